@@ -0,0 +1,181 @@
+/// ThreadBench.cpp ////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////
+//
+// Measures how reads of a CDataFile scale with the number of reader
+// threads, while a single writer keeps changing values in the background.
+// Reads go through the shared lock (SetThreadSafe), through lock-free
+// snapshots (EnableSnapshots) or through the thread-local caches of hot keys
+// (CHotKey). Build with 'make bench' and run
+// test/cdfBench.out; the optional arguments are the milliseconds to run each
+// step (default 500), the largest number of reader threads (default 64) and
+// the milliseconds between writes (default 1). Every write invalidates all
+// of the cached values, so the caches only pay off when writes are rare.
+////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#include "CDataFile.h"
+
+const int SECTIONS = 64;
+const int KEYS     = 32;
+
+// The ways of reading.
+enum e_Mode { MODE_LOCKED = 0, MODE_SNAPSHOT, MODE_CACHED, MODES };
+const char* ModeNames[MODES] = { "Locked", "Snapshot", "Cached" };
+
+// Fill
+// Builds the data the benchmark reads from.
+static void Fill(cdf::CDataFile &DF)
+{
+	char szSection[32];
+	char szKey[32];
+
+	for (int s = 0; s < SECTIONS; s++)
+	{
+		snprintf(szSection, sizeof(szSection), "section%d", s);
+
+		for (int k = 0; k < KEYS; k++)
+		{
+			snprintf(szKey, sizeof(szKey), "key%d", k);
+			DF.SetInt(szKey, s * KEYS + k, "", szSection);
+		}
+	}
+}
+
+// Reader
+// Reads random keys until told to stop, counting the reads.
+static void Reader(cdf::CDataFile* pDF, int nMode, std::atomic<bool>* pRun, long long* pReads, unsigned nSeed)
+{
+	std::vector<cdf::t_Str> Sections(SECTIONS);
+	std::vector<cdf::t_Str> Keys(KEYS);
+	static std::vector<cdf::CHotKey> HotKeys;
+	static std::once_flag HotKeysMade;
+	char szName[32];
+	long long nReads = 0;
+	int nValue;
+
+	for (int s = 0; s < SECTIONS; s++)
+	{
+		snprintf(szName, sizeof(szName), "section%d", s);
+		Sections[s] = szName;
+	}
+
+	for (int k = 0; k < KEYS; k++)
+	{
+		snprintf(szName, sizeof(szName), "key%d", k);
+		Keys[k] = szName;
+	}
+
+	std::call_once(HotKeysMade, [&]
+	{
+		for (int i = 0; i < SECTIONS * KEYS; i++)
+			HotKeys.push_back(cdf::CHotKey(Keys[i % KEYS], Sections[i / KEYS]));
+	});
+
+	while ( pRun->load(std::memory_order_relaxed) )
+	{
+		nSeed = nSeed * 1103515245 + 12345;
+
+		int nKey = (nSeed >> 8) % KEYS;
+		int nSection = (nSeed >> 16) % SECTIONS;
+
+		if ( nMode == MODE_SNAPSHOT )
+		{
+			cdf::CSnapshot Snapshot(*pDF);
+			Snapshot.GetInt(Keys[nKey], Sections[nSection], nValue);
+		}
+		else
+		if ( nMode == MODE_CACHED )
+			pDF->GetInt(HotKeys[nSection * KEYS + nKey], nValue);
+		else
+			pDF->GetInt(Keys[nKey], Sections[nSection], nValue);
+
+		nReads++;
+	}
+
+	*pReads = nReads;
+}
+
+// Writer
+// Changes a value every nInterval milliseconds until told to stop.
+static void Writer(cdf::CDataFile* pDF, int nInterval, std::atomic<bool>* pRun, long long* pWrites)
+{
+	long long nWrites = 0;
+
+	while ( pRun->load(std::memory_order_relaxed) )
+	{
+		pDF->SetInt("key0", (int)nWrites, "", "section0");
+		nWrites++;
+		std::this_thread::sleep_for(std::chrono::milliseconds(nInterval));
+	}
+
+	*pWrites = nWrites;
+}
+
+// RunStep
+// Runs nThreads readers and the writer for nMillis, and prints the results.
+static void RunStep(cdf::CDataFile &DF, int nMode, int nThreads, int nMillis, int nInterval)
+{
+	std::atomic<bool> bRun(true);
+	std::vector<long long> Reads(nThreads, 0);
+	std::vector<std::thread> Threads;
+	long long nWrites = 0;
+
+	std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+
+	for (int t = 0; t < nThreads; t++)
+		Threads.push_back(std::thread(Reader, &DF, nMode, &bRun, &Reads[t], (unsigned)t * 7919 + 1));
+
+	std::thread WriterThread(Writer, &DF, nInterval, &bRun, &nWrites);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(nMillis));
+	bRun = false;
+
+	for (int t = 0; t < nThreads; t++)
+		Threads[t].join();
+	WriterThread.join();
+
+	double fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+	long long nTotal = 0;
+
+	for (int t = 0; t < nThreads; t++)
+		nTotal += Reads[t];
+
+	printf("%8d %16.0f %16.0f %12.1f %10lld\n", nThreads, nTotal / fSeconds, nTotal / fSeconds / nThreads,
+		fSeconds * 1e9 * nThreads / (nTotal ? nTotal : 1), nWrites);
+}
+
+int main(int argc, char** argv)
+{
+	int nMillis = argc > 1 ? atoi(argv[1]) : 500;
+	int nMaxThreads = argc > 2 ? atoi(argv[2]) : 64;
+	int nInterval = argc > 3 ? atoi(argv[3]) : 1;
+
+	cdf::CDataFile DF;
+	Fill(DF);
+	DF.SetDirty(false);
+	DF.SetThreadSafe(true);
+	DF.EnableSnapshots();
+
+	printf("%d sections of %d keys, %d ms per step, a write every %d ms, %u hardware threads\n",
+		SECTIONS, KEYS, nMillis, nInterval, std::thread::hardware_concurrency());
+
+	for (int nMode = 0; nMode < MODES; nMode++)
+	{
+		printf("\n%s reads\n", ModeNames[nMode]);
+		printf("%8s %16s %16s %12s %10s\n", "readers", "reads/s", "reads/s/thread", "ns/read", "writes");
+
+		for (int nThreads = 1; nThreads <= nMaxThreads; nThreads *= 2)
+			RunStep(DF, nMode, nThreads, nMillis, nInterval);
+	}
+
+	DF.SetDirty(false);
+
+	return 0;
+}
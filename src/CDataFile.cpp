@@ -45,9 +45,25 @@
 #include <string.h> // memset
 #include <fstream>
 #include <sstream>
+#include <map>
+#include <unordered_set>
+#include <algorithm>
+#include <functional>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #if defined(WIN32)
 	#include <windows.h>
+#else
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <limits.h>
+	#include <unistd.h>
+	#include <sys/uio.h>
+#endif
+
+#if defined(__linux__)
+	#include <sys/xattr.h>
 #endif
 
 #include "CDataFile.h"
@@ -60,363 +76,3766 @@ using namespace cdf;
 	#define vsnprintf _vsnprintf
 #endif
 
+// CREATE_ALL
+// The create policy for data that is read in (from the file or the
+// journal): every key and section is created as needed.
+static const long CREATE_ALL = AUTOCREATE_SECTIONS | AUTOCREATE_KEYS;
 
-// CDataFile
-// Our default contstructor.  If it can load the file, it will do so and populate
-// the section list with the values from the file.
-cdf::CDataFile::CDataFile(const t_Str &szFileName)
+
+// Journal Records //////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////
+// The change journal holds one line per change: an operation code (V set
+// value, K key comment, S section comment, C create section, X delete key,
+// D delete section) followed by its tab separated arguments. Changes
+// committed together are preceded by a T record holding their number, so
+// that a crash in the middle of writing them loses all of them.
+
+// JournalField
+// Appends a field to a journal record. Fields are separated by tabs, so
+// tabs, line breaks and backslashes in the data are escaped.
+static void JournalField(t_Str &szRecord, const t_Str &szField)
 {
-	m_szFileName = szFileName;
-	m_Flags = (AUTOCREATE_SECTIONS | AUTOCREATE_KEYS);
-	m_Sections.push_back( *(new t_Section) );
+	szRecord += '\t';
 
-	Load(m_szFileName);
-	m_bDirty = false;
+	for (size_t i = 0; i < szField.size(); i++)
+	{
+		switch ( szField[i] )
+		{
+			case '\\': szRecord += "\\\\"; break;
+			case '\t': szRecord += "\\t"; break;
+			case '\n': szRecord += "\\n"; break;
+			case '\r': szRecord += "\\r"; break;
+			default:   szRecord += szField[i]; break;
+		}
+	}
 }
 
-cdf::CDataFile::CDataFile()
+// JournalRecord
+// Builds a journal record: an operation code followed by its arguments.
+static t_Str JournalRecord(const char* szOp, const t_Str &szArg1)
 {
-	Clear();
-	m_Flags = (AUTOCREATE_SECTIONS | AUTOCREATE_KEYS);
-	m_Sections.push_back( *(new t_Section) );
-}
+	t_Str szRecord = szOp;
 
-// ~CDataFile
-// Saves the file if any values have changed since the last save.
-cdf::CDataFile::~CDataFile()
-{
-	if ( m_bDirty )
-		Save();
-}
+	JournalField(szRecord, szArg1);
 
-// Clear
-// Resets the member variables to their defaults
-void cdf::CDataFile::Clear()
-{
-	m_bDirty = false;
-	m_szFileName = t_Str("");
-	m_Sections.clear();
+	return szRecord + "\n";
 }
 
-// SetDirty
-// Sets the 'dirty' flag to mark the data as changed or not
-void cdf::CDataFile::SetDirty(bool dirty)
+static t_Str JournalRecord(const char* szOp, const t_Str &szArg1, const t_Str &szArg2)
 {
-	m_bDirty = dirty;
-}
+	t_Str szRecord = szOp;
 
-// IsDirty
-// Obtains the 'dirty' flag showing the data is changed or not
-bool cdf::CDataFile::IsDirty() const
-{
-	return m_bDirty;
-}
+	JournalField(szRecord, szArg1);
+	JournalField(szRecord, szArg2);
 
+	return szRecord + "\n";
+}
 
-// SetFileName
-// Set's the m_szFileName member variable. For use when creating the CDataFile
-// object by hand (-vs- loading it from a file
-void cdf::CDataFile::SetFileName(const t_Str &szFileName)
+static t_Str JournalRecord(const char* szOp, const t_Str &szArg1, const t_Str &szArg2,
+	const t_Str &szArg3)
 {
-	if (m_szFileName.size() != 0 && CompareNoCase(szFileName, m_szFileName) != 0)
-	{
-		m_bDirty = true;
+	t_Str szRecord = szOp;
 
-		Report(E_WARN, "[CDataFile::SetFileName] The filename has changed from <%s> to <%s>.",
-			m_szFileName.c_str(), szFileName.c_str());
-	}
+	JournalField(szRecord, szArg1);
+	JournalField(szRecord, szArg2);
+	JournalField(szRecord, szArg3);
 
-	m_szFileName = szFileName;
+	return szRecord + "\n";
 }
 
-// Load
-// Attempts to load in the text file. If successful it will populate the
-// Section list with the key/value pairs found in the file. Note that comments
-// are saved so that they can be rewritten to the file later.
-bool cdf::CDataFile::Load(const t_Str& szFileName)
+static t_Str JournalRecord(const char* szOp, const t_Str &szArg1, const t_Str &szArg2,
+	const t_Str &szArg3, const t_Str &szArg4)
 {
-	// We dont want to create a new file here.  If it doesn't exist, just
-	// return false and report the failure.
-	std::ifstream File(szFileName.c_str());
-	if ( ! File.is_open() )
-	{
-		Report(E_INFO, "[CDataFile::Load] Unable to open file. Does it exist?");
-		return false;
-	}
+	t_Str szRecord = szOp;
 
-	bool bDone = false;
-	bool bAutoKey = (m_Flags & AUTOCREATE_KEYS) == AUTOCREATE_KEYS;
-	bool bAutoSec = (m_Flags & AUTOCREATE_SECTIONS) == AUTOCREATE_SECTIONS;
+	JournalField(szRecord, szArg1);
+	JournalField(szRecord, szArg2);
+	JournalField(szRecord, szArg3);
+	JournalField(szRecord, szArg4);
 
-	t_Str szLine;
-	t_Str szComment;
-	char buffer[MAX_BUFFER_LEN];
-	t_Section* pSection = GetSection("");
+	return szRecord + "\n";
+}
 
-	// These need to be set, we'll restore the original values later.
-	m_Flags |= AUTOCREATE_KEYS;
-	m_Flags |= AUTOCREATE_SECTIONS;
+// SplitRecord
+// Splits a journal record back into its (unescaped) fields.
+static void SplitRecord(const t_Str &szRecord, std::vector<t_Str> &Fields)
+{
+	Fields.clear();
+	Fields.push_back(t_Str(""));
 
-	while ( !bDone )
+	for (size_t i = 0; i < szRecord.size(); i++)
 	{
-		memset(buffer, 0, MAX_BUFFER_LEN);
-		File.getline(buffer, MAX_BUFFER_LEN);
-
-		szLine = buffer;
-		Trim(szLine);
-
-		bDone = ( File.eof() || File.bad() || File.fail() );
+		char c = szRecord[i];
 
-		if ( szLine.find_first_of(CommentIndicators) == 0 )
-		{
-			szComment += "\n";
-			szComment += szLine;
-		}
+		if ( c == '\t' )
+			Fields.push_back(t_Str(""));
 		else
-		if ( szLine.find_first_of('[') == 0 ) // new section
+		if ( c == '\\' && i + 1 < szRecord.size() )
 		{
-			szLine.erase( 0, 1 );
-			szLine.erase( szLine.find_last_of(']'), 1 );
-
-			CreateSection(szLine, szComment);
-			pSection = GetSection(szLine);
-			szComment = t_Str("");
+			c = szRecord[++i];
+			Fields.back() += c == 't' ? '\t' : c == 'n' ? '\n' : c == 'r' ? '\r' : c;
 		}
 		else
-		if ( szLine.size() > 0 ) // we have a key, add this key/value pair
-		{
-			t_Str szKey = GetNextWord(szLine);
-			t_Str szValue = szLine;
-
-			if ( szKey.size() > 0 )
-			{
-				SetValue(szKey, szValue, szComment, pSection->szName);
-				szComment = t_Str("");
-			}
-		}
+			Fields.back() += c;
 	}
+}
 
-	// Restore the original flag values.
-	if ( !bAutoKey )
-		m_Flags &= ~AUTOCREATE_KEYS;
 
-	if ( !bAutoSec )
-		m_Flags &= ~AUTOCREATE_SECTIONS;
+// Value Conversions ////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////
+// Shared by CDataFile and CSnapshot.
 
-	File.close();
+// ToFloat
+// Converts a value to a float. Returns false if it is not a number.
+static bool ToFloat(const t_Str &szValue, float &ret)
+{
+	float x;
+	if( (std::istringstream(szValue) >> x).fail() )
+		return false;
 
+	ret = x;
 	return true;
 }
 
-
-// Save
-// Attempts to save the Section list and keys to the file. Note that if Load
-// was never called (the CDataFile object was created manually), then you
-// must set the m_szFileName variable before calling save.
-bool cdf::CDataFile::Save()
+// ToInt
+// Converts a value to an int. Returns false if it is not a number.
+static bool ToInt(const t_Str &szValue, int &ret)
 {
-	if ( KeyCount() == 0 && SectionCount() == 0 )
-	{
-		// no point in saving
-		Report(E_INFO, "[CDataFile::Save] Nothing to save.");
+	int n;
+	if( (std::istringstream(szValue) >> n).fail() )
 		return false;
+
+	ret = n;
+	return true;
+}
+
+// ToBool
+// Converts a value to a bool: "1...", "true" and "yes" are true, anything
+// else is false.
+static bool ToBool(const t_Str &szValue, bool &ret)
+{
+	ret = false;
+	if ( szValue.find("1") == 0
+		|| CompareNoCase(szValue, "true") == 0
+		|| CompareNoCase(szValue, "yes") == 0 ) {
+		ret = true;
 	}
 
-	if ( m_szFileName.size() == 0 )
+	return true;
+}
+
+
+// Snapshot Epochs //////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////
+// Replaced snapshots are freed by epoch based reclamation. Each thread that
+// reads snapshots owns a record, on a cache line of its own, in which it
+// posts the global epoch while it reads (and 0 otherwise). A snapshot that
+// is replaced is stamped with the epoch current at the time, and the epoch
+// moves on; it is freed once every posted epoch is past its stamp, because
+// a reader that posted a later epoch must have found the new snapshot.
+
+// st_epochrecord
+// A reader thread's posted epoch. Records are never freed; a thread that
+// exits leaves its record for the next one.
+typedef struct alignas(64) st_epochrecord
+{
+	std::atomic<unsigned long long> nEpoch;
+	std::atomic<bool>               bInUse;
+	struct st_epochrecord*          pNext;
+} t_EpochRecord;
+
+static std::atomic<unsigned long long> s_nEpoch(1);
+static std::atomic<t_EpochRecord*>     s_pEpochRecords(NULL);
+
+// CEpochThread
+// The calling thread's epoch record, claimed on first use and given back
+// when the thread exits, and how deeply it is nested in CSnapshots.
+class CEpochThread
+{
+public:
+	CEpochThread()
 	{
-		Report(E_ERROR, "[CDataFile::Save] No filename has been set.");
-		return false;
+		m_pRecord = NULL;
+		m_nDepth = 0;
 	}
 
-	std::ofstream File(m_szFileName.c_str(), std::ios::out|std::ios::trunc);
-	if ( ! File.is_open() )
+	~CEpochThread()
 	{
-		Report(E_ERROR, "[CDataFile::Save] Unable to save file.");
-		return false;
+		if ( m_pRecord )
+			m_pRecord->bInUse.store(false, std::memory_order_release);
 	}
 
-	SectionItor s_pos;
-	KeyItor k_pos;
-	t_Section Section;
-	t_Key Key;
-
-	for (s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+	t_EpochRecord* Record()
 	{
-		Section = (*s_pos);
-		bool bWroteComment = false;
+		if ( m_pRecord )
+			return m_pRecord;
 
-		if ( Section.szComment.size() > 0 )
+		// Reuse a record given back by a thread that has exited...
+		for (t_EpochRecord* pRecord = s_pEpochRecords.load(); pRecord; pRecord = pRecord->pNext)
 		{
-			bWroteComment = true;
-			WriteLn(File, "\n%s", CommentStr(Section.szComment).c_str());
+			bool bFree = false;
+			if ( pRecord->bInUse.compare_exchange_strong(bFree, true) )
+				return m_pRecord = pRecord;
 		}
 
-		if ( Section.szName.size() > 0 )
-		{
-			WriteLn(File, "%s[%s]",
-					bWroteComment ? "" : "\n",
-					Section.szName.c_str());
-		}
+		// ...or add a new one.
+		t_EpochRecord* pRecord = new t_EpochRecord;
+		pRecord->nEpoch = 0;
+		pRecord->bInUse = true;
+		pRecord->pNext = s_pEpochRecords.load();
 
-		for (k_pos = Section.Keys.begin(); k_pos != Section.Keys.end(); k_pos++)
-		{
-			Key = (*k_pos);
+		while ( !s_pEpochRecords.compare_exchange_weak(pRecord->pNext, pRecord) )
+			;
 
-			if ( Key.szKey.size() > 0 )
-			{
-				WriteLn(File, "%s%s%s%s%c%s",
-					Key.szComment.size() > 0 ? "\n" : "",
-					CommentStr(Key.szComment).c_str(),
-					Key.szComment.size() > 0 ? "\n" : "",
-					Key.szKey.c_str(),
-					EqualIndicators[0],
-					Key.szValue.c_str());
-			}
-		}
+		return m_pRecord = pRecord;
 	}
 
-	m_bDirty = false;
-
-	File.flush();
-	File.close();
+	t_EpochRecord* m_pRecord;
+	int            m_nDepth;
+};
 
-	return true;
+// EpochThread
+// The calling thread's CEpochThread.
+static CEpochThread& EpochThread()
+{
+	static thread_local CEpochThread Thread;
+	return Thread;
 }
 
-// SetKeyComment
-// Set the comment of a given key. Returns true if the key is not found.
-bool cdf::CDataFile::SetKeyComment(const t_Str &szKey, const t_Str &szComment, const t_Str &szSection)
+// EnterEpoch
+// Posts the current epoch for the calling thread, before it loads a snapshot.
+static void EnterEpoch()
 {
-	KeyItor k_pos;
-	t_Section* pSection;
+	CEpochThread &Thread = EpochThread();
 
-	if ( (pSection = GetSection(szSection)) == NULL )
-		return false;
+	if ( Thread.m_nDepth++ == 0 )
+		Thread.Record()->nEpoch.store(s_nEpoch.load());
+}
 
-	for (k_pos = pSection->Keys.begin(); k_pos != pSection->Keys.end(); k_pos++)
-	{
-		if ( CompareNoCase( (*k_pos).szKey, szKey ) == 0 )
-		{
-			(*k_pos).szComment = szComment;
-			m_bDirty = true;
-			return true;
-		}
-	}
+// LeaveEpoch
+// Withdraws the calling thread's posted epoch, once it is done reading.
+static void LeaveEpoch()
+{
+	CEpochThread &Thread = EpochThread();
 
-	return false;
+	if ( --Thread.m_nDepth == 0 )
+		Thread.m_pRecord->nEpoch.store(0, std::memory_order_release);
 }
 
-// SetSectionComment
-// Set the comment for a given section. Returns false if the section
-// was not found.
-bool cdf::CDataFile::SetSectionComment(const t_Str &szSection, const t_Str &szComment)
+// OldestEpoch
+// Returns the oldest epoch posted by a reader, or the current one if none is
+// reading.
+static unsigned long long OldestEpoch()
 {
-	SectionItor s_pos;
+	unsigned long long nOldest = s_nEpoch.load();
 
-	for (s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+	for (t_EpochRecord* pRecord = s_pEpochRecords.load(); pRecord; pRecord = pRecord->pNext)
 	{
-		if ( CompareNoCase( (*s_pos).szName, szSection ) == 0 )
-		{
-			(*s_pos).szComment = szComment;
-			m_bDirty = true;
-			return true;
-		}
+		unsigned long long nEpoch = pRecord->nEpoch.load();
+
+		if ( nEpoch != 0 && nEpoch < nOldest )
+			nOldest = nEpoch;
 	}
 
-	return false;
+	return nOldest;
 }
 
-
-// SetValue
-// Given a key, a value and a section, this function will attempt to locate the
-// Key within the given section, and if it finds it, change the keys value to
-// the new value. If it does not locate the key, it will create a new key with
-// the proper value and place it in the section requested.
-bool cdf::CDataFile::SetValue(const t_Str &szKey, const t_Str &szValue, const t_Str &szComment, const t_Str &szSection)
+// Read Caches //////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////
+// Every thread keeps the values it read through CHotKeys in a table of its
+// own, indexed by the id of the key. A value is good for as long as the data
+// file it came from keeps the version it had when the value was read.
+// Versions only ever grow, and every object gets a serial number of its own,
+// so an object that takes the place of one that was destroyed can not be
+// mistaken for it. Ids are reused, so that the tables only grow as large as
+// the most keys there were at one time, and at most to MAX_HOT_KEYS; keys
+// get serial numbers too.
+
+// CACHED_*
+// The conversions of a cached value that have been done.
+static const int CACHED_FLOAT = (1<<0);
+static const int CACHED_INT   = (1<<1);
+static const int CACHED_BOOL  = (1<<2);
+
+static std::atomic<unsigned long long> s_nSerials(1);
+
+// st_hotkeyids
+// The ids of CHotKeys: how many were ever given, and those given back.
+typedef struct st_hotkeyids
 {
-	t_Key* pKey = GetKey(szKey, szSection);
-	t_Section* pSection = GetSection(szSection);
+	std::mutex       Mutex;
+	int              nGiven;
+	std::vector<int> Free;
 
-	if (pSection == NULL)
+	st_hotkeyids()
 	{
-		if ( !(m_Flags & AUTOCREATE_SECTIONS) || !CreateSection(szSection,""))
-			return false;
-
-		pSection = GetSection(szSection);
+		nGiven = 0;
 	}
 
-	// Sanity check...
-	if ( pSection == NULL )
-		return false;
+} t_HotKeyIds;
 
-	// if the key does not exist in that section then add the new key.
-	if ( pKey == NULL && (m_Flags & AUTOCREATE_KEYS))
-	{
-		pKey = new t_Key;
+// HotKeyIds
+// Made on first use, so that it outlives every CHotKey, statics included.
+static t_HotKeyIds& HotKeyIds()
+{
+	static t_HotKeyIds Ids;
+	return Ids;
+}
 
-		pKey->szKey = szKey;
-		pKey->szValue = szValue;
-		pKey->szComment = szComment;
+// CachedValues
+// The calling thread's cache.
+static std::vector<t_CachedValue>& CachedValues()
+{
+	static thread_local std::vector<t_CachedValue> Values;
+	return Values;
+}
 
-		m_bDirty = true;
+// CHotKey
+// Names the key, and takes an id for it.
+cdf::CHotKey::CHotKey(const t_Str &szKey, const t_Str &szSection)
+{
+	TakeId();
+	m_szKey = szKey;
+	m_szSection = szSection;
+}
 
-		pSection->Keys.push_back(*pKey);
+// CHotKey
+// Names the same key as Other, under an id of its own.
+cdf::CHotKey::CHotKey(const CHotKey &Other)
+{
+	TakeId();
+	m_szKey = Other.m_szKey;
+	m_szSection = Other.m_szSection;
+}
 
-		return true;
-	}
+// operator=
+// Names the same key as Other. The id is kept, but with a new serial
+// number, so that what the threads cached for the old key is not used.
+cdf::CHotKey& cdf::CHotKey::operator=(const CHotKey &Other)
+{
+	m_nSerial = s_nSerials.fetch_add(1);
+	m_szKey = Other.m_szKey;
+	m_szSection = Other.m_szSection;
 
-	if ( pKey != NULL )
-	{
-		pKey->szValue = szValue;
-		pKey->szComment = szComment;
+	return *this;
+}
 
-		m_bDirty = true;
+// TakeId
+// Takes an id that was given back, or the next one if there is none and we
+// are not past MAX_HOT_KEYS.
+void cdf::CHotKey::TakeId()
+{
+	t_HotKeyIds &Ids = HotKeyIds();
 
-		return true;
+	{
+		std::lock_guard<std::mutex> Lock(Ids.Mutex);
+
+		if ( Ids.Free.size() > 0 )
+		{
+			m_nId = Ids.Free.back();
+			Ids.Free.pop_back();
+		}
+		else
+			m_nId = Ids.nGiven < MAX_HOT_KEYS ? Ids.nGiven++ : -1;
 	}
 
-	return false;
+	m_nSerial = s_nSerials.fetch_add(1);
 }
 
-// SetFloat
-// Passes the given float to SetValue as a string
-bool cdf::CDataFile::SetFloat(const t_Str &szKey, float fValue, const t_Str &szComment, const t_Str &szSection)
+// ~CHotKey
+// Gives the id back.
+cdf::CHotKey::~CHotKey()
 {
-	char szStr[64];
+	if ( m_nId < 0 )
+		return;
 
-	snprintf(szStr, 64, "%g", fValue);
+	t_HotKeyIds &Ids = HotKeyIds();
+	std::lock_guard<std::mutex> Lock(Ids.Mutex);
 
-	return SetValue(szKey, szStr, szComment, szSection);
+	Ids.Free.push_back(m_nId);
 }
 
-// SetInt
-// Passes the given int to SetValue as a string
-bool cdf::CDataFile::SetInt(const t_Str &szKey, int nValue, t_Str szComment, t_Str szSection)
-{
-	char szStr[64];
 
-	snprintf(szStr, 64, "%d", nValue);
+// Init
+// Gives every member its default. The constructors call it before anything
+// else, since Clear() and Load() rely on the members they do not set.
+void cdf::CDataFile::Init()
+{
+	m_Flags = (AUTOCREATE_SECTIONS | AUTOCREATE_KEYS);
+	m_szFileName = t_Str("");
+	m_bDirty = false;
+	m_nVersion = 0;
+	m_nSerial = s_nSerials.fetch_add(1);
+	m_bSpansValid = false;
+	m_bSourceValid = false;
+	m_bIncludes = false;
+	m_nSubscriptions = 0;
+	m_bExpanding = false;
+	m_nExpandEpoch = 0;
+	m_bThreadSafe = false;
+	m_nWriteDepth = 0;
+	m_bWasDirty = false;
+	m_nAnnounced = 0;
+	m_pSnapshot = NULL;
+	m_pRetired = NULL;
+	m_bUnpublished = false;
+	m_bPersistRun = false;
+	m_PersistInterval = std::chrono::milliseconds(0);
+	m_PersistPolicy = PERSIST_ON_DESTROY;
+	m_pQueueHead = NULL;
+	m_pQueueTail = NULL;
+	m_nTickets = 0;
+	m_nApplied = 0;
+	m_nFailed = 0;
+	m_nLastFailed = 0;
+	m_nQueueing = 0;
+	m_bQueueRun = false;
+	m_bApplierIdle = false;
+	m_bWatchRun = false;
+	m_nWatchDebounce = 0;
+	m_pWatch = NULL;
+	m_pJournal = NULL;
+	m_nJournalSize = 0;
+	m_nJournalMax = 0;
+	m_nJournalBatch = 0;
+	m_bJournalReplayed = false;
+	m_nSaveThreads = 1;
+}
+
+// CDataFile
+// Our default contstructor.  If it can load the file, it will do so and populate
+// the section list with the values from the file.
+cdf::CDataFile::CDataFile(const t_Str &szFileName)
+{
+	Init();
+	m_szFileName = szFileName;
+	m_Sections.push_back( *(new t_Section) );
+
+	Load(m_szFileName);
+	m_bDirty = false;
+}
+
+cdf::CDataFile::CDataFile()
+{
+	Init();
+	Clear();
+	m_Sections.push_back( *(new t_Section) );
+}
+
+// ~CDataFile
+// Deals with any values that have changed since the last save, as the
+// persist policy says: saves the file, hands the data over to be saved in
+// the background, or drops the changes.
+cdf::CDataFile::~CDataFile()
+{
+	StopWatcher();
+	StopMutationQueue();
+	DisableSnapshots();
+
+	// Everything in the journal is allready safe.
+	if ( m_pJournal )
+	{
+		fclose(m_pJournal);
+		m_pJournal = NULL;
+		SetDirty(false);
+	}
+
+	if ( m_PersistPolicy == PERSIST_HANDOFF )
+		HandOff();
+	else
+	if ( m_PersistPolicy == PERSIST_NEVER )
+		SetDirty(false);
+
+	StopPersister();
+
+	if ( m_bDirty )
+		Save();
+
+	delete m_pQueueHead;
+
+	for (std::map<t_Str, CSlot*>::iterator i = m_Slots.begin(); i != m_Slots.end(); i++)
+		delete i->second;
+}
+
+// Clear
+// Resets the member variables to their defaults
+void cdf::CDataFile::Clear()
+{
+	CWriteLock Lock(this);
+	m_nVersion.fetch_add(1, std::memory_order_relaxed);
+	m_bUnpublished = true;
+	m_bDirty = false;
+	m_bSpansValid = false;
+	m_bSourceValid = false;
+	m_bIncludes = false;
+	DetachJournal();
+	m_szFileName = t_Str("");
+	m_szSource = t_Str("");
+	ForgetExpansions();
+
+	if ( !m_Subscriptions.empty() )
+	{
+		for (SectionItor s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+			Notify(CHANGE_REMOVED, (*s_pos).szName, t_Str(""), t_Str(""), t_Str(""));
+	}
+
+	m_Sections.clear();
+	SyncSlots();
+}
+
+// SetDirty
+// Sets the 'dirty' flag to mark the data as changed or not
+void cdf::CDataFile::SetDirty(bool dirty)
+{
+	std::lock_guard<CSharedMutex> Lock(m_Mutex);
+
+	if ( dirty )
+		Touch(NULL);
+	else
+		m_bDirty = false;
+}
+
+// IsDirty
+// Obtains the 'dirty' flag showing the data is changed or not
+bool cdf::CDataFile::IsDirty() const
+{
+	std::shared_lock<CSharedMutex> Lock(m_Mutex);
+
+	return m_bDirty;
+}
+
+// StartPersister
+// Starts the background persister. While it runs, changes are saved by the
+// worker thread instead of the caller: the first change after a save wakes
+// it up, and it then waits until nIntervalMs have passed since the previous
+// save, picking up any further changes made in the meantime.
+bool cdf::CDataFile::StartPersister(int nIntervalMs)
+{
+	std::lock_guard<CSharedMutex> Lock(m_Mutex);
+
+	if ( m_bPersistRun )
+	{
+		Report(E_INFO, "[CDataFile::StartPersister] The persister is allready running.");
+		return false;
+	}
+
+	if ( m_szFileName.size() == 0 )
+	{
+		Report(E_ERROR, "[CDataFile::StartPersister] No filename has been set.");
+		return false;
+	}
+
+	m_PersistInterval = std::chrono::milliseconds(nIntervalMs > 0 ? nIntervalMs : 0);
+	m_bPersistRun = true;
+	m_Persister = std::thread(&CDataFile::PersistLoop, this);
+
+	return true;
+}
+
+// StopPersister
+// Stops the background persister and waits for it to finish. Pending changes
+// are saved before the thread exits.
+void cdf::CDataFile::StopPersister()
+{
+	{
+		std::lock_guard<CSharedMutex> Lock(m_Mutex);
+
+		if ( !m_bPersistRun )
+			return;
+
+		m_bPersistRun = false;
+		m_PersistCond.notify_all();
+	}
+
+	m_Persister.join();
+}
+
+// Flush
+// Saves any pending changes now, on the calling thread. Returns true if
+// there was nothing to save or the save succeeded.
+bool cdf::CDataFile::Flush()
+{
+	std::lock_guard<CSharedMutex> Lock(m_Mutex);
+
+	if ( !m_bDirty )
+		return true;
+
+	return Save();
+}
+
+// SetPersistPolicy
+// Sets what the destructor does with changes that have not been saved.
+void cdf::CDataFile::SetPersistPolicy(e_PersistPolicy Policy)
+{
+	std::lock_guard<CSharedMutex> Lock(m_Mutex);
+
+	m_PersistPolicy = Policy;
+}
+
+// GetPersistPolicy
+// Obtains what the destructor does with changes that have not been saved.
+e_PersistPolicy cdf::CDataFile::GetPersistPolicy() const
+{
+	std::shared_lock<CSharedMutex> Lock(m_Mutex);
+
+	return m_PersistPolicy;
+}
+
+// SetSaveThreads
+// Sets how many threads Save() may use to render the file. The output is
+// the same whatever the number; only files with many sections are split.
+void cdf::CDataFile::SetSaveThreads(int nThreads)
+{
+	std::lock_guard<CSharedMutex> Lock(m_Mutex);
+
+	m_nSaveThreads = nThreads > 1 ? nThreads : 1;
+}
+
+// SetThreadSafe
+// Turns shared locking of the readers on or off. The writers always lock.
+void cdf::CDataFile::SetThreadSafe(bool bThreadSafe)
+{
+	std::lock_guard<CSharedMutex> Lock(m_Mutex);
+
+	m_bThreadSafe = bThreadSafe;
+}
+
+// SetSectionLocking
+// Turns section-locking mode on or off.
+void cdf::CDataFile::SetSectionLocking(bool bEnable)
+{
+	CWriteLock Lock(this);
+
+	if ( bEnable && !m_pStripes )
+		m_pStripes.reset(new t_Stripe[SECTION_STRIPES]);
+	else
+	if ( !bEnable )
+		m_pStripes.reset();
+
+	if ( bEnable )
+		m_bThreadSafe = true;
+}
+
+// EnableSnapshots
+// Starts publishing snapshots for CSnapshot readers, beginning with one of
+// the data as it is now.
+void cdf::CDataFile::EnableSnapshots()
+{
+	CWriteLock Lock(this);
+
+	if ( m_pSnapshot.load() == NULL )
+		Publish();
+}
+
+// DisableSnapshots
+// Stops publishing snapshots, and waits until no reader uses any of them
+// before freeing them.
+void cdf::CDataFile::DisableSnapshots()
+{
+	std::lock_guard<CSharedMutex> Lock(m_Mutex);
+	t_Snapshot* pSnapshot = m_pSnapshot.exchange(NULL);
+
+	if ( pSnapshot == NULL )
+		return;
+
+	pSnapshot->nRetired = s_nEpoch.fetch_add(1);
+	pSnapshot->pNext = m_pRetired;
+	m_pRetired = pSnapshot;
+
+	while ( m_pRetired )
+	{
+		Reclaim();
+
+		if ( m_pRetired )
+			std::this_thread::yield();
+	}
+
+	for (SectionItor s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+		(*s_pos).pPublished.reset();
+}
+
+// Commit
+// Called when the outermost CWriteLock is released, so once for a whole
+// group of changes made under it: writes their journal records with a
+// single write, wakes the persister if they made the data dirty, and
+// publishes a new snapshot of them.
+void cdf::CDataFile::Commit()
+{
+	if ( m_nJournalBatch > 0 )
+		Journal(TakeJournalBatch());
+
+	if ( m_bDirty && !m_bWasDirty && m_bPersistRun )
+		m_PersistCond.notify_one();
+
+	if ( m_bUnpublished && m_pSnapshot.load(std::memory_order_relaxed) )
+		Publish();
+}
+
+// Apply
+// Makes the changes of a transaction in order, under one write lock, so
+// that they are committed as one. Each section is saved before it is first
+// changed. If a change fails, the saved sections are put back, and so are
+// the dirty flag, the journal records and the changes waiting for the
+// subscribers, which leaves nothing to commit.
+bool cdf::CDataFile::Apply(const std::vector<t_Operation> &Operations)
+{
+	CWriteLock Lock(this);
+
+	std::vector<t_Undo> Undo;
+	bool bDirty = m_bDirty;
+	size_t nJournal = m_szJournalBatch.size();
+	int nJournalBatch = m_nJournalBatch;
+	size_t nNotices = m_Notices.size();
+
+	for (size_t i = 0; i < Operations.size(); i++)
+	{
+		const t_Operation &Operation = Operations[i];
+		bool bDone = false;
+
+		Remember(Operation.szSection, Undo);
+
+		switch ( Operation.Op )
+		{
+		case OP_SET_VALUE:
+			bDone = SetValue(Operation.szKey, Operation.szValue, Operation.szComment, Operation.szSection);
+			break;
+		case OP_CREATE_KEY:
+			bDone = CreateKey(Operation.szKey, Operation.szValue, Operation.szComment, Operation.szSection);
+			break;
+		case OP_DELETE_KEY:
+			bDone = DeleteKey(Operation.szKey, Operation.szSection);
+			break;
+		case OP_CREATE_SECTION:
+			bDone = CreateSection(Operation.szSection, Operation.szComment);
+			break;
+		case OP_DELETE_SECTION:
+			bDone = DeleteSection(Operation.szSection);
+			if ( bDone )
+				Undo.back().bDeleted = true;
+			break;
+		}
+
+		if ( !bDone )
+		{
+			Report(E_INFO, "[CDataFile::Apply] Change %d of %d failed. Rolling back.",
+				(int)i + 1, (int)Operations.size());
+
+			Rollback(Undo);
+			m_bDirty = bDirty;
+			m_szJournalBatch.resize(nJournal);
+			m_nJournalBatch = nJournalBatch;
+			m_Notices.resize(nNotices);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Remember
+// Saves a copy of a section, and where it was before the transaction,
+// unless it has been saved allready; the entry is moved to the back of Undo
+// either way. A section that does not exist is remembered as such.
+// Sections are only ever appended or deleted, so a section that was not
+// touched yet is still in its original place, less one for every section
+// in front of it that the transaction deleted.
+void cdf::CDataFile::Remember(const t_Str &szSection, std::vector<t_Undo> &Undo)
+{
+	std::vector<long> Deleted;
+
+	for (size_t i = 0; i < Undo.size(); i++)
+	{
+		if ( CompareNoCase(Undo[i].szName, szSection) == 0 )
+		{
+			std::rotate(Undo.begin() + i, Undo.begin() + i + 1, Undo.end());
+			return;
+		}
+
+		if ( Undo[i].bDeleted && Undo[i].nIndex >= 0 )
+			Deleted.push_back(Undo[i].nIndex);
+	}
+
+	Undo.push_back(t_Undo());
+	Undo.back().szName = szSection;
+	Undo.back().nIndex = -1;
+	Undo.back().bDeleted = false;
+
+	for (size_t i = 0; i < m_Sections.size(); i++)
+	{
+		if ( CompareNoCase(m_Sections[i].szName, szSection) == 0 )
+		{
+			long nIndex = (long)i;
+
+			std::sort(Deleted.begin(), Deleted.end());
+			for (size_t d = 0; d < Deleted.size() && Deleted[d] <= nIndex; d++)
+				nIndex++;
+
+			Undo.back().nIndex = nIndex;
+			Undo.back().Section = m_Sections[i];
+			break;
+		}
+	}
+}
+
+// ByIndex
+// Orders saved sections by their position in the section list.
+static bool ByIndex(const t_Undo &a, const t_Undo &b)
+{
+	return a.nIndex < b.nIndex;
+}
+
+// Rollback
+// Takes every section the transaction touched out of the list, which leaves
+// the others in their original order, and puts the saved copies of those
+// that existed back where they were, the lowest position first. They count
+// as changed again, so that generations never go back.
+void cdf::CDataFile::Rollback(std::vector<t_Undo> &Undo)
+{
+	for (size_t i = 0; i < Undo.size(); i++)
+	{
+		for (SectionItor s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+		{
+			if ( CompareNoCase((*s_pos).szName, Undo[i].szName) == 0 )
+			{
+				m_Sections.erase(s_pos);
+				break;
+			}
+		}
+	}
+
+	std::sort(Undo.begin(), Undo.end(), ByIndex);
+
+	unsigned long long nGeneration = m_nVersion.fetch_add(1, std::memory_order_relaxed) + 1;
+
+	for (size_t i = 0; i < Undo.size(); i++)
+	{
+		if ( Undo[i].nIndex >= 0 )
+		{
+			m_Sections.insert(m_Sections.begin() + Undo[i].nIndex, Undo[i].Section);
+			m_Sections[Undo[i].nIndex].nGeneration = nGeneration;
+		}
+
+		Invalidate(Undo[i].szName, t_Str(""));
+	}
+	m_bUnpublished = true;
+	SyncSlots();
+}
+
+// Publish
+// Builds a snapshot of the current data and swaps it in for the published
+// one. Sections that did not change since the last time are shared rather
+// than copied. The old snapshot is retired, and freed once the last reader
+// that might have seen it is done. Must be called with m_Mutex held.
+void cdf::CDataFile::Publish()
+{
+	t_Snapshot* pSnapshot = new t_Snapshot;
+
+	pSnapshot->Sections.reserve(m_Sections.size());
+
+	for (SectionItor s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+	{
+		t_Section &Section = *s_pos;
+
+		if ( !Section.pPublished )
+		{
+			// Not make_shared: the reference count is kept apart from the
+			// data, so that counting does not disturb the readers' cache.
+			std::shared_ptr<t_Section> pCopy(new t_Section(Section));
+			pCopy->pPublished.reset();
+			Section.pPublished = pCopy;
+		}
+
+		pSnapshot->Sections.push_back(Section.pPublished);
+		pSnapshot->nKeys += (int)Section.Keys.size();
+	}
+
+	t_Snapshot* pOld = m_pSnapshot.exchange(pSnapshot);
+	m_bUnpublished = false;
+
+	if ( pOld )
+	{
+		pOld->nRetired = s_nEpoch.fetch_add(1);
+		pOld->pNext = m_pRetired;
+		m_pRetired = pOld;
+	}
+
+	Reclaim();
+}
+
+// Reclaim
+// Frees the retired snapshots that were replaced before the oldest epoch any
+// reader has posted. Must be called with m_Mutex held.
+void cdf::CDataFile::Reclaim()
+{
+	if ( m_pRetired == NULL )
+		return;
+
+	unsigned long long nOldest = OldestEpoch();
+	t_Snapshot** ppSnapshot = &m_pRetired;
+
+	while ( *ppSnapshot )
+	{
+		t_Snapshot* pSnapshot = *ppSnapshot;
+
+		if ( pSnapshot->nRetired < nOldest )
+		{
+			*ppSnapshot = pSnapshot->pNext;
+			delete pSnapshot;
+		}
+		else
+			ppSnapshot = &pSnapshot->pNext;
+	}
+}
+
+// LockWrite
+// Locks the data for modification.
+void cdf::CDataFile::LockWrite()
+{
+	m_Mutex.lock();
+
+	if ( m_nWriteDepth++ == 0 )
+		m_bWasDirty = m_bDirty;
+}
+
+// UnlockWrite
+// Commits the changes, if this is the outermost lock, and unlocks. The
+// subscribers hear about the changes once the lock is released.
+void cdf::CDataFile::UnlockWrite()
+{
+	std::vector<t_Delivery> Deliveries;
+
+	if ( --m_nWriteDepth == 0 )
+	{
+		Commit();
+		Announce();
+
+		if ( !m_Notices.empty() )
+			Route(Deliveries);
+	}
+
+	m_Mutex.unlock();
+
+	if ( !Deliveries.empty() )
+		Deliver(Deliveries);
+}
+
+// Announce
+// Called as a write lock is released, with the data still locked, so that a
+// view that sees its counter move can not read the data before the change
+// is done. Writers holding section locks may get here at the same time;
+// the first one bumps the counters for all of them.
+void cdf::CDataFile::Announce()
+{
+	if ( m_Dependents.empty() )
+		return;
+
+	unsigned long long nVersion = m_nVersion.load();
+
+	if ( m_nAnnounced.exchange(nVersion) == nVersion )
+		return;
+
+	for (size_t i = 0; i < m_Dependents.size(); i++)
+		m_Dependents[i]->fetch_add(1);
+}
+
+// CWriteLock
+// Locks the data for modification, for as long as it lives.
+cdf::CDataFile::CWriteLock::CWriteLock(CDataFile* pFile)
+{
+	m_pFile = pFile;
+	m_pFile->LockWrite();
+}
+
+cdf::CDataFile::CWriteLock::~CWriteLock()
+{
+	m_pFile->UnlockWrite();
+}
+
+// CSectionLock
+// Locks a single section if it can, and the data as a whole otherwise. A
+// change in a section must not be journaled, published or passed on to
+// subscribers on its own (all need the data locked as a whole), and a
+// thread that holds the data allready gains nothing from locking less.
+cdf::CDataFile::CSectionLock::CSectionLock(CDataFile* pFile, const t_Str &szSection)
+{
+	m_pFile = pFile;
+	m_pStripe = NULL;
+
+	if ( m_pFile->m_pStripes && !m_pFile->m_Mutex.IsOwner() )
+	{
+		m_pFile->m_Mutex.lock_shared();
+
+		if ( !m_pFile->m_pJournal && !m_pFile->m_pSnapshot.load() && m_pFile->m_Subscriptions.empty() &&
+			 m_pFile->GetSection(szSection) )
+		{
+			m_pStripe = &m_pFile->SectionStripe(szSection);
+			m_pStripe->lock();
+			return;
+		}
+
+		m_pFile->m_Mutex.unlock_shared();
+	}
+
+	m_pFile->LockWrite();
+}
+
+cdf::CDataFile::CSectionLock::~CSectionLock()
+{
+	if ( m_pStripe )
+	{
+		m_pFile->Announce();
+		m_pStripe->unlock();
+		m_pFile->m_Mutex.unlock_shared();
+	}
+	else
+		m_pFile->UnlockWrite();
+}
+
+// SectionStripe
+// Picks the lock of a section by a hash of its name. Names are compared
+// without regard to case, so they are hashed that way too.
+cdf::CSharedMutex& cdf::CDataFile::SectionStripe(const t_Str &szSection) const
+{
+	t_Str szName = LowerCase(szSection);
+	unsigned long long nHash = HashBytes(szName.data(), szName.size());
+
+	return m_pStripes[nHash & (SECTION_STRIPES - 1)].Mutex;
+}
+
+// ReadSection
+// Locks a section shared, in section-locking mode.
+std::shared_lock<CSharedMutex> cdf::CDataFile::ReadSection(const t_Str &szSection) const
+{
+	if ( m_pStripes )
+		return std::shared_lock<CSharedMutex>(SectionStripe(szSection));
+
+	return std::shared_lock<CSharedMutex>();
+}
+
+// ReadAllSections
+// Locks every section shared, in section-locking mode. The stripes are
+// always taken in the same order.
+void cdf::CDataFile::ReadAllSections(std::vector< std::shared_lock<CSharedMutex> > &Locks) const
+{
+	if ( !m_pStripes )
+		return;
+
+	Locks.reserve(SECTION_STRIPES);
+
+	for (int i = 0; i < SECTION_STRIPES; i++)
+		Locks.push_back(std::shared_lock<CSharedMutex>(m_pStripes[i].Mutex));
+}
+
+// ReadLock
+// Locks the data for reading, if the object is in thread-safe mode.
+std::shared_lock<CSharedMutex> cdf::CDataFile::ReadLock() const
+{
+	if ( m_bThreadSafe )
+		return std::shared_lock<CSharedMutex>(m_Mutex);
+
+	return std::shared_lock<CSharedMutex>();
+}
+
+// PersistLoop
+// The background persister. Sleeps until the data becomes dirty, waits out
+// the rest of the save interval, and saves.
+void cdf::CDataFile::PersistLoop()
+{
+	std::unique_lock<CSharedMutex> Lock(m_Mutex);
+	std::chrono::steady_clock::time_point tLastSave = std::chrono::steady_clock::now() - m_PersistInterval;
+
+	while ( m_bPersistRun )
+	{
+		if ( !m_bDirty )
+		{
+			m_PersistCond.wait(Lock);
+			continue;
+		}
+
+		std::chrono::steady_clock::time_point tDue = tLastSave + m_PersistInterval;
+		if ( std::chrono::steady_clock::now() < tDue )
+		{
+			m_PersistCond.wait_until(Lock, tDue);
+			continue;
+		}
+
+		Save();
+		tLastSave = std::chrono::steady_clock::now();
+	}
+
+	if ( m_bDirty )
+		Save();
+}
+
+// StartMutationQueue
+// Starts the applier thread. The queue starts out with a dummy, made once
+// and kept for the life of the object, so that a thread that queues a
+// change as the queue is stopped can never find it gone.
+bool cdf::CDataFile::StartMutationQueue()
+{
+	std::lock_guard<std::mutex> Lock(m_QueueMutex);
+
+	if ( m_bQueueRun )
+	{
+		Report(E_INFO, "[CDataFile::StartMutationQueue] The queue is allready running.");
+		return false;
+	}
+
+	if ( m_pQueueHead == NULL )
+	{
+		m_pQueueHead = new t_Mutation;
+		m_pQueueTail = m_pQueueHead;
+	}
+
+	m_bQueueRun = true;
+	m_Applier = std::thread(&CDataFile::ApplyLoop, this);
+
+	return true;
+}
+
+// StopMutationQueue
+// Stops the applier, which applies everything queued before it exits, and
+// then applies anything that slipped in as it did. A thread that saw the
+// queue running may still be adding to it, so those are waited for first;
+// any that come after see it stopped and set their value themselves.
+void cdf::CDataFile::StopMutationQueue()
+{
+	{
+		std::lock_guard<std::mutex> Lock(m_QueueMutex);
+
+		if ( !m_bQueueRun )
+			return;
+
+		m_bQueueRun = false;
+		m_QueueCond.notify_one();
+	}
+
+	m_Applier.join();
+
+	while ( m_nQueueing > 0 )
+		std::this_thread::yield();
+
+	while ( DrainQueue(MUTATION_BATCH) > 0 )
+		;
+}
+
+// QueueValue
+// Adds a change to the tail of the queue: takes a ticket, swaps the new
+// change in as the tail, and links the old tail to it. The applier only
+// needs waking if it had run out of work; the flag and the tail are both
+// sequentially consistent, so either it sees our change before going to
+// sleep or we see that it is asleep. We count ourselves in before looking
+// at m_bQueueRun, so that StopMutationQueue() either waits for us or we
+// see it stopped.
+unsigned long long cdf::CDataFile::QueueValue(const t_Str &szKey, const t_Str &szValue,
+	const t_Str &szComment, const t_Str &szSection)
+{
+	m_nQueueing++;
+
+	if ( !m_bQueueRun )
+	{
+		m_nQueueing--;
+		return SetValue(szKey, szValue, szComment, szSection) ? 0 : MUTATION_FAILED;
+	}
+
+	t_Mutation* pMutation = new t_Mutation;
+
+	pMutation->Operation.Op = OP_SET_VALUE;
+	pMutation->Operation.szSection = szSection;
+	pMutation->Operation.szKey = szKey;
+	pMutation->Operation.szValue = szValue;
+	pMutation->Operation.szComment = szComment;
+	pMutation->nTicket = m_nTickets.fetch_add(1) + 1;
+
+	unsigned long long nTicket = pMutation->nTicket;
+	t_Mutation* pPrev = m_pQueueTail.exchange(pMutation);
+	pPrev->pNext.store(pMutation, std::memory_order_release);
+
+	if ( m_bApplierIdle )
+	{
+		std::lock_guard<std::mutex> Lock(m_QueueMutex);
+		m_QueueCond.notify_one();
+	}
+
+	m_nQueueing--;
+	return nTicket;
+}
+
+// QueueInt
+// Passes the given int to QueueValue as a string.
+unsigned long long cdf::CDataFile::QueueInt(const t_Str &szKey, int nValue,
+	const t_Str &szComment, const t_Str &szSection)
+{
+	char szStr[64];
+
+	snprintf(szStr, 64, "%d", nValue);
+
+	return QueueValue(szKey, szStr, szComment, szSection);
+}
+
+// WaitForMutation
+// Waits for the applier to get past the ticket, then tells whether its
+// change was made. Tickets past the last failed one need no lock once they
+// are applied, however many failed before them.
+bool cdf::CDataFile::WaitForMutation(unsigned long long nTicket, int nTimeoutMs)
+{
+	if ( nTicket == MUTATION_FAILED )
+		return false;
+
+	if ( m_nApplied >= nTicket && (m_nFailed == 0 || nTicket > m_nLastFailed) )
+		return true;
+
+	std::unique_lock<std::mutex> Lock(m_QueueMutex);
+
+	if ( nTimeoutMs < 0 )
+	{
+		while ( m_nApplied < nTicket )
+			m_AppliedCond.wait(Lock);
+	}
+	else
+	if ( !m_AppliedCond.wait_for(Lock, std::chrono::milliseconds(nTimeoutMs),
+		[&] { return m_nApplied >= nTicket; }) )
+	{
+		return false;
+	}
+
+	return m_Failed.count(nTicket) == 0;
+}
+
+// ApplyLoop
+// The applier. Applies whatever has been queued, batch after batch, and
+// sleeps when there is nothing left.
+void cdf::CDataFile::ApplyLoop()
+{
+	for ( ;; )
+	{
+		if ( DrainQueue(MUTATION_BATCH) > 0 )
+			continue;
+
+		std::unique_lock<std::mutex> Lock(m_QueueMutex);
+
+		m_bApplierIdle = true;
+		while ( m_bQueueRun && QueueEmpty() )
+			m_QueueCond.wait(Lock);
+		m_bApplierIdle = false;
+
+		if ( !m_bQueueRun && QueueEmpty() )
+			break;
+	}
+}
+
+// QueueEmpty
+// The queue is empty when the tail is the dummy at its head.
+bool cdf::CDataFile::QueueEmpty() const
+{
+	return m_pQueueHead == NULL || m_pQueueTail.load() == m_pQueueHead;
+}
+
+// DrainQueue
+// Takes changes off the head of the queue: the dummy's successor holds the
+// next change, and becomes the new dummy once its change has been taken.
+// A change that has been swapped in as the tail but not linked yet is
+// waited for, as its writer is just about to do so. The changes are then
+// made under one write lock, so that they are committed as one, and the
+// tickets applied without a gap before them are announced.
+size_t cdf::CDataFile::DrainQueue(size_t nMax)
+{
+	std::vector<t_Operation> Operations;
+	std::vector<unsigned long long> Tickets;
+	std::vector<unsigned long long> Failed;
+
+	while ( Operations.size() < nMax && !QueueEmpty() )
+	{
+		t_Mutation* pNext;
+
+		while ( (pNext = m_pQueueHead->pNext.load(std::memory_order_acquire)) == NULL )
+			std::this_thread::yield();
+
+		Operations.push_back(t_Operation());
+		Operations.back().Op = pNext->Operation.Op;
+		Operations.back().szSection.swap(pNext->Operation.szSection);
+		Operations.back().szKey.swap(pNext->Operation.szKey);
+		Operations.back().szValue.swap(pNext->Operation.szValue);
+		Operations.back().szComment.swap(pNext->Operation.szComment);
+		Tickets.push_back(pNext->nTicket);
+
+		delete m_pQueueHead;
+		m_pQueueHead = pNext;
+	}
+
+	if ( Operations.size() == 0 )
+		return 0;
+
+	{
+		CWriteLock Lock(this);
+
+		for (size_t i = 0; i < Operations.size(); i++)
+		{
+			if ( !SetValue(Operations[i].szKey, Operations[i].szValue, Operations[i].szComment, Operations[i].szSection) )
+				Failed.push_back(Tickets[i]);
+		}
+	}
+
+	unsigned long long nApplied = m_nApplied;
+
+	for (size_t i = 0; i < Tickets.size(); i++)
+	{
+		m_Applied.push_back(Tickets[i]);
+		std::push_heap(m_Applied.begin(), m_Applied.end(), std::greater<unsigned long long>());
+	}
+
+	while ( m_Applied.size() > 0 && m_Applied.front() == nApplied + 1 )
+	{
+		std::pop_heap(m_Applied.begin(), m_Applied.end(), std::greater<unsigned long long>());
+		m_Applied.pop_back();
+		nApplied++;
+	}
+
+	// The failures are recorded before their tickets are announced, so that
+	// no waiter can miss them, and forgotten MUTATION_HISTORY tickets on.
+	if ( nApplied != m_nApplied || Failed.size() > 0 )
+	{
+		std::lock_guard<std::mutex> Lock(m_QueueMutex);
+
+		for (size_t i = 0; i < Failed.size(); i++)
+		{
+			m_Failed.insert(Failed[i]);
+			if ( Failed[i] > m_nLastFailed )
+				m_nLastFailed = Failed[i];
+		}
+
+		while ( m_Failed.size() > 0 && *m_Failed.begin() + MUTATION_HISTORY < nApplied )
+			m_Failed.erase(m_Failed.begin());
+
+		m_nFailed = m_Failed.size();
+		m_nApplied = nApplied;
+		m_AppliedCond.notify_all();
+	}
+
+	return Operations.size();
+}
+
+
+// SetFileName
+// Set's the m_szFileName member variable. For use when creating the CDataFile
+// object by hand (-vs- loading it from a file
+void cdf::CDataFile::SetFileName(const t_Str &szFileName)
+{
+	std::lock_guard<CSharedMutex> Lock(m_Mutex);
+	if (m_szFileName.size() != 0 && CompareNoCase(szFileName, m_szFileName) != 0)
+	{
+		m_bDirty = true;
+		m_bSpansValid = false;
+
+		Report(E_WARN, "[CDataFile::SetFileName] The filename has changed from <%s> to <%s>.",
+			m_szFileName.c_str(), szFileName.c_str());
+
+		DetachJournal();
+	}
+
+	m_szFileName = szFileName;
+}
+
+// Load
+// Attempts to load in the text file. If successful it will populate the
+// Section list with the key/value pairs found in the file. Note that comments
+// are saved so that they can be rewritten to the file later.
+bool cdf::CDataFile::Load(const t_Str& szFileName)
+{
+	// We dont want to create a new file here.  If it doesn't exist, just
+	// return false and report the failure.
+	std::ifstream File(szFileName.c_str(), std::ios::in|std::ios::binary);
+	if ( ! File.is_open() )
+	{
+		Report(E_INFO, "[CDataFile::Load] Unable to open file. Does it exist?");
+		return false;
+	}
+
+	// The whole file is read with a single call and parsed from memory.
+	t_Str szData;
+	File.seekg(0, std::ios::end);
+	long long nSize = (long long)File.tellg();
+	File.seekg(0, std::ios::beg);
+
+	if ( nSize > 0 )
+	{
+		szData.resize((size_t)nSize);
+		File.read(&szData[0], nSize);
+		szData.resize((size_t)File.gcount());
+	}
+
+	File.close();
+
+	CWriteLock Lock(this);
+
+	LoadData(szFileName, szData, NULL);
+
+	return true;
+}
+
+// LoadData
+// Does the work of Load() once the contents of the file have been read into
+// szData (which may be taken over). pStamp, if given, identifies the version
+// of the file that was read; otherwise the file is stat()ed. Must be called
+// with m_Mutex held.
+void cdf::CDataFile::LoadData(const t_Str &szFileName, t_Str &szData, const t_FileStamp* pStamp)
+{
+	// What we load is allready on disk, so it does not go to the journal.
+	FILE* pJournal = m_pJournal;
+	m_pJournal = NULL;
+
+	// The section byte ranges only describe the file if we are not merging
+	// it into data we allready have, and only describe the file on disk if
+	// it is the one we save to.
+	bool bFresh = KeyCount() == 0 && SectionCount() <= 1;
+	m_bSpansValid = bFresh;
+
+	Parse(szData.data(), (long long)szData.size(), szFileName);
+
+	if ( m_bSpansValid )
+	{
+		for (SectionItor s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+		{
+			if ( (*s_pos).nOffset >= 0 )
+				(*s_pos).nHash = HashBytes(szData.data() + (*s_pos).nOffset, (size_t)(*s_pos).nLength);
+		}
+	}
+
+	m_bSourceValid = m_bSpansValid && (m_Flags & PRESERVE_FORMAT) && !m_bIncludes;
+	if ( m_bSourceValid )
+		m_szSource.swap(szData);
+	else
+		m_szSource = t_Str("");
+
+	if ( szFileName != m_szFileName )
+		m_bSpansValid = false;
+
+	if ( m_bSpansValid && pStamp )
+		m_FileStamp = *pStamp;
+	else
+	if ( m_bSpansValid )
+		m_bSpansValid = GetFileStamp(szFileName, m_FileStamp);
+
+	if ( bFresh )
+		MarkClean();
+
+	// Changes made after the file was last saved.
+	ReplayJournal(szFileName);
+	m_pJournal = pJournal;
+}
+
+
+// Save
+// Attempts to save the Section list and keys to the file. Note that if Load
+// was never called (the CDataFile object was created manually), then you
+// must set the m_szFileName variable before calling save.
+bool cdf::CDataFile::Save()
+{
+	std::lock_guard<CSharedMutex> Lock(m_Mutex);
+
+	if ( KeyCount() == 0 && SectionCount() == 0 )
+	{
+		// no point in saving
+		Report(E_INFO, "[CDataFile::Save] Nothing to save.");
+		return false;
+	}
+
+	if ( m_szFileName.size() == 0 )
+	{
+		Report(E_ERROR, "[CDataFile::Save] No filename has been set.");
+		return false;
+	}
+
+	if ( (m_Flags & INCREMENTAL_SAVE) && SaveIncremental() )
+	{
+		ResetJournal();
+		return true;
+	}
+
+	// Render the whole file into memory, possibly in several pieces on
+	// several threads, and write it out in one go, noting where each
+	// section ends up.
+	std::vector<t_Str> Chunks;
+	std::vector<long long> Offsets;
+	std::vector<unsigned long long> Hashes;
+
+	SerializeChunks(Chunks, Offsets);
+	HashChunks(Chunks, Offsets, Hashes);
+
+	// Values are often set to what they allready were. Leave the file (and
+	// its modification time) alone if it would come out the same.
+	if ( Unchanged(Offsets, Hashes) )
+	{
+		MarkClean();
+		m_bDirty = false;
+		ResetJournal();
+		return true;
+	}
+
+	if ( !WriteChunks(m_szFileName, Chunks) )
+	{
+		m_bSpansValid = false;
+		return false;
+	}
+
+	SaveDone(Chunks, Offsets, Hashes);
+
+	return true;
+}
+
+// SaveDone
+// Bookkeeping after the rendered Chunks have been written to the file:
+// remembers where each section went, keeps the text for PRESERVE_FORMAT,
+// and marks everything clean. Must be called with m_Mutex held.
+void cdf::CDataFile::SaveDone(std::vector<t_Str> &Chunks, const std::vector<long long> &Offsets,
+                              const std::vector<unsigned long long> &Hashes)
+{
+	for (size_t i = 0; i < m_Sections.size(); i++)
+	{
+		m_Sections[i].nOffset = Offsets[i];
+		m_Sections[i].nLength = Offsets[i+1] - Offsets[i];
+		m_Sections[i].nHash = Hashes[i];
+	}
+
+	// What we just wrote is now the text the spans refer to.
+	m_bSourceValid = (m_Flags & PRESERVE_FORMAT) != 0 && !m_bIncludes;
+	m_szSource = t_Str("");
+
+	if ( m_bSourceValid && Chunks.size() == 1 )
+		m_szSource.swap(Chunks[0]);
+	else
+	if ( m_bSourceValid )
+	{
+		m_szSource.reserve((size_t)Offsets.back());
+		for (size_t i = 0; i < Chunks.size(); i++)
+			m_szSource += Chunks[i];
+	}
+
+	MarkClean();
+	m_bDirty = false;
+	m_bSpansValid = GetFileStamp(m_szFileName, m_FileStamp);
+	ResetJournal();
+}
+
+// HashChunks
+// Hashes the rendering of each section, as laid out in Chunks by
+// SerializeChunks(). A section never straddles two chunks.
+void cdf::CDataFile::HashChunks(const std::vector<t_Str> &Chunks, const std::vector<long long> &Offsets,
+                                std::vector<unsigned long long> &Hashes) const
+{
+	size_t c = 0;
+	long long nBase = 0;
+
+	Hashes.resize(m_Sections.size());
+
+	for (size_t i = 0; i < m_Sections.size(); i++)
+	{
+		while ( c + 1 < Chunks.size() && Offsets[i] >= nBase + (long long)Chunks[c].size() )
+			nBase += (long long)Chunks[c++].size();
+
+		Hashes[i] = HashBytes(Chunks[c].data() + (Offsets[i] - nBase), (size_t)(Offsets[i+1] - Offsets[i]));
+	}
+}
+
+// Unchanged
+// Returns true if every section would be written to the same place, with the
+// same bytes (going by their hashes), as it occupies in the file now, and the
+// file has not been changed by anyone else since we last loaded or saved it.
+bool cdf::CDataFile::Unchanged(const std::vector<long long> &Offsets,
+                               const std::vector<unsigned long long> &Hashes) const
+{
+	if ( !m_bSpansValid || Offsets.back() != m_FileStamp.nSize )
+		return false;
+
+	for (size_t i = 0; i < m_Sections.size(); i++)
+	{
+		const t_Section &Section = m_Sections[i];
+
+		if ( Section.nOffset != Offsets[i] || Section.nLength != Offsets[i+1] - Offsets[i]
+			|| Section.nHash != Hashes[i] )
+			return false;
+	}
+
+	t_FileStamp Stamp;
+
+	return GetFileStamp(m_szFileName, Stamp) && Stamp == m_FileStamp;
+}
+
+// SerializedSize
+// Returns the exact number of bytes that Save(), SaveToBuffer() or
+// SaveToStream() would produce.
+size_t cdf::CDataFile::SerializedSize() const
+{
+	std::shared_lock<CSharedMutex> Lock(m_Mutex);
+	std::vector< std::shared_lock<CSharedMutex> > SectionLocks;
+
+	ReadAllSections(SectionLocks);
+	size_t nSize = 0;
+
+	if ( m_bSourceValid && (m_Flags & PRESERVE_FORMAT) )
+	{
+		t_Str szData;
+		SerializeAll(szData, NULL);
+		return szData.size();
+	}
+
+	for (SectionList::const_iterator s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+		nSize += SectionSize(*s_pos);
+
+	return nSize;
+}
+
+// SaveToBuffer
+// Serializes the data into szOut, replacing what it held, exactly as Save()
+// would write it to the file. The string is sized once, up front.
+bool cdf::CDataFile::SaveToBuffer(t_Str &szOut) const
+{
+	std::shared_lock<CSharedMutex> Lock(m_Mutex);
+	std::vector< std::shared_lock<CSharedMutex> > SectionLocks;
+
+	ReadAllSections(SectionLocks);
+
+	SerializeAll(szOut, NULL);
+
+	return true;
+}
+
+// SaveToBuffer
+// Serializes the data into the nBufferSize bytes at pBuffer. nWritten is set
+// to the number of bytes needed; if that is more than nBufferSize nothing is
+// written and false is returned. Call SerializedSize() to size the buffer.
+bool cdf::CDataFile::SaveToBuffer(char* pBuffer, size_t nBufferSize, size_t &nWritten) const
+{
+	std::shared_lock<CSharedMutex> Lock(m_Mutex);
+	std::vector< std::shared_lock<CSharedMutex> > SectionLocks;
+
+	SectionList::const_iterator s_pos;
+
+	ReadAllSections(SectionLocks);
+
+	nWritten = SerializedSize();
+	if ( nWritten > nBufferSize )
+		return false;
+
+	if ( m_bSourceValid && (m_Flags & PRESERVE_FORMAT) )
+	{
+		t_Str szData;
+		SerializeAll(szData, NULL);
+		memcpy(pBuffer, szData.data(), szData.size());
+		return true;
+	}
+
+	for (s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+		pBuffer = SerializeSection(*s_pos, pBuffer);
+
+	return true;
+}
+
+// SaveToStream
+// Writes the data to the given stream exactly as Save() would write it to
+// the file. Returns false if the stream reports an error.
+bool cdf::CDataFile::SaveToStream(std::ostream &stream) const
+{
+	std::shared_lock<CSharedMutex> Lock(m_Mutex);
+	std::vector< std::shared_lock<CSharedMutex> > SectionLocks;
+
+	SectionList::const_iterator s_pos;
+	t_Str szChunk;
+
+	ReadAllSections(SectionLocks);
+
+	// One section at a time, so that we never hold a copy of the whole file.
+	for (s_pos = m_Sections.begin(); s_pos != m_Sections.end() && stream.good(); s_pos++)
+	{
+		szChunk.clear();
+		RenderSection(*s_pos, szChunk);
+		stream.write(szChunk.data(), szChunk.size());
+	}
+
+	return !stream.fail();
+}
+
+// SetKeyComment
+// Set the comment of a given key. Returns true if the key is not found.
+bool cdf::CDataFile::SetKeyComment(const t_Str &szKey, const t_Str &szComment, const t_Str &szSection)
+{
+	CSectionLock Lock(this, szSection);
+
+	KeyItor k_pos;
+	t_Section* pSection;
+
+	if ( (pSection = GetSection(szSection)) == NULL )
+		return false;
+
+	for (k_pos = pSection->Keys.begin(); k_pos != pSection->Keys.end(); k_pos++)
+	{
+		if ( CompareNoCase( (*k_pos).szKey, szKey ) == 0 )
+		{
+			if ( (*k_pos).szComment != szComment )
+				(*k_pos).bCommentChanged = true;
+
+			(*k_pos).szComment = szComment;
+			(*k_pos).bIncluded = false;
+			pSection->bIncluded = false;
+			Touch(pSection);
+			Journal(JournalRecord("K", szSection, szKey, szComment));
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// SetSectionComment
+// Set the comment for a given section. Returns false if the section
+// was not found.
+bool cdf::CDataFile::SetSectionComment(const t_Str &szSection, const t_Str &szComment)
+{
+	CWriteLock Lock(this);
+
+	SectionItor s_pos;
+
+	for (s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+	{
+		if ( CompareNoCase( (*s_pos).szName, szSection ) == 0 )
+		{
+			if ( (*s_pos).szComment != szComment )
+				(*s_pos).bCommentChanged = true;
+
+			(*s_pos).szComment = szComment;
+			(*s_pos).bIncluded = false;
+			Touch(&(*s_pos));
+			Journal(JournalRecord("S", szSection, szComment));
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+// SetValue
+// Given a key, a value and a section, this function will attempt to locate the
+// Key within the given section, and if it finds it, change the keys value to
+// the new value. If it does not locate the key, it will create a new key with
+// the proper value and place it in the section requested.
+bool cdf::CDataFile::SetValue(const t_Str &szKey, const t_Str &szValue, const t_Str &szComment, const t_Str &szSection)
+{
+	return SetValue(szKey, szValue, szComment, szSection, m_Flags);
+}
+
+// SetValue
+// Does the work of the one above, going by the create policy passed in.
+bool cdf::CDataFile::SetValue(const t_Str &szKey, const t_Str &szValue, const t_Str &szComment,
+	const t_Str &szSection, long nCreate)
+{
+	CSectionLock Lock(this, szSection);
+	t_Key* pKey = GetKey(szKey, szSection);
+	t_Section* pSection = GetSection(szSection);
+
+	if (pSection == NULL)
+	{
+		if ( !(nCreate & AUTOCREATE_SECTIONS) || !CreateSection(szSection,""))
+			return false;
+
+		pSection = GetSection(szSection);
+	}
+
+	// Sanity check...
+	if ( pSection == NULL )
+		return false;
+
+	// if the key does not exist in that section then add the new key.
+	if ( pKey == NULL && (nCreate & AUTOCREATE_KEYS))
+	{
+		pKey = new t_Key;
+
+		pKey->szKey = szKey;
+		pKey->szValue = szValue;
+		pKey->szComment = szComment;
+		pSection->bIncluded = false;
+
+		Touch(pSection);
+		Notify(CHANGE_ADDED, pSection->szName, szKey, t_Str(""), szValue);
+
+		pSection->Keys.push_back(*pKey);
+		Invalidate(szSection, szKey);
+		Journal(JournalRecord("V", szSection, szKey, szValue, szComment));
+		UpdateSlot(szKey, szSection, &szValue);
+
+		return true;
+	}
+
+	if ( pKey != NULL )
+	{
+		if ( pKey->szValue != szValue )
+		{
+			pKey->bValueChanged = true;
+			Notify(CHANGE_MODIFIED, pSection->szName, pKey->szKey, pKey->szValue, szValue);
+		}
+		if ( pKey->szComment != szComment )
+			pKey->bCommentChanged = true;
+
+		pKey->szValue = szValue;
+		pKey->szComment = szComment;
+		pKey->bIncluded = false;
+		pSection->bIncluded = false;
+
+		Touch(pSection);
+		Invalidate(szSection, szKey);
+		Journal(JournalRecord("V", szSection, szKey, szValue, szComment));
+		UpdateSlot(szKey, szSection, &szValue);
+
+		return true;
+	}
+
+	return false;
+}
+
+// SetFloat
+// Passes the given float to SetValue as a string
+bool cdf::CDataFile::SetFloat(const t_Str &szKey, float fValue, const t_Str &szComment, const t_Str &szSection)
+{
+	char szStr[64];
+
+	snprintf(szStr, 64, "%g", fValue);
+
+	return SetValue(szKey, szStr, szComment, szSection);
+}
+
+// SetInt
+// Passes the given int to SetValue as a string
+bool cdf::CDataFile::SetInt(const t_Str &szKey, int nValue, t_Str szComment, t_Str szSection)
+{
+	char szStr[64];
+
+	snprintf(szStr, 64, "%d", nValue);
 
 	return SetValue(szKey, szStr, szComment, szSection);
 
 }
 
-// SetBool
-// Passes the given bool to SetValue as a string
-bool cdf::CDataFile::SetBool(const t_Str &szKey, bool bValue, t_Str szComment, t_Str szSection)
+// SetBool
+// Passes the given bool to SetValue as a string
+bool cdf::CDataFile::SetBool(const t_Str &szKey, bool bValue, t_Str szComment, t_Str szSection)
+{
+	t_Str szValue = bValue ?  "True" : "False";
+
+	return SetValue(szKey, szValue, szComment, szSection);
+}
+
+// SlotName
+// The name a bound key is filed under: its section and key, lower-cased,
+// since names are compared without regard to case.
+static t_Str SlotName(const t_Str &szKey, const t_Str &szSection)
+{
+	return LowerCase(szSection + '\n' + szKey);
+}
+
+// BindSlot
+// Creates the slot of a key, if it has none yet, and fills it in.
+const CSlot* cdf::CDataFile::BindSlot(const t_Str &szKey, const t_Str &szSection)
+{
+	CWriteLock Lock(this);
+
+	CSlot* &pSlot = m_Slots[SlotName(szKey, szSection)];
+
+	if ( pSlot == NULL )
+	{
+		t_Key* pKey = GetKey(szKey, szSection);
+
+		pSlot = new CSlot(szKey, szSection);
+		pSlot->Store(pKey ? &pKey->szValue : NULL);
+	}
+
+	return pSlot;
+}
+
+// UpdateSlot
+// Called with the key (and so its slot) locked for modification, so that
+// no two threads ever update the same slot at once.
+void cdf::CDataFile::UpdateSlot(const t_Str &szKey, const t_Str &szSection, const t_Str* pValue)
+{
+	if ( m_Slots.size() == 0 )
+		return;
+
+	std::map<t_Str, CSlot*>::iterator i = m_Slots.find(SlotName(szKey, szSection));
+
+	if ( i != m_Slots.end() )
+		i->second->Store(pValue);
+}
+
+// SyncSlots
+// Looks up the key of every slot again. Must be called with the data
+// locked as a whole.
+void cdf::CDataFile::SyncSlots()
+{
+	for (std::map<t_Str, CSlot*>::iterator i = m_Slots.begin(); i != m_Slots.end(); i++)
+	{
+		t_Key* pKey = GetKey(i->second->m_szKey, i->second->m_szSection);
+
+		i->second->Store(pKey ? &pKey->szValue : NULL);
+	}
+}
+
+// CachedValue
+// Looks the key up in the calling thread's cache. The check takes a relaxed
+// load: a thread may see a change a moment late, as it might have read a
+// moment early, but never an older value than it has seen allready. When it
+// is out of date the value is read again, along with the version, under the
+// same locks as GetValue(), so that the two always go together. A key
+// without an id is read every time, into a value of its own.
+t_CachedValue& cdf::CDataFile::CachedValue(const CHotKey &Key)
+{
+	static thread_local t_CachedValue Uncached;
+	std::vector<t_CachedValue> &Values = CachedValues();
+
+	if ( Key.m_nId >= 0 && (size_t)Key.m_nId >= Values.size() )
+		Values.resize(Key.m_nId + 1);
+
+	t_CachedValue &Value = Key.m_nId >= 0 ? Values[Key.m_nId] : Uncached;
+
+	if ( Key.m_nId >= 0 && Value.nKey == Key.m_nSerial && Value.nFile == m_nSerial
+		 && Value.nVersion == m_nVersion.load(std::memory_order_relaxed) )
+		return Value;
+
+	std::shared_lock<CSharedMutex> Lock = ReadLock();
+	std::shared_lock<CSharedMutex> SectionLock = ReadSection(Key.m_szSection);
+	t_Key* pKey = GetKey(Key.m_szKey, Key.m_szSection);
+
+	Value.nKey = Key.m_nSerial;
+	Value.nFile = m_nSerial;
+	Value.nVersion = m_nVersion.load(std::memory_order_relaxed);
+	Value.bFound = pKey != NULL;
+	Value.szValue = pKey ? pKey->szValue : t_Str("");
+	Value.nConverted = 0;
+
+	return Value;
+}
+
+// GetValue
+// Obtains the value of a hot key as a t_Str object. Returns false if the
+// key could not be found.
+bool cdf::CDataFile::GetValue(const CHotKey &Key, t_Str &ret)
+{
+	t_CachedValue &Value = CachedValue(Key);
+	if ( ! Value.bFound )
+		return false;
+
+	ret = Value.szValue;
+	return true;
+}
+
+// GetString
+// Obtains the value of a hot key as a t_Str object.
+bool cdf::CDataFile::GetString(const CHotKey &Key, t_Str &ret)
+{
+	return GetValue(Key, ret);
+}
+
+// GetFloat
+// Obtains the value of a hot key as a float, converting it once per change.
+bool cdf::CDataFile::GetFloat(const CHotKey &Key, float &ret)
+{
+	t_CachedValue &Value = CachedValue(Key);
+
+	if ( !(Value.nConverted & CACHED_FLOAT) )
+	{
+		Value.bFloat = Value.bFound && ToFloat(Value.szValue, Value.fValue);
+		Value.nConverted |= CACHED_FLOAT;
+	}
+
+	if ( Value.bFloat )
+		ret = Value.fValue;
+
+	return Value.bFloat;
+}
+
+// GetInt
+// Obtains the value of a hot key as an int, converting it once per change.
+bool cdf::CDataFile::GetInt(const CHotKey &Key, int &ret)
+{
+	t_CachedValue &Value = CachedValue(Key);
+
+	if ( !(Value.nConverted & CACHED_INT) )
+	{
+		Value.bInt = Value.bFound && ToInt(Value.szValue, Value.nValue);
+		Value.nConverted |= CACHED_INT;
+	}
+
+	if ( Value.bInt )
+		ret = Value.nValue;
+
+	return Value.bInt;
+}
+
+// GetBool
+// Obtains the value of a hot key as a bool, converting it once per change.
+bool cdf::CDataFile::GetBool(const CHotKey &Key, bool &ret)
+{
+	t_CachedValue &Value = CachedValue(Key);
+
+	if ( !(Value.nConverted & CACHED_BOOL) )
+	{
+		if ( Value.bFound )
+			ToBool(Value.szValue, Value.bValue);
+		Value.nConverted |= CACHED_BOOL;
+	}
+
+	if ( Value.bFound )
+		ret = Value.bValue;
+
+	return Value.bFound;
+}
+
+// GetValue
+// Obtains the key value as a t_Str object. Returns false
+// if the key could not be found.
+bool cdf::CDataFile::GetValue(const t_Str &szKey, const t_Str &szSection, t_Str& ret)
+{
+	std::shared_lock<CSharedMutex> Lock = ReadLock();
+	std::shared_lock<CSharedMutex> SectionLock = ReadSection(szSection);
+	t_Key* pKey = GetKey(szKey, szSection);
+	if( ! pKey )
+		return false;
+
+	ret = pKey->szValue;
+	return true;
+}
+
+// GetString
+// Obtains the key value as a t_Str object. Returns false
+// if the key could not be found.
+bool cdf::CDataFile::GetString(const t_Str &szKey, const t_Str &szSection, t_Str &ret)
+{
+	return GetValue(szKey, szSection, ret);
+}
+
+// GetFloat
+// Obtains the key value as a float type. Returns false if the key is
+// not found.
+bool cdf::CDataFile::GetFloat(const t_Str &szKey, const t_Str &szSection, float &ret)
+{
+	t_Str szValue;
+	if( ! GetValue(szKey, szSection, szValue) )
+		return false;
+
+	return ToFloat(szValue, ret);
+}
+
+// GetInt
+// Obtains the key value as an integer type. Returns false if the key is
+// not found.
+bool cdf::CDataFile::GetInt(const t_Str &szKey, const t_Str &szSection, int &ret)
+{
+	t_Str szValue;
+	if( ! GetValue(szKey, szSection, szValue) )
+		return false;
+
+	return ToInt(szValue, ret);
+}
+
+// GetBool
+// Obtains the key value as a bool type. Returns false if the key is
+// not found.
+bool cdf::CDataFile::GetBool(const t_Str &szKey, const t_Str &szSection, bool &ret)
+{
+	t_Str szValue;
+	if( ! GetValue(szKey, szSection, szValue) )
+		return false;
+
+	return ToBool(szValue, ret);
+}
+
+// DeleteSection
+// Delete a specific section. Returns false if the section cannot be
+// found or true when sucessfully deleted.
+bool cdf::CDataFile::DeleteSection(const t_Str &szSection)
+{
+	CWriteLock Lock(this);
+
+	SectionItor s_pos;
+
+	for (s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+	{
+		if ( CompareNoCase( (*s_pos).szName, szSection ) == 0 )
+		{
+			Notify(CHANGE_REMOVED, (*s_pos).szName, t_Str(""), t_Str(""), t_Str(""));
+			m_Sections.erase(s_pos);
+			Touch(NULL);
+			Invalidate(szSection, t_Str(""));
+			Journal(JournalRecord("D", szSection));
+			SyncSlots();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// DeleteKey
+// Delete a specific key in a specific section. Returns false if the key
+// cannot be found or true when sucessfully deleted.
+bool cdf::CDataFile::DeleteKey(const t_Str &szKey, const t_Str &szFromSection)
+{
+	CSectionLock Lock(this, szFromSection);
+
+	KeyItor k_pos;
+	t_Section* pSection;
+
+	if ( (pSection = GetSection(szFromSection)) == NULL )
+		return false;
+
+	for (k_pos = pSection->Keys.begin(); k_pos != pSection->Keys.end(); k_pos++)
+	{
+		if ( CompareNoCase( (*k_pos).szKey, szKey ) == 0 )
+		{
+			Notify(CHANGE_REMOVED, pSection->szName, (*k_pos).szKey, (*k_pos).szValue, t_Str(""));
+			pSection->Keys.erase(k_pos);
+			Touch(pSection);
+			Invalidate(szFromSection, szKey);
+			Journal(JournalRecord("X", szFromSection, szKey));
+			UpdateSlot(szKey, szFromSection, NULL);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// CreateKey
+// Given a key, a value and a section, this function will attempt to locate the
+// Key within the given section, and if it finds it, change the keys value to
+// the new value. If it does not locate the key, it will create a new key with
+// the proper value and place it in the section requested.
+bool cdf::CDataFile::CreateKey(const t_Str &szKey, const t_Str &szValue, const t_Str &szComment, const t_Str &szSection)
+{
+	return SetValue(szKey, szValue, szComment, szSection, m_Flags | AUTOCREATE_KEYS);
+}
+
+
+// CreateSection
+// Given a section name, this function first checks to see if the given section
+// allready exists in the list or not, if not, it creates the new section and
+// assigns it the comment given in szComment.  The function returns true if
+// sucessfully created, or false otherwise.
+bool cdf::CDataFile::CreateSection(const t_Str &szSection, const t_Str &szComment)
+{
+	CWriteLock Lock(this);
+
+	t_Section* pSection = GetSection(szSection);
+
+	if ( pSection )
+	{
+		Report(E_INFO, "[CDataFile::CreateSection] Section <%s> allready exists. Aborting.", szSection.c_str());
+		return false;
+	}
+
+	pSection = new t_Section;
+
+	pSection->szName = szSection;
+	pSection->szComment = szComment;
+	m_Sections.push_back(*pSection);
+	Touch(&m_Sections.back());
+	Journal(JournalRecord("C", szSection, szComment));
+	Notify(CHANGE_ADDED, szSection, t_Str(""), t_Str(""), t_Str(""));
+
+	return true;
+}
+
+// CreateSection
+// Given a section name, this function first checks to see if the given section
+// allready exists in the list or not, if not, it creates the new section and
+// assigns it the comment given in szComment.  The function returns true if
+// sucessfully created, or false otherwise. This version accpets a KeyList
+// and sets up the newly created Section with the keys in the list.
+bool cdf::CDataFile::CreateSection(const t_Str &szSection, const t_Str &szComment, KeyList Keys)
+{
+	CWriteLock Lock(this);
+
+	if ( !CreateSection(szSection, szComment) )
+		return false;
+
+	t_Section* pSection = GetSection(szSection);
+
+	if ( !pSection )
+		return false;
+
+	KeyItor k_pos;
+	t_Str szRecords;
+
+	pSection->szName = szSection;
+	for (k_pos = Keys.begin(); k_pos != Keys.end(); k_pos++)
+	{
+		t_Key* pKey = new t_Key;
+		pKey->szComment = (*k_pos).szComment;
+		pKey->szKey = (*k_pos).szKey;
+		pKey->szValue = (*k_pos).szValue;
+
+		pSection->Keys.push_back(*pKey);
+		szRecords += JournalRecord("V", szSection, pKey->szKey, pKey->szValue, pKey->szComment);
+	}
+
+	Touch(pSection);
+	Invalidate(szSection, t_Str(""));
+	Journal(szRecords);
+	SyncSlots();
+
+	return true;
+}
+
+// Generation
+// The data version, which every change bumps.
+unsigned long long cdf::CDataFile::Generation() const
+{
+	return m_nVersion.load();
+}
+
+// SectionGeneration
+// Looks the section up under the read locks, since the striped writers
+// set its generation with only the section locked.
+unsigned long long cdf::CDataFile::SectionGeneration(const t_Str &szSection)
+{
+	std::shared_lock<CSharedMutex> Lock = ReadLock();
+	std::shared_lock<CSharedMutex> SectionLock = ReadSection(szSection);
+	t_Section* pSection = GetSection(szSection);
+
+	return pSection ? pSection->nGeneration : m_nVersion.load();
+}
+
+// HasSection
+// Returns true if the specified section exists.
+bool cdf::CDataFile::HasSection(const t_Str &szSection)
+{
+	std::shared_lock<CSharedMutex> Lock = ReadLock();
+
+	return GetSection(szSection) != NULL;
+}
+
+// SectionCount
+// Simply returns the number of sections in the list.
+int cdf::CDataFile::SectionCount()
+{
+	std::shared_lock<CSharedMutex> Lock = ReadLock();
+
+	return m_Sections.size();
+}
+
+// KeyCount
+// Returns the total number of keys contained within all the sections.
+int cdf::CDataFile::KeyCount()
+{
+	std::shared_lock<CSharedMutex> Lock = ReadLock();
+	std::vector< std::shared_lock<CSharedMutex> > SectionLocks;
+	int nCounter = 0;
+
+	ReadAllSections(SectionLocks);
+
+	SectionItor s_pos;
+
+	for (s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+		nCounter += (*s_pos).Keys.size();
+
+	return nCounter;
+}
+
+
+// Protected Member Functions ///////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////
+
+// GetKey
+// Given a key and section name, looks up the key and if found, returns a
+// pointer to that key, otherwise returns NULL.
+t_Key*	cdf::CDataFile::GetKey(const t_Str &szKey, const t_Str &szSection)
+{
+	KeyItor k_pos;
+	t_Section* pSection;
+
+	// Since our default section has a name value of t_Str("") this should
+	// always return a valid section, wether or not it has any keys in it is
+	// another matter.
+	if ( (pSection = GetSection(szSection)) == NULL )
+		return NULL;
+
+	for (k_pos = pSection->Keys.begin(); k_pos != pSection->Keys.end(); k_pos++)
+	{
+		if ( CompareNoCase( (*k_pos).szKey, szKey ) == 0 )
+			return (t_Key*)&(*k_pos);
+	}
+
+	return NULL;
+}
+
+// GetSection
+// Given a section name, locates that section in the list and returns a pointer
+// to it. If the section was not found, returns NULL
+t_Section* cdf::CDataFile::GetSection(const t_Str &szSection)
+{
+	SectionItor s_pos;
+
+	for (s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+	{
+		if ( CompareNoCase( (*s_pos).szName, szSection ) == 0 )
+			return (t_Section*)&(*s_pos);
+	}
+
+	return NULL;
+}
+
+
+// CHandoffQueue
+// The process-wide thread that saves data handed off by destructors with the
+// PERSIST_HANDOFF policy. It is created on first use, and on its way out
+// (when the program exits) it saves whatever is still queued.
+class CHandoffQueue
+{
+public:
+	CHandoffQueue()
+	{
+		m_bRun = true;
+		m_nBusy = 0;
+		m_Thread = std::thread(&CHandoffQueue::Run, this);
+	}
+
+	~CHandoffQueue()
+	{
+		{
+			std::lock_guard<std::mutex> Lock(m_Mutex);
+			m_bRun = false;
+			m_Cond.notify_all();
+		}
+
+		m_Thread.join();
+		s_bClosed = true;
+	}
+
+	void Push(CDataFile* pData)
+	{
+		std::lock_guard<std::mutex> Lock(m_Mutex);
+		m_Queue.push_back(pData);
+		m_Cond.notify_all();
+	}
+
+	void Wait()
+	{
+		std::unique_lock<std::mutex> Lock(m_Mutex);
+		while ( m_Queue.size() > 0 || m_nBusy > 0 )
+			m_Cond.wait(Lock);
+	}
+
+	static bool s_bClosed;
+
+private:
+	void Run()
+	{
+		std::unique_lock<std::mutex> Lock(m_Mutex);
+
+		for ( ;; )
+		{
+			if ( m_Queue.size() == 0 )
+			{
+				if ( !m_bRun )
+					break;
+
+				m_Cond.wait(Lock);
+				continue;
+			}
+
+			CDataFile* pData = m_Queue.front();
+			m_Queue.erase(m_Queue.begin());
+			m_nBusy++;
+
+			Lock.unlock();
+			pData->Save();
+			delete pData;
+			Lock.lock();
+
+			m_nBusy--;
+			m_Cond.notify_all();
+		}
+	}
+
+	std::mutex              m_Mutex;
+	std::condition_variable m_Cond;
+	std::vector<CDataFile*> m_Queue;
+	std::thread             m_Thread;
+	bool                    m_bRun;
+	int                     m_nBusy;
+};
+
+bool CHandoffQueue::s_bClosed = false;
+
+static CHandoffQueue& HandoffQueue()
+{
+	static CHandoffQueue Queue;
+	return Queue;
+}
+
+// HandOff
+// Moves unsaved data into a new CDataFile and queues that to be saved by the
+// hand-off thread, leaving this one clean. Only the section list changes
+// hands, so this is cheap regardless of how much data there is. Saves on
+// the spot if the hand-off thread has allready shut down.
+void cdf::CDataFile::HandOff()
+{
+	std::lock_guard<CSharedMutex> Lock(m_Mutex);
+
+	if ( !m_bDirty )
+		return;
+
+	if ( CHandoffQueue::s_bClosed )
+	{
+		Save();
+		return;
+	}
+
+	CDataFile* pData = new CDataFile;
+
+	pData->m_Sections.swap(m_Sections);
+	m_nVersion.fetch_add(1, std::memory_order_relaxed);
+	ForgetExpansions();
+	pData->m_szFileName = m_szFileName;
+	pData->m_Flags = m_Flags;
+	pData->m_bSpansValid = m_bSpansValid;
+	pData->m_FileStamp = m_FileStamp;
+	pData->m_szSource.swap(m_szSource);
+	pData->m_bSourceValid = m_bSourceValid;
+	pData->m_bIncludes = m_bIncludes;
+	pData->m_bDirty = true;
+	pData->m_PersistPolicy = PERSIST_NEVER;
+	pData->m_nSaveThreads = m_nSaveThreads;
+
+	m_bDirty = false;
+	m_bSpansValid = false;
+	m_bSourceValid = false;
+	m_bIncludes = false;
+
+	HandoffQueue().Push(pData);
+}
+
+// EnableJournal
+// Starts journaling. Any changes that have not been saved yet are saved
+// first, so that the file plus the journal always hold all of the data.
+bool cdf::CDataFile::EnableJournal(long long nMaxBytes)
+{
+	std::lock_guard<CSharedMutex> Lock(m_Mutex);
+
+	if ( m_szFileName.size() == 0 )
+	{
+		Report(E_ERROR, "[CDataFile::EnableJournal] No filename has been set.");
+		return false;
+	}
+
+	if ( m_pJournal )
+		fclose(m_pJournal);
+	m_pJournal = NULL;
+
+	if ( m_bDirty && !Save() )
+		return false;
+
+	t_Str szJournal = m_szFileName + ".journal";
+
+	if ( (m_pJournal = fopen(szJournal.c_str(), "ab")) == NULL )
+	{
+		Report(E_ERROR, "[CDataFile::EnableJournal] Unable to open <%s>.", szJournal.c_str());
+		return false;
+	}
+
+	// Unbuffered, so that every record goes out with a single write.
+	setvbuf(m_pJournal, NULL, _IONBF, 0);
+	fseek(m_pJournal, 0, SEEK_END);
+
+	m_nJournalSize = ftell(m_pJournal);
+	m_nJournalMax = nMaxBytes;
+	m_bJournalReplayed = false;
+
+	return true;
+}
+
+// DisableJournal
+// Stops journaling. The file is saved and the journal removed.
+void cdf::CDataFile::DisableJournal()
+{
+	std::lock_guard<CSharedMutex> Lock(m_Mutex);
+
+	if ( !m_pJournal )
+		return;
+
+	if ( !Save() )
+		return;
+
+	fclose(m_pJournal);
+	m_pJournal = NULL;
+	remove((m_szFileName + ".journal").c_str());
+}
+
+// Journal
+// Appends a record (or several) to the journal with a single write. Once
+// the journal has grown past its limit the file is saved, which empties it.
+// Records of changes made under a CWriteLock are held back until it is
+// released, and then written together by Commit().
+void cdf::CDataFile::Journal(const t_Str &szRecord)
+{
+	if ( !m_pJournal || szRecord.size() == 0 )
+		return;
+
+	if ( m_nWriteDepth > 0 )
+	{
+		m_szJournalBatch += szRecord;
+		m_nJournalBatch++;
+		return;
+	}
+
+	if ( fwrite(szRecord.data(), 1, szRecord.size(), m_pJournal) != szRecord.size() )
+	{
+		Report(E_ERROR, "[CDataFile::Journal] Unable to write to the journal of <%s>.",
+			m_szFileName.c_str());
+		return;
+	}
+
+	m_nJournalSize += szRecord.size();
+
+	if ( m_nJournalSize > m_nJournalMax )
+		Save();
+}
+
+// ResetJournal
+// Called after a successful save: the journal's changes are now in the file.
+void cdf::CDataFile::ResetJournal()
+{
+	t_Str szJournal = m_szFileName + ".journal";
+
+	if ( m_pJournal )
+	{
+		fclose(m_pJournal);
+
+		if ( (m_pJournal = fopen(szJournal.c_str(), "wb")) == NULL )
+			Report(E_ERROR, "[CDataFile::ResetJournal] Unable to reopen <%s>.", szJournal.c_str());
+		else
+			setvbuf(m_pJournal, NULL, _IONBF, 0);
+
+		m_nJournalSize = 0;
+	}
+	else
+	if ( m_bJournalReplayed )
+	{
+		remove(szJournal.c_str());
+		m_bJournalReplayed = false;
+	}
+}
+
+// DetachJournal
+// Closes the journal without removing it: its changes are not in the file
+// it was kept for, and Load() will replay them. Records a CWriteLock still
+// holds back go out first, as one group.
+void cdf::CDataFile::DetachJournal()
+{
+	m_bJournalReplayed = false;
+
+	if ( !m_pJournal )
+		return;
+
+	if ( m_nJournalBatch > 0 )
+	{
+		t_Str szRecords = TakeJournalBatch();
+
+		if ( fwrite(szRecords.data(), 1, szRecords.size(), m_pJournal) != szRecords.size() )
+			Report(E_ERROR, "[CDataFile::DetachJournal] Unable to write to the journal of <%s>.",
+				m_szFileName.c_str());
+	}
+
+	fclose(m_pJournal);
+	m_pJournal = NULL;
+	m_nJournalSize = 0;
+}
+
+// TakeJournalBatch
+// Puts a T record in front of the records held back, if there are several,
+// so that a replay applies all of them or none.
+t_Str cdf::CDataFile::TakeJournalBatch()
+{
+	t_Str szRecords;
+	char szCount[32];
+
+	if ( m_nJournalBatch > 1 )
+	{
+		snprintf(szCount, sizeof(szCount), "%d", m_nJournalBatch);
+		szRecords = JournalRecord("T", szCount);
+	}
+
+	szRecords += m_szJournalBatch;
+	m_szJournalBatch = t_Str("");
+	m_nJournalBatch = 0;
+
+	return szRecords;
+}
+
+// ReplayJournal
+// Reads <szFileName>.journal, if there is one, and applies its records in
+// order. A record cut short (by a crash in the middle of writing it) ends
+// the replay.
+void cdf::CDataFile::ReplayJournal(const t_Str &szFileName)
+{
+	std::ifstream File((szFileName + ".journal").c_str(), std::ios::in|std::ios::binary);
+	if ( ! File.is_open() )
+		return;
+
+	std::ostringstream Data;
+	Data << File.rdbuf();
+
+	t_Str szData = Data.str();
+	size_t nPos = 0;
+	size_t nEnd;
+	std::vector<t_Str> Fields;
+
+	while ( (nEnd = szData.find('\n', nPos)) != t_Str::npos )
+	{
+		SplitRecord(szData.substr(nPos, nEnd - nPos), Fields);
+		nPos = nEnd + 1;
+
+		const t_Str &szOp = Fields[0];
+		size_t nFields = Fields.size();
+
+		if ( szOp == "T" && nFields == 2 )
+		{
+			// The records of a transaction only count if all of them made it.
+			long nRecords = atol(Fields[1].c_str());
+			size_t nCheck = nPos;
+
+			for (; nRecords > 0 && nCheck != t_Str::npos; nRecords--)
+			{
+				nCheck = szData.find('\n', nCheck);
+				if ( nCheck != t_Str::npos )
+					nCheck++;
+			}
+
+			if ( nCheck == t_Str::npos )
+				break;
+		}
+		else
+		if ( szOp == "V" && nFields == 5 )
+			SetValue(Fields[2], Fields[3], Fields[4], Fields[1], CREATE_ALL);
+		else
+		if ( szOp == "K" && nFields == 4 )
+			SetKeyComment(Fields[2], Fields[3], Fields[1]);
+		else
+		if ( szOp == "S" && nFields == 3 )
+			SetSectionComment(Fields[1], Fields[2]);
+		else
+		if ( szOp == "C" && nFields == 3 )
+		{
+			if ( !HasSection(Fields[1]) )
+				CreateSection(Fields[1], Fields[2]);
+		}
+		else
+		if ( szOp == "X" && nFields == 3 )
+			DeleteKey(Fields[2], Fields[1]);
+		else
+		if ( szOp == "D" && nFields == 2 )
+			DeleteSection(Fields[1]);
+		else
+			Report(E_WARN, "[CDataFile::ReplayJournal] Skipping a malformed record in <%s.journal>.",
+				szFileName.c_str());
+	}
+
+	m_bJournalReplayed = true;
+}
+
+// Touch
+// Marks a section as modified, so that the incremental save knows to rewrite
+// it, and flags the data as changed. Must be called with m_Mutex held.
+// pSection may be NULL for changes that do not belong to any particular
+// section.
+void cdf::CDataFile::Touch(t_Section* pSection)
+{
+	unsigned long long nGeneration = m_nVersion.fetch_add(1, std::memory_order_relaxed) + 1;
+
+	if ( pSection )
+	{
+		pSection->bDirty = true;
+		pSection->bKeysHashed = false;
+		pSection->nGeneration = nGeneration;
+		pSection->pPublished.reset();
+	}
+	m_bUnpublished = true;
+
+	// The first change after a save wakes the persister up. Under a
+	// CWriteLock, Commit() does that once for all the changes.
+	if ( !m_bDirty && m_bPersistRun && m_nWriteDepth == 0 )
+		m_PersistCond.notify_one();
+
+	m_bDirty = true;
+}
+
+// IncludePath
+// Returns true if a trimmed line is an include directive, and sets szPath
+// to the file it names.
+static bool IncludePath(const t_Str &szLine, t_Str &szPath)
+{
+	size_t nSize = IncludeDirective.size();
+
+	if ( szLine.size() <= nSize || szLine.compare(0, nSize, IncludeDirective) != 0 ||
+		 (szLine[nSize] != ' ' && szLine[nSize] != '\t') )
+		return false;
+
+	size_t nStart = szLine.find_first_not_of(WhiteSpace, nSize);
+	size_t nEnd = szLine.find_last_not_of(WhiteSpace);
+
+	if ( nStart == t_Str::npos )
+		return false;
+
+	szPath.assign(szLine, nStart, nEnd - nStart + 1);
+	return true;
+}
+
+// Parse
+// Splits an in-memory copy of a file into lines and adds the sections, keys
+// and comments found to the section list. The byte range of every section is
+// recorded as we go; a section starts with the blank lines and comment
+// preceding its header, as SerializeSection() writes them, and ends where
+// the next one starts. Include directives are handed to Include() as they
+// come.
+void cdf::CDataFile::Parse(const char* pData, long long nLength, const t_Str &szFileName)
+{
+	t_Str szLine;
+	t_Str szComment;
+	t_Str szPath;
+	t_Section* pSection = GetSection("");
+	t_Str szSection = t_Str("");
+
+	long long nPos = 0;
+	long long nSectionPos = 0;
+	long long nLeadPos = -1;
+
+	while ( nPos < nLength )
+	{
+		const char* pEnd = (const char*)memchr(pData + nPos, '\n', (size_t)(nLength - nPos));
+		long long nLinePos = nPos;
+
+		nPos = pEnd ? (pEnd - pData) + 1 : nLength;
+		szLine.assign(pData + nLinePos, (size_t)((pEnd ? nPos - 1 : nPos) - nLinePos));
+		Trim(szLine);
+
+		if ( szLine.size() == 0 )
+		{
+			if ( nLeadPos < 0 )
+				nLeadPos = nLinePos;
+		}
+		else
+		if ( szLine.find_first_of(CommentIndicators) == 0 )
+		{
+			if ( nLeadPos < 0 )
+				nLeadPos = nLinePos;
+
+			szComment += "\n";
+			szComment += szLine;
+		}
+		else
+		if ( szLine.find_first_of('[') == 0 ) // new section
+		{
+			szLine.erase( 0, 1 );
+			if ( szLine.find_last_of(']') != t_Str::npos )
+				szLine.erase( szLine.find_last_of(']'), 1 );
+
+			long long nStart = nLeadPos < 0 ? nLinePos : nLeadPos;
+
+			if ( pSection )
+			{
+				pSection->nOffset = nSectionPos;
+				pSection->nLength = nStart - nSectionPos;
+			}
+
+			// A section that appears twice in the file can not be described
+			// by a single byte range. One that an included file brought in
+			// is ours from now on.
+			pSection = GetSection(szLine);
+
+			if ( pSection && pSection->bIncluded )
+			{
+				pSection->bIncluded = false;
+				pSection->szComment = szComment;
+			}
+			else
+			if ( !CreateSection(szLine, szComment) )
+				m_bSpansValid = false;
+
+			pSection = GetSection(szLine);
+			szSection = szLine;
+			nSectionPos = nStart;
+			szComment = t_Str("");
+			nLeadPos = -1;
+		}
+		else
+		if ( IncludePath(szLine, szPath) )
+		{
+			Include(szPath, szComment, szSection, szFileName);
+
+			pSection = GetSection(szSection);
+			szComment = t_Str("");
+			nLeadPos = -1;
+		}
+		else
+		if ( szLine.size() > 0 ) // we have a key, add this key/value pair
+		{
+			t_Str szKey = GetNextWord(szLine);
+			t_Str szValue = szLine;
+
+			if ( szKey.size() > 0 )
+			{
+				SetValue(szKey, szValue, szComment, szSection, CREATE_ALL);
+				szComment = t_Str("");
+				nLeadPos = -1;
+			}
+		}
+	}
+
+	if ( (pSection = GetSection(szSection)) != NULL )
+	{
+		pSection->nOffset = nSectionPos;
+		pSection->nLength = nLength - nSectionPos;
+	}
+}
+
+// ScanSections
+// Goes through the lines of a file the way Parse() does, but only looks at
+// what decides where sections start: blank lines, comment lines, and
+// section headers.
+// Any other line that Parse() takes for a key ends the comment a section
+// might start with. That is every line with more than whitespace and '='
+// or ':' in it, and, Trim() being what it is, some of those without: for
+// them we do just what Parse() does.
+bool cdf::CDataFile::ScanSections(const char* pData, long long nLength, std::vector<t_Span> &Spans)
+{
+	t_Str szTrimChars = WhiteSpace + EqualIndicators;
+	t_Str szLine;
+	t_Str szPath;
+	std::unordered_set<t_Str> Names;
+
+	long long nPos = 0;
+	long long nLeadPos = -1;
+
+	Spans.clear();
+	Spans.push_back(t_Span());
+	Names.insert(t_Str(""));
+
+	while ( nPos < nLength )
+	{
+		const char* pEnd = (const char*)memchr(pData + nPos, '\n', (size_t)(nLength - nPos));
+		long long nLinePos = nPos;
+		long long nLineEnd = pEnd ? pEnd - pData : nLength;
+		long long i = nLinePos;
+
+		nPos = pEnd ? nLineEnd + 1 : nLength;
+
+		while ( i < nLineEnd && szTrimChars.find(pData[i]) != t_Str::npos )
+			i++;
+
+		if ( i == nLineEnd )
+		{
+			szLine.assign(pData + nLinePos, (size_t)(nLineEnd - nLinePos));
+			Trim(szLine);
+
+			if ( szLine.size() == 0 )
+			{
+				if ( nLeadPos < 0 )
+					nLeadPos = nLinePos;
+			}
+			else
+			if ( GetNextWord(szLine).size() > 0 )
+				nLeadPos = -1;
+		}
+		else
+		if ( CommentIndicators.find(pData[i]) != t_Str::npos )
+		{
+			if ( nLeadPos < 0 )
+				nLeadPos = nLinePos;
+		}
+		else
+		if ( pData[i] == IncludeDirective[0] )
+		{
+			// Sections of other files can not be told apart from ours by
+			// their bytes.
+			szLine.assign(pData + nLinePos, (size_t)(nLineEnd - nLinePos));
+			Trim(szLine);
+
+			if ( IncludePath(szLine, szPath) )
+				return false;
+
+			nLeadPos = -1;
+		}
+		else
+		if ( pData[i] == '[' )
+		{
+			szLine.assign(pData + nLinePos, (size_t)(nLineEnd - nLinePos));
+			Trim(szLine);
+
+			szLine.erase( 0, 1 );
+			if ( szLine.find_last_of(']') != t_Str::npos )
+				szLine.erase( szLine.find_last_of(']'), 1 );
+
+			long long nStart = nLeadPos < 0 ? nLinePos : nLeadPos;
+
+			Spans.back().nLength = nStart - Spans.back().nOffset;
+			Spans.push_back(t_Span());
+			Spans.back().szName = szLine;
+			Spans.back().nOffset = nStart;
+			nLeadPos = -1;
+
+			if ( !Names.insert(LowerCase(szLine)).second )
+				return false;
+		}
+		else
+			nLeadPos = -1;
+	}
+
+	Spans.back().nLength = nLength - Spans.back().nOffset;
+
+	for (size_t i = 0; i < Spans.size(); i++)
+		Spans[i].nHash = HashBytes(pData + Spans[i].nOffset, (size_t)Spans[i].nLength);
+
+	return true;
+}
+
+// SectionSize
+// Returns the number of bytes SerializeSection() will write for a section.
+size_t cdf::CDataFile::SectionSize(const t_Section &Section) const
+{
+	size_t nSize = 0;
+	bool bWroteComment = false;
+
+	if ( Section.bIncluded )
+		return 0;
+
+	if ( Section.szComment.size() > 0 )
+	{
+		bWroteComment = true;
+		nSize += CommentStr(Section.szComment).size() + 2;
+	}
+
+	if ( Section.szName.size() > 0 )
+		nSize += (bWroteComment ? 0 : 1) + Section.szName.size() + 3;
+
+	for (KeyList::const_iterator k_pos = Section.Keys.begin(); k_pos != Section.Keys.end(); k_pos++)
+	{
+		if ( (*k_pos).szKey.size() == 0 || (*k_pos).bIncluded )
+			continue;
+
+		if ( (*k_pos).szComment.size() > 0 )
+			nSize += CommentStr((*k_pos).szComment).size() + 2;
+
+		nSize += (*k_pos).szKey.size() + (*k_pos).szValue.size() + 2;
+	}
+
+	return nSize;
+}
+
+// Put
+// Copies a string to pOut, returning the position just past it.
+static inline char* Put(char* pOut, const t_Str &szStr)
+{
+	memcpy(pOut, szStr.data(), szStr.size());
+	return pOut + szStr.size();
+}
+
+// SerializeSection
+// Writes the section, as it appears on disk, to pOut and returns the
+// position just past it. pOut must have room for SectionSize() bytes. This
+// is the one place that decides what a saved file looks like.
+char* cdf::CDataFile::SerializeSection(const t_Section &Section, char* pOut) const
+{
+	bool bWroteComment = false;
+
+	if ( Section.bIncluded )
+		return pOut;
+
+	if ( Section.szComment.size() > 0 )
+	{
+		bWroteComment = true;
+		*pOut++ = '\n';
+		pOut = Put(pOut, CommentStr(Section.szComment));
+		*pOut++ = '\n';
+	}
+
+	if ( Section.szName.size() > 0 )
+	{
+		if ( !bWroteComment )
+			*pOut++ = '\n';
+
+		*pOut++ = '[';
+		pOut = Put(pOut, Section.szName);
+		*pOut++ = ']';
+		*pOut++ = '\n';
+	}
+
+	for (KeyList::const_iterator k_pos = Section.Keys.begin(); k_pos != Section.Keys.end(); k_pos++)
+	{
+		const t_Key &Key = (*k_pos);
+
+		if ( Key.szKey.size() == 0 || Key.bIncluded )
+			continue;
+
+		if ( Key.szComment.size() > 0 )
+		{
+			*pOut++ = '\n';
+			pOut = Put(pOut, CommentStr(Key.szComment));
+			*pOut++ = '\n';
+		}
+
+		// Include directives are kept as keys, but do not read back as such.
+		pOut = Put(pOut, Key.szKey);
+		*pOut++ = Key.szKey == IncludeDirective ? ' ' : EqualIndicators[0];
+		pOut = Put(pOut, Key.szValue);
+		*pOut++ = '\n';
+	}
+
+	return pOut;
+}
+
+// SerializeAll
+// Renders every section into szOut, which is sized exactly once. If
+// pOffsets is given it receives the offset of each section, plus the total
+// size as a final entry.
+void cdf::CDataFile::SerializeAll(t_Str &szOut, std::vector<long long> *pOffsets) const
+{
+	std::vector<size_t> Sizes(m_Sections.size());
+	size_t nTotal = 0;
+	size_t i;
+
+	if ( pOffsets )
+		pOffsets->resize(m_Sections.size() + 1);
+
+	// With the original text at hand the sizes are not known up front, but
+	// the result will be close to the size of the original.
+	if ( m_bSourceValid && (m_Flags & PRESERVE_FORMAT) )
+	{
+		szOut.clear();
+		szOut.reserve(m_szSource.size() + m_szSource.size() / 8);
+
+		for (i = 0; i < m_Sections.size(); i++)
+		{
+			if ( pOffsets )
+				(*pOffsets)[i] = (long long)szOut.size();
+
+			RenderSection(m_Sections[i], szOut);
+		}
+
+		if ( pOffsets )
+			(*pOffsets)[i] = (long long)szOut.size();
+
+		return;
+	}
+
+	for (i = 0; i < m_Sections.size(); i++)
+	{
+		Sizes[i] = SectionSize(m_Sections[i]);
+		nTotal += Sizes[i];
+	}
+
+	szOut.resize(nTotal);
+
+	char* pBase = &szOut[0];
+	size_t nPos = 0;
+
+	for (i = 0; i < m_Sections.size(); i++)
+	{
+		if ( pOffsets )
+			(*pOffsets)[i] = (long long)nPos;
+
+		SerializeSection(m_Sections[i], pBase + nPos);
+		nPos += Sizes[i];
+	}
+
+	if ( pOffsets )
+		(*pOffsets)[i] = (long long)nPos;
+}
+
+// SerializeChunks
+// Renders all sections for Save(). With more than one save thread, the
+// section list is cut into contiguous ranges which are rendered into
+// separate chunks in parallel; written out in order the chunks are
+// identical to a sequential rendering. Offsets receives the offset of each
+// section in the output, plus the total size as a final entry.
+void cdf::CDataFile::SerializeChunks(std::vector<t_Str> &Chunks, std::vector<long long> &Offsets) const
+{
+	size_t nSections = m_Sections.size();
+	size_t nThreads = (size_t)m_nSaveThreads;
+	size_t t;
+
+	// Not worth a thread unless it gets a good number of sections.
+	if ( nThreads > nSections / MIN_SECTIONS_PER_THREAD )
+		nThreads = nSections / MIN_SECTIONS_PER_THREAD;
+
+	if ( nThreads <= 1 )
+	{
+		Chunks.resize(1);
+		SerializeAll(Chunks[0], &Offsets);
+		return;
+	}
+
+	Chunks.assign(nThreads, t_Str());
+	Offsets.resize(nSections + 1);
+
+	std::vector<std::thread> Workers;
+
+	for (t = 0; t < nThreads; t++)
+	{
+		Workers.push_back(std::thread(&CDataFile::SerializeRange, this,
+			nSections * t / nThreads, nSections * (t + 1) / nThreads,
+			std::ref(Chunks[t]), &Offsets[0]));
+	}
+
+	for (t = 0; t < nThreads; t++)
+		Workers[t].join();
+
+	// The workers recorded offsets within their own chunk.
+	long long nBase = 0;
+
+	for (t = 0; t < nThreads; t++)
+	{
+		for (size_t i = nSections * t / nThreads; i < nSections * (t + 1) / nThreads; i++)
+			Offsets[i] += nBase;
+
+		nBase += (long long)Chunks[t].size();
+	}
+
+	Offsets[nSections] = nBase;
+}
+
+// SerializeRange
+// Renders sections nBegin up to nEnd into szOut, the body of a save thread.
+// pOffsets receives the offset of each section within szOut.
+void cdf::CDataFile::SerializeRange(size_t nBegin, size_t nEnd, t_Str &szOut, long long* pOffsets) const
+{
+	size_t nSize = 0;
+	size_t i;
+
+	if ( !m_bSourceValid || !(m_Flags & PRESERVE_FORMAT) )
+	{
+		for (i = nBegin; i < nEnd; i++)
+			nSize += SectionSize(m_Sections[i]);
+
+		szOut.reserve(nSize);
+	}
+
+	for (i = nBegin; i < nEnd; i++)
+	{
+		pOffsets[i] = (long long)szOut.size();
+		RenderSection(m_Sections[i], szOut);
+	}
+}
+
+// RenderSection
+// Appends the section to szOut as Save() writes it. In PRESERVE_FORMAT mode
+// a section that has not changed since it was read is copied from the
+// original text, and one that has changed is patched line by line.
+void cdf::CDataFile::RenderSection(const t_Section &Section, t_Str &szOut) const
+{
+	if ( m_bSourceValid && (m_Flags & PRESERVE_FORMAT) && Section.nOffset >= 0 )
+	{
+		if ( Section.bDirty )
+			RenderLossless(Section, szOut);
+		else
+			szOut.append(m_szSource, (size_t)Section.nOffset, (size_t)Section.nLength);
+
+		return;
+	}
+
+	size_t nPos = szOut.size();
+
+	szOut.resize(nPos + SectionSize(Section));
+	SerializeSection(Section, &szOut[nPos]);
+}
+
+// AppendText
+// Appends szText to szOut, turning its line breaks into CR/LF if bCRLF.
+static void AppendText(t_Str &szOut, const t_Str &szText, bool bCRLF)
+{
+	for (size_t i = 0; i < szText.size(); i++)
+	{
+		if ( bCRLF && szText[i] == '\n' )
+			szOut += '\r';
+
+		szOut += szText[i];
+	}
+}
+
+
+// RenderLossless
+// Appends a modified section, walking its original text line by line the
+// way Parse() does. Lines of unmodified keys, blank lines and stray
+// comments are copied as they are. A key whose value changed keeps
+// everything up to the value (name, spacing, separator) and its line
+// ending. Keys whose comment changed are rewritten, deleted keys are
+// dropped along with their comment, and keys new to the section are added
+// after the last existing key.
+void cdf::CDataFile::RenderLossless(const t_Section &Section, t_Str &szOut) const
+{
+	const char* pData = m_szSource.data();
+	long long nPos = Section.nOffset;
+	long long nEnd = Section.nOffset + Section.nLength;
+	long long nPending = -1;		// comment lines not written out yet
+	size_t nInsert = szOut.size();	// where keys new to the section go
+	bool bInsertEol = false;		// the line before nInsert has no line break
+	bool bCRLF = false;
+	std::vector<bool> Written(Section.Keys.size(), false);
+	std::map<t_Str, size_t> Index;
+	t_Str szLine;
+	size_t i;
+
+	const char* pBreak = (const char*)memchr(pData + nPos, '\n', (size_t)(nEnd - nPos));
+	if ( pBreak && pBreak > pData + nPos && pBreak[-1] == '\r' )
+		bCRLF = true;
+
+	for (i = 0; i < Section.Keys.size(); i++)
+		Index.insert(std::make_pair(LowerCase(Section.Keys[i].szKey), i));
+
+	while ( nPos < nEnd )
+	{
+		pBreak = (const char*)memchr(pData + nPos, '\n', (size_t)(nEnd - nPos));
+
+		long long nLine = nPos;
+		long long nText = pBreak ? pBreak - pData : nEnd;
+
+		nPos = pBreak ? nText + 1 : nEnd;
+		szLine.assign(pData + nLine, (size_t)(nText - nLine));
+		Trim(szLine);
+
+		if ( szLine.find_first_of(CommentIndicators) == 0 )
+		{
+			if ( nPending < 0 )
+				nPending = nLine;
+			continue;
+		}
+
+		if ( szLine.size() == 0 )
+		{
+			if ( nPending < 0 )
+				szOut.append(pData + nLine, (size_t)(nPos - nLine));
+			continue;
+		}
+
+		long long nBlock = nPending < 0 ? nLine : nPending;
+		nPending = -1;
+
+		if ( szLine.find_first_of('[') == 0 )
+		{
+			// The section header, along with the comment before it.
+			if ( Section.bCommentChanged )
+			{
+				t_Section Header;
+				t_Str szHeader;
+
+				Header.szName = Section.szName;
+				Header.szComment = Section.szComment;
+				RenderSection(Header, szHeader);
+				AppendText(szOut, szHeader, bCRLF);
+			}
+			else
+				szOut.append(pData + nBlock, (size_t)(nPos - nBlock));
+
+			nInsert = szOut.size();
+			bInsertEol = pBreak == NULL;
+			continue;
+		}
+
+		std::map<t_Str, size_t>::const_iterator i_pos = Index.find(LowerCase(GetNextWord(szLine)));
+
+		if ( i_pos == Index.end() )
+			continue;	// deleted
+
+		const t_Key &Key = Section.Keys[i_pos->second];
+		bool bChanged = Key.bValueChanged || Key.bCommentChanged;
+
+		if ( Written[i_pos->second] )
+		{
+			// The key appears more than once. Keep the extra copies only
+			// while they still say what the first one does.
+			if ( !bChanged )
+				szOut.append(pData + nBlock, (size_t)(nPos - nBlock));
+			continue;
+		}
+
+		Written[i_pos->second] = true;
+
+		if ( Key.bCommentChanged )
+		{
+			t_Section Single;
+			t_Str szKey;
+
+			Single.Keys.push_back(Key);
+			RenderSection(Single, szKey);
+			AppendText(szOut, szKey, bCRLF);
+		}
+		else
+		if ( Key.bValueChanged )
+		{
+			long long nRaw = nText;
+			if ( nRaw > nLine && pData[nRaw-1] == '\r' )
+				nRaw--;
+
+			t_Str szRaw(pData + nLine, (size_t)(nRaw - nLine));
+			size_t nValue = szRaw.find_first_of(EqualIndicators);
+			t_Str szSkip = WhiteSpace + EqualIndicators;
+
+			if ( nValue == t_Str::npos )
+			{
+				szRaw += EqualIndicators[0];
+				nValue = szRaw.size();
+			}
+			else
+			{
+				while ( nValue < szRaw.size() && szSkip.find(szRaw[nValue]) != t_Str::npos )
+					nValue++;
+			}
+
+			szOut.append(pData + nBlock, (size_t)(nLine - nBlock));
+			szOut.append(szRaw, 0, nValue);
+			szOut += Key.szValue;
+			szOut.append(pData + nRaw, (size_t)(nPos - nRaw));
+		}
+		else
+			szOut.append(pData + nBlock, (size_t)(nPos - nBlock));
+
+		nInsert = szOut.size();
+		bInsertEol = pBreak == NULL;
+	}
+
+	if ( nPending >= 0 )
+		szOut.append(pData + nPending, (size_t)(nEnd - nPending));
+
+	// Keys that are new to the section go right after the last key.
+	t_Section Added;
+	t_Str szAdded;
+
+	for (i = 0; i < Section.Keys.size(); i++)
+	{
+		if ( !Written[i] )
+			Added.Keys.push_back(Section.Keys[i]);
+	}
+
+	if ( Added.Keys.size() == 0 )
+		return;
+
+	if ( bInsertEol )
+		szAdded = bCRLF ? "\r\n" : "\n";
+
+	t_Str szKeys;
+	RenderSection(Added, szKeys);
+	AppendText(szAdded, szKeys, bCRLF);
+
+	szOut.insert(nInsert, szAdded);
+}
+
+// MarkClean
+// Forgets which sections and keys were modified, after the data has been
+// loaded or saved. Leaves the dirty flag to the caller.
+void cdf::CDataFile::MarkClean()
+{
+	for (SectionItor s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+	{
+		if ( !(*s_pos).bDirty )
+			continue;
+
+		(*s_pos).bDirty = false;
+		(*s_pos).bCommentChanged = false;
+
+		for (KeyItor k_pos = (*s_pos).Keys.begin(); k_pos != (*s_pos).Keys.end(); k_pos++)
+		{
+			(*k_pos).bValueChanged = false;
+			(*k_pos).bCommentChanged = false;
+		}
+	}
+}
+
+#ifndef WIN32
+// WriteAll
+// write()s the whole buffer, at nOffset or (if negative) at the current
+// file position. Returns false on error.
+static bool WriteAll(int fd, const char* pData, size_t nLength, long long nOffset)
+{
+	while ( nLength > 0 )
+	{
+		ssize_t nDone = nOffset < 0 ? write(fd, pData, nLength)
+		                            : pwrite(fd, pData, nLength, (off_t)nOffset);
+		if ( nDone < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			return false;
+		}
+
+		pData += nDone;
+		nLength -= nDone;
+		if ( nOffset >= 0 )
+			nOffset += nDone;
+	}
+
+	return true;
+}
+
+// CopyRange
+// Appends nLength bytes, starting at nOffset in file src, to file dst. Uses
+// copy_file_range() where available, so the data does not pass through user
+// space (and may even be shared by the filesystem).
+static bool CopyRange(int src, long long nOffset, long long nLength, int dst)
+{
+#if defined(__linux__)
+	while ( nLength > 0 )
+	{
+		loff_t nIn = (loff_t)nOffset;
+		ssize_t nDone = copy_file_range(src, &nIn, dst, NULL, (size_t)nLength, 0);
+
+		if ( nDone < 0 && errno == EINTR )
+			continue;
+		if ( nDone <= 0 )
+			break;	// not supported here, use the plain copy below
+
+		nOffset += nDone;
+		nLength -= nDone;
+	}
+#endif
+
+	char buffer[65536];
+
+	while ( nLength > 0 )
+	{
+		size_t nWant = nLength < (long long)sizeof(buffer) ? (size_t)nLength : sizeof(buffer);
+		ssize_t nDone = pread(src, buffer, nWant, (off_t)nOffset);
+
+		if ( nDone < 0 && errno == EINTR )
+			continue;
+		if ( nDone <= 0 || !WriteAll(dst, buffer, (size_t)nDone, -1) )
+			return false;
+
+		nOffset += nDone;
+		nLength -= nDone;
+	}
+
+	return true;
+}
+
+// Replaceable
+// Returns true if a file can be replaced by a new one without losing
+// anything a full save, which writes into the file itself, would keep, and
+// sets szTarget to the path to replace: the file a link points to, not the
+// link. A file with more than one name, or with extended attributes (ACLs
+// among them), which a new file would not have, is not replaceable. The
+// owner and permissions are copied over by the caller.
+static bool Replaceable(const t_Str &szFileName, const struct stat &st, t_Str &szTarget)
+{
+	char szPath[PATH_MAX];
+
+	if ( !S_ISREG(st.st_mode) || st.st_nlink > 1 || realpath(szFileName.c_str(), szPath) == NULL )
+		return false;
+
+	szTarget = szPath;
+
+#if defined(__linux__)
+	ssize_t nAttributes = listxattr(szTarget.c_str(), NULL, 0);
+
+	if ( nAttributes != 0 && !(nAttributes < 0 && errno == ENOTSUP) )
+		return false;
+#endif
+
+	return true;
+}
+#endif
+
+// SaveIncremental
+// Writes out only the sections that changed since the file was last loaded
+// or saved. If every changed section fits into the bytes it used to occupy
+// (and no sections were added, removed or reordered) the file is patched in
+// place, padding with empty lines, as long as that takes no more than
+// MAX_SAVE_PADDING of them; a section that keeps shrinking would otherwise
+// leave the file ever emptier. Otherwise a new file is assembled from
+// the changed sections and the unchanged byte ranges of the old file, next
+// to the file a link points to, and renamed over it once it is on disk.
+// Returns false without touching the file if the section ranges are unknown,
+// the file was changed by someone else, or replacing it would lose anything
+// a full save keeps.
+bool cdf::CDataFile::SaveIncremental()
+{
+#ifdef WIN32
+	return false;
+#else
+	if ( !m_bSpansValid )
+		return false;
+
+	t_FileStamp Stamp;
+	struct stat st;
+
+	if ( !GetFileStamp(m_szFileName, Stamp) || !(Stamp == m_FileStamp)
+		|| stat(m_szFileName.c_str(), &st) != 0 )
+	{
+		Report(E_INFO, "[CDataFile::SaveIncremental] <%s> has changed on disk, saving all of it.",
+			m_szFileName.c_str());
+		return false;
+	}
+
+	// Render the changed sections, and see whether they can go in place.
+	std::vector<t_Str> Rendered(m_Sections.size());
+	bool bInPlace = true;
+	long long nExpect = 0;
+	long long nPadding = 0;
+	size_t i;
+
+	for (i = 0; i < m_Sections.size(); i++)
+	{
+		const t_Section &Section = m_Sections[i];
+
+		// Not saved, so not in the file either.
+		if ( Section.bIncluded )
+			continue;
+
+		if ( Section.nOffset != nExpect )
+			bInPlace = false;
+
+		if ( Section.bDirty || Section.nOffset < 0 )
+		{
+			RenderSection(Section, Rendered[i]);
+
+			if ( (long long)Rendered[i].size() > Section.nLength )
+				bInPlace = false;
+			else
+				nPadding += Section.nLength - (long long)Rendered[i].size();
+		}
+
+		nExpect = Section.nOffset + Section.nLength;
+	}
+
+	if ( nExpect != Stamp.nSize || nPadding > MAX_SAVE_PADDING )
+		bInPlace = false;
+
+	if ( bInPlace )
+	{
+		// Opened on first use; if nothing needs writing the file is not
+		// even opened, so watchers see no activity at all.
+		int fd = -1;
+
+		for (i = 0; i < m_Sections.size(); i++)
+		{
+			const t_Section &Section = m_Sections[i];
+
+			if ( !Section.bDirty || Section.bIncluded )
+				continue;
+
+			// Pad with empty lines, which Load() skips.
+			Rendered[i].append((size_t)Section.nLength - Rendered[i].size(), '\n');
+
+			// Modified, but back to what the file allready holds.
+			unsigned long long nHash = HashBytes(Rendered[i].data(), Rendered[i].size());
+			if ( nHash == Section.nHash )
+				continue;
+
+			if ( fd < 0 && (fd = open(m_szFileName.c_str(), O_WRONLY)) < 0 )
+				return false;
+
+			if ( !WriteAll(fd, Rendered[i].data(), Rendered[i].size(), Section.nOffset) )
+			{
+				Report(E_ERROR, "[CDataFile::SaveIncremental] Unable to write file <%s>.",
+					m_szFileName.c_str());
+				close(fd);
+				m_bSpansValid = false;
+				return false;
+			}
+
+			m_Sections[i].nHash = nHash;
+
+			if ( m_bSourceValid )
+				m_szSource.replace((size_t)Section.nOffset, Rendered[i].size(), Rendered[i]);
+		}
+
+		if ( fd >= 0 )
+			close(fd);
+	}
+	else
+	{
+		t_Str szTarget;
+
+		if ( !Replaceable(m_szFileName, st, szTarget) )
+		{
+			Report(E_INFO, "[CDataFile::SaveIncremental] <%s> can not be replaced, saving all of it.",
+				m_szFileName.c_str());
+			return false;
+		}
+
+		// Named uniquely, so that two processes saving at once do not
+		// write into the same file.
+		t_Str szTemp = szTarget + ".XXXXXX";
+		int src = open(szTarget.c_str(), O_RDONLY);
+		int dst = mkstemp(&szTemp[0]);
+
+		// The owner first, since changing it may clear the set-id bits.
+		bool bOk = src >= 0 && dst >= 0 && fchown(dst, st.st_uid, st.st_gid) == 0
+			&& fchmod(dst, st.st_mode & 07777) == 0;
+
+		if ( dst >= 0 && !bOk )
+		{
+			close(dst);
+			unlink(szTemp.c_str());
+			if ( src >= 0 )
+				close(src);
+
+			Report(E_INFO, "[CDataFile::SaveIncremental] <%s> can not be replaced, saving all of it.",
+				m_szFileName.c_str());
+			return false;
+		}
+
+		std::vector<long long> Offsets(m_Sections.size());
+		std::vector<unsigned long long> Hashes(m_Sections.size());
+		long long nOut = 0;
+		t_Str szSource;
+
+		for (i = 0; bOk && i < m_Sections.size(); i++)
+		{
+			const t_Section &Section = m_Sections[i];
+
+			Offsets[i] = nOut;
+			if ( Section.bDirty || Section.nOffset < 0 )
+			{
+				bOk = WriteAll(dst, Rendered[i].data(), Rendered[i].size(), -1);
+				nOut += Rendered[i].size();
+				Hashes[i] = HashBytes(Rendered[i].data(), Rendered[i].size());
+
+				if ( m_bSourceValid )
+					szSource += Rendered[i];
+			}
+			else
+			{
+				bOk = CopyRange(src, Section.nOffset, Section.nLength, dst);
+				nOut += Section.nLength;
+				Hashes[i] = Section.nHash;
+
+				if ( m_bSourceValid )
+					szSource.append(m_szSource, (size_t)Section.nOffset, (size_t)Section.nLength);
+			}
+		}
+
+		// On disk before it replaces the file, or a crash could leave an
+		// empty file where the old one was.
+		if ( bOk && fsync(dst) != 0 )
+			bOk = false;
+
+		if ( src >= 0 )
+			close(src);
+		if ( dst >= 0 && close(dst) != 0 )
+			bOk = false;
+
+		if ( !bOk || rename(szTemp.c_str(), szTarget.c_str()) != 0 )
+		{
+			Report(E_ERROR, "[CDataFile::SaveIncremental] Unable to write file <%s>.",
+				szTemp.c_str());
+			unlink(szTemp.c_str());
+			return false;
+		}
+
+		for (i = 0; i < m_Sections.size(); i++)
+		{
+			m_Sections[i].nHash = Hashes[i];
+			m_Sections[i].nLength = i + 1 < m_Sections.size() ? Offsets[i+1] - Offsets[i]
+			                                                  : nOut - Offsets[i];
+			m_Sections[i].nOffset = Offsets[i];
+		}
+
+		m_szSource.swap(szSource);
+	}
+
+	MarkClean();
+	m_bDirty = false;
+	m_bSpansValid = GetFileStamp(m_szFileName, m_FileStamp);
+
+	return true;
+#endif
+}
+
+t_Str cdf::CDataFile::CommentStr(t_Str szComment)
+{
+	t_Str szNewStr = t_Str("");
+
+	Trim(szComment);
+
+		if ( szComment.size() == 0 )
+			return szComment;
+
+	if ( szComment.find_first_of(CommentIndicators) != 0 )
+	{
+		szNewStr = CommentIndicators[0];
+		szNewStr += " ";
+	}
+
+	szNewStr += szComment;
+
+	return szNewStr;
+}
+
+
+
+// CSnapshot ////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////
+
+// CSnapshot
+// Pins the snapshot the data file has published. Posting our epoch before
+// loading the pointer guarantees that the writer will not free it under us.
+cdf::CSnapshot::CSnapshot(const CDataFile &DataFile)
 {
-	t_Str szValue = bValue ?  "True" : "False";
+	EnterEpoch();
+	m_pSnapshot = DataFile.m_pSnapshot.load();
+}
 
-	return SetValue(szKey, szValue, szComment, szSection);
+// ~CSnapshot
+// Lets go of the snapshot.
+cdf::CSnapshot::~CSnapshot()
+{
+	LeaveEpoch();
+}
+
+// IsValid
+// Returns true if there is a snapshot to read from.
+bool cdf::CSnapshot::IsValid() const
+{
+	return m_pSnapshot != NULL;
+}
+
+// GetSection
+// Looks up a section by name, NULL if it is not in the snapshot.
+const t_Section* cdf::CSnapshot::GetSection(const t_Str &szSection) const
+{
+	if ( m_pSnapshot == NULL )
+		return NULL;
+
+	for (size_t i = 0; i < m_pSnapshot->Sections.size(); i++)
+	{
+		if ( CompareNoCase(m_pSnapshot->Sections[i]->szName, szSection) == 0 )
+			return m_pSnapshot->Sections[i].get();
+	}
+
+	return NULL;
+}
+
+// GetKey
+// Looks up a key in a section, NULL if it is not in the snapshot.
+const t_Key* cdf::CSnapshot::GetKey(const t_Str &szKey, const t_Str &szSection) const
+{
+	const t_Section* pSection = GetSection(szSection);
+
+	if ( pSection == NULL )
+		return NULL;
+
+	for (KeyList::const_iterator k_pos = pSection->Keys.begin(); k_pos != pSection->Keys.end(); k_pos++)
+	{
+		if ( CompareNoCase((*k_pos).szKey, szKey) == 0 )
+			return &(*k_pos);
+	}
+
+	return NULL;
 }
 
 // GetValue
-// Obtains the key value as a t_Str object. Returns false
-// if the key could not be found.
-bool cdf::CDataFile::GetValue(const t_Str &szKey, const t_Str &szSection, t_Str& ret)
+// Obtains the raw value of a key. Returns false if it is not found.
+bool cdf::CSnapshot::GetValue(const t_Str &szKey, const t_Str &szSection, t_Str &ret) const
 {
-	t_Key* pKey = GetKey(szKey, szSection);
-	if( ! pKey )
+	const t_Key* pKey = GetKey(szKey, szSection);
+	if ( ! pKey )
 		return false;
 
 	ret = pKey->szValue;
@@ -424,280 +3843,730 @@ bool cdf::CDataFile::GetValue(const t_Str &szKey, const t_Str &szSection, t_Str&
 }
 
 // GetString
-// Obtains the key value as a t_Str object. Returns false
-// if the key could not be found.
-bool cdf::CDataFile::GetString(const t_Str &szKey, const t_Str &szSection, t_Str &ret)
+// Obtains the value of a key as a t_Str.
+bool cdf::CSnapshot::GetString(const t_Str &szKey, const t_Str &szSection, t_Str &ret) const
 {
 	return GetValue(szKey, szSection, ret);
 }
 
 // GetFloat
-// Obtains the key value as a float type. Returns false if the key is
-// not found.
-bool cdf::CDataFile::GetFloat(const t_Str &szKey, const t_Str &szSection, float &ret)
+// Obtains the value of a key as a float.
+bool cdf::CSnapshot::GetFloat(const t_Str &szKey, const t_Str &szSection, float &ret) const
 {
-	t_Str szValue;
-	if( ! GetValue(szKey, szSection, szValue) )
-		return false;
-
-	float x;
-	if( (std::istringstream(szValue) >> x).fail() )
-		return false;
+	const t_Key* pKey = GetKey(szKey, szSection);
 
-	ret = x;
-	return true;
+	return pKey && ToFloat(pKey->szValue, ret);
 }
 
 // GetInt
-// Obtains the key value as an integer type. Returns false if the key is
-// not found.
-bool cdf::CDataFile::GetInt(const t_Str &szKey, const t_Str &szSection, int &ret)
+// Obtains the value of a key as an int.
+bool cdf::CSnapshot::GetInt(const t_Str &szKey, const t_Str &szSection, int &ret) const
 {
-	t_Str szValue;
-	if( ! GetValue(szKey, szSection, szValue) )
-		return false;
-
-	int n;
-	if( (std::istringstream(szValue) >> n).fail() )
-		return false;
+	const t_Key* pKey = GetKey(szKey, szSection);
 
-	ret = n;
-	return true;
+	return pKey && ToInt(pKey->szValue, ret);
 }
 
 // GetBool
-// Obtains the key value as a bool type. Returns false if the key is
-// not found.
-bool cdf::CDataFile::GetBool(const t_Str &szKey, const t_Str &szSection, bool &ret)
+// Obtains the value of a key as a bool.
+bool cdf::CSnapshot::GetBool(const t_Str &szKey, const t_Str &szSection, bool &ret) const
 {
-	t_Str szValue;
-	if( ! GetValue(szKey, szSection, szValue) )
-		return false;
+	const t_Key* pKey = GetKey(szKey, szSection);
 
-	ret = false;
-	if ( szValue.find("1") == 0
-		|| CompareNoCase(szValue, "true") == 0
-		|| CompareNoCase(szValue, "yes") == 0 ) {
-		ret = true;
-	}
+	return pKey && ToBool(pKey->szValue, ret);
+}
 
-	return true;
+// HasSection
+// Returns true if the section is in the snapshot.
+bool cdf::CSnapshot::HasSection(const t_Str &szSection) const
+{
+	return GetSection(szSection) != NULL;
+}
+
+// SectionCount
+// Returns the number of sections in the snapshot.
+int cdf::CSnapshot::SectionCount() const
+{
+	return m_pSnapshot ? (int)m_pSnapshot->Sections.size() : 0;
+}
+
+// KeyCount
+// Returns the number of keys in the snapshot, across all sections.
+int cdf::CSnapshot::KeyCount() const
+{
+	return m_pSnapshot ? m_pSnapshot->nKeys : 0;
+}
+
+
+// CTransaction /////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////
+
+// CTransaction
+// Starts out with no changes staged.
+cdf::CTransaction::CTransaction(CDataFile &DataFile) : m_DataFile(DataFile)
+{
+}
+
+// Stage
+// Adds a change to the end of the list.
+void cdf::CTransaction::Stage(e_Operation Op, const t_Str &szSection, const t_Str &szKey,
+	const t_Str &szValue, const t_Str &szComment)
+{
+	m_Operations.push_back(t_Operation());
+
+	t_Operation &Operation = m_Operations.back();
+
+	Operation.Op = Op;
+	Operation.szSection = szSection;
+	Operation.szKey = szKey;
+	Operation.szValue = szValue;
+	Operation.szComment = szComment;
+}
+
+// SetValue
+// Stages setting the value of a key.
+void cdf::CTransaction::SetValue(const t_Str &szKey, const t_Str &szValue,
+	const t_Str &szComment, const t_Str &szSection)
+{
+	Stage(OP_SET_VALUE, szSection, szKey, szValue, szComment);
+}
+
+// SetFloat
+// Stages setting a key to a float, formatted as CDataFile::SetFloat would.
+void cdf::CTransaction::SetFloat(const t_Str &szKey, float fValue,
+	const t_Str &szComment, const t_Str &szSection)
+{
+	char szStr[64];
+
+	snprintf(szStr, 64, "%g", fValue);
+
+	SetValue(szKey, szStr, szComment, szSection);
+}
+
+// SetInt
+// Stages setting a key to an int.
+void cdf::CTransaction::SetInt(const t_Str &szKey, int nValue,
+	const t_Str &szComment, const t_Str &szSection)
+{
+	char szStr[64];
+
+	snprintf(szStr, 64, "%d", nValue);
+
+	SetValue(szKey, szStr, szComment, szSection);
+}
+
+// SetBool
+// Stages setting a key to a bool.
+void cdf::CTransaction::SetBool(const t_Str &szKey, bool bValue,
+	const t_Str &szComment, const t_Str &szSection)
+{
+	SetValue(szKey, bValue ? "True" : "False", szComment, szSection);
+}
+
+// CreateKey
+// Stages creating (or setting) a key.
+void cdf::CTransaction::CreateKey(const t_Str &szKey, const t_Str &szValue,
+	const t_Str &szComment, const t_Str &szSection)
+{
+	Stage(OP_CREATE_KEY, szSection, szKey, szValue, szComment);
+}
+
+// DeleteKey
+// Stages deleting a key.
+void cdf::CTransaction::DeleteKey(const t_Str &szKey, const t_Str &szFromSection)
+{
+	Stage(OP_DELETE_KEY, szFromSection, szKey, t_Str(""), t_Str(""));
+}
+
+// CreateSection
+// Stages creating a section.
+void cdf::CTransaction::CreateSection(const t_Str &szSection, const t_Str &szComment)
+{
+	Stage(OP_CREATE_SECTION, szSection, t_Str(""), t_Str(""), szComment);
 }
 
 // DeleteSection
-// Delete a specific section. Returns false if the section cannot be
-// found or true when sucessfully deleted.
-bool cdf::CDataFile::DeleteSection(const t_Str &szSection)
+// Stages deleting a section.
+void cdf::CTransaction::DeleteSection(const t_Str &szSection)
 {
-	SectionItor s_pos;
+	Stage(OP_DELETE_SECTION, szSection, t_Str(""), t_Str(""), t_Str(""));
+}
 
-	for (s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+// Commit
+// Hands the staged changes to the data file, which makes all of them or
+// none.
+bool cdf::CTransaction::Commit()
+{
+	std::vector<t_Operation> Operations;
+
+	Operations.swap(m_Operations);
+
+	if ( Operations.size() == 0 )
+		return true;
+
+	return m_DataFile.Apply(Operations);
+}
+
+// Discard
+// Drops the staged changes without making them.
+void cdf::CTransaction::Discard()
+{
+	m_Operations.clear();
+}
+
+// Count
+// Returns the number of staged changes.
+int cdf::CTransaction::Count() const
+{
+	return (int)m_Operations.size();
+}
+
+
+// CLayeredDataFile /////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////
+
+// CLayeredDataFile
+// An empty view.
+cdf::CLayeredDataFile::CLayeredDataFile()
+{
+	t_Index* pIndex = new t_Index;
+
+	pIndex->nDirty = 0;
+	pIndex->nRetired = 0;
+	pIndex->pNext = NULL;
+
+	m_nDirty = 0;
+	m_pIndex = pIndex;
+	m_pRetired = NULL;
+}
+
+// ~CLayeredDataFile
+// Stops the layers from bumping our counter, and frees the indexes. No one
+// can be reading by now.
+cdf::CLayeredDataFile::~CLayeredDataFile()
+{
+	for (size_t i = 0; i < m_Layers.size(); i++)
 	{
-		if ( CompareNoCase( (*s_pos).szName, szSection ) == 0 )
+		CDataFile* pFile = m_Layers[i].pFile;
+		std::lock_guard<CSharedMutex> Lock(pFile->m_Mutex);
+		std::vector<std::atomic<unsigned long long>*>::iterator pos =
+			std::find(pFile->m_Dependents.begin(), pFile->m_Dependents.end(), &m_nDirty);
+
+		if ( pos != pFile->m_Dependents.end() )
+			pFile->m_Dependents.erase(pos);
+	}
+
+	delete m_pIndex.load();
+
+	while ( m_pRetired )
+	{
+		t_Index* pIndex = m_pRetired;
+		m_pRetired = pIndex->pNext;
+		delete pIndex;
+	}
+}
+
+// AddLayer
+// Puts the layer on top, and has it bump our counter from now on. It has
+// not been indexed yet, so the next read indexes every section it has.
+void cdf::CLayeredDataFile::AddLayer(CDataFile &Layer)
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+
+	m_Layers.push_back(t_Layer());
+	m_Layers.back().pFile = &Layer;
+	m_Layers.back().nGeneration = ~0ULL;
+
+	{
+		std::lock_guard<CSharedMutex> LayerLock(Layer.m_Mutex);
+		Layer.m_Dependents.push_back(&m_nDirty);
+	}
+
+	m_nDirty++;
+}
+
+// LayerCount
+// Returns the number of layers.
+int cdf::CLayeredDataFile::LayerCount()
+{
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+
+	return (int)m_Layers.size();
+}
+
+// Current
+// Returns the published index if no layer has changed since it was made.
+// Otherwise one is made first, by this thread or another one that got
+// there before us.
+const cdf::CLayeredDataFile::t_Index* cdf::CLayeredDataFile::Current()
+{
+	const t_Index* pIndex = m_pIndex.load();
+
+	if ( pIndex->nDirty == m_nDirty.load() )
+		return pIndex;
+
+	{
+		std::lock_guard<std::mutex> Lock(m_Mutex);
+		Refresh();
+	}
+
+	return m_pIndex.load();
+}
+
+// Refresh
+// Finds the sections that were added, changed or deleted in any layer since
+// it was last looked at, by their generations, and resolves their keys
+// again in a copy of the index, which then replaces it. The counter is read
+// before the layers, so that a change made meanwhile is caught on the next
+// read. The replaced index is freed once no reader can be using it.
+void cdf::CLayeredDataFile::Refresh()
+{
+	unsigned long long nDirty = m_nDirty.load();
+	t_Index* pOld = m_pIndex.load();
+
+	if ( pOld->nDirty == nDirty )
+		return;
+
+	std::unordered_set<t_Str> Changed;
+
+	for (size_t i = 0; i < m_Layers.size(); i++)
+	{
+		t_Layer &Layer = m_Layers[i];
+		unsigned long long nGeneration = Layer.pFile->Generation();
+
+		if ( nGeneration == Layer.nGeneration )
+			continue;
+
+		std::unordered_map<t_Str, unsigned long long> Sections;
+
 		{
-			m_Sections.erase(s_pos);
-			return true;
+			std::shared_lock<CSharedMutex> LayerLock = Layer.pFile->ReadLock();
+			std::vector< std::shared_lock<CSharedMutex> > SectionLocks;
+
+			Layer.pFile->ReadAllSections(SectionLocks);
+
+			for (SectionItor s_pos = Layer.pFile->m_Sections.begin(); s_pos != Layer.pFile->m_Sections.end(); s_pos++)
+			{
+				t_Str szName = LowerCase((*s_pos).szName);
+				std::unordered_map<t_Str, unsigned long long>::iterator pos = Layer.Sections.find(szName);
+
+				if ( pos == Layer.Sections.end() || pos->second != (*s_pos).nGeneration )
+					Changed.insert(szName);
+
+				Sections.emplace(szName, (*s_pos).nGeneration);
+			}
+		}
+
+		for (std::unordered_map<t_Str, unsigned long long>::iterator pos = Layer.Sections.begin();
+			 pos != Layer.Sections.end(); pos++)
+		{
+			if ( Sections.find(pos->first) == Sections.end() )
+				Changed.insert(pos->first);
 		}
+
+		Layer.Sections.swap(Sections);
+		Layer.nGeneration = nGeneration;
 	}
 
-	return false;
+	t_Index* pIndex = new t_Index;
+
+	pIndex->Sections = pOld->Sections;
+	pIndex->nDirty = nDirty;
+	pIndex->nRetired = 0;
+	pIndex->pNext = NULL;
+
+	for (std::unordered_set<t_Str>::iterator pos = Changed.begin(); pos != Changed.end(); pos++)
+		IndexSection(*pos, *pIndex);
+
+	m_pIndex = pIndex;
+
+	pOld->nRetired = s_nEpoch.fetch_add(1);
+	pOld->pNext = m_pRetired;
+	m_pRetired = pOld;
+
+	unsigned long long nOldest = OldestEpoch();
+	t_Index** ppIndex = &m_pRetired;
+
+	while ( *ppIndex )
+	{
+		t_Index* pRetired = *ppIndex;
+
+		if ( pRetired->nRetired < nOldest )
+		{
+			*ppIndex = pRetired->pNext;
+			delete pRetired;
+		}
+		else
+			ppIndex = &pRetired->pNext;
+	}
 }
 
-// DeleteKey
-// Delete a specific key in a specific section. Returns false if the key
-// cannot be found or true when sucessfully deleted.
-bool cdf::CDataFile::DeleteKey(const t_Str &szKey, const t_Str &szFromSection)
+// IndexSection
+// Goes through the layers from the top down, adding the keys of the section
+// that no layer above had. The section is left out of the index if no layer
+// has it.
+void cdf::CLayeredDataFile::IndexSection(const t_Str &szSection, t_Index &Index)
 {
-	KeyItor k_pos;
-	t_Section* pSection;
+	std::shared_ptr<ResolvedKeys> pKeys = std::make_shared<ResolvedKeys>();
+	bool bFound = false;
+
+	for (int i = (int)m_Layers.size() - 1; i >= 0; i--)
+	{
+		CDataFile* pFile = m_Layers[i].pFile;
+		std::shared_lock<CSharedMutex> Lock = pFile->ReadLock();
+		std::shared_lock<CSharedMutex> SectionLock = pFile->ReadSection(szSection);
+		t_Section* pSection = pFile->GetSection(szSection);
+
+		if ( pSection == NULL )
+			continue;
+
+		bFound = true;
+
+		for (KeyItor k_pos = pSection->Keys.begin(); k_pos != pSection->Keys.end(); k_pos++)
+		{
+			if ( (*k_pos).szKey.size() == 0 )
+				continue;
+
+			t_Resolved Resolved;
+
+			Resolved.szValue = (*k_pos).szValue;
+			Resolved.nLayer = i;
+
+			pKeys->emplace(LowerCase((*k_pos).szKey), Resolved);
+		}
+	}
+
+	if ( bFound )
+		Index.Sections[szSection] = pKeys;
+	else
+		Index.Sections.erase(szSection);
+}
+
+// Lookup
+// Reads the index inside an epoch, so that it can not be freed under us.
+bool cdf::CLayeredDataFile::Lookup(const t_Str &szKey, const t_Str &szSection, t_Str &szValue,
+	int &nLayer)
+{
+	EnterEpoch();
 
-	if ( (pSection = GetSection(szFromSection)) == NULL )
-		return false;
+	const t_Index* pIndex = Current();
+	std::unordered_map< t_Str, std::shared_ptr<const ResolvedKeys> >::const_iterator s_pos =
+		pIndex->Sections.find(LowerCase(szSection));
+	bool bFound = false;
 
-	for (k_pos = pSection->Keys.begin(); k_pos != pSection->Keys.end(); k_pos++)
+	if ( s_pos != pIndex->Sections.end() )
 	{
-		if ( CompareNoCase( (*k_pos).szKey, szKey ) == 0 )
+		ResolvedKeys::const_iterator k_pos = s_pos->second->find(LowerCase(szKey));
+
+		if ( k_pos != s_pos->second->end() )
 		{
-			pSection->Keys.erase(k_pos);
-			return true;
+			szValue = k_pos->second.szValue;
+			nLayer = k_pos->second.nLayer;
+			bFound = true;
 		}
 	}
 
-	return false;
+	LeaveEpoch();
+
+	return bFound;
 }
 
-// CreateKey
-// Given a key, a value and a section, this function will attempt to locate the
-// Key within the given section, and if it finds it, change the keys value to
-// the new value. If it does not locate the key, it will create a new key with
-// the proper value and place it in the section requested.
-bool cdf::CDataFile::CreateKey(const t_Str &szKey, const t_Str &szValue, const t_Str &szComment, const t_Str &szSection)
+// FindLayer
+// Returns the layer a key is resolved from, -1 if none has it.
+int cdf::CLayeredDataFile::FindLayer(const t_Str &szKey, const t_Str &szSection)
 {
-	bool bAutoKey = (m_Flags & AUTOCREATE_KEYS) == AUTOCREATE_KEYS;
-	bool bReturn  = false;
-
-	m_Flags |= AUTOCREATE_KEYS;
+	t_Str szValue;
+	int nLayer;
 
-	bReturn = SetValue(szKey, szValue, szComment, szSection);
+	return Lookup(szKey, szSection, szValue, nLayer) ? nLayer : -1;
+}
 
-	if ( !bAutoKey )
-		m_Flags &= ~AUTOCREATE_KEYS;
+// GetValue
+// Obtains the raw value of a key. Returns false if no layer has it.
+bool cdf::CLayeredDataFile::GetValue(const t_Str &szKey, const t_Str &szSection, t_Str &ret)
+{
+	int nLayer;
 
-	return bReturn;
+	return Lookup(szKey, szSection, ret, nLayer);
 }
 
-
-// CreateSection
-// Given a section name, this function first checks to see if the given section
-// allready exists in the list or not, if not, it creates the new section and
-// assigns it the comment given in szComment.  The function returns true if
-// sucessfully created, or false otherwise.
-bool cdf::CDataFile::CreateSection(const t_Str &szSection, const t_Str &szComment)
+// GetString
+// Obtains the value of a key as a t_Str.
+bool cdf::CLayeredDataFile::GetString(const t_Str &szKey, const t_Str &szSection, t_Str &ret)
 {
-	t_Section* pSection = GetSection(szSection);
+	return GetValue(szKey, szSection, ret);
+}
 
-	if ( pSection )
-	{
-		Report(E_INFO, "[CDataFile::CreateSection] Section <%s> allready exists. Aborting.", szSection.c_str());
-		return false;
-	}
+// GetFloat
+// Obtains the value of a key as a float.
+bool cdf::CLayeredDataFile::GetFloat(const t_Str &szKey, const t_Str &szSection, float &ret)
+{
+	t_Str szValue;
 
-	pSection = new t_Section;
+	return GetValue(szKey, szSection, szValue) && ToFloat(szValue, ret);
+}
 
-	pSection->szName = szSection;
-	pSection->szComment = szComment;
-	m_Sections.push_back(*pSection);
-	m_bDirty = true;
+// GetInt
+// Obtains the value of a key as an int.
+bool cdf::CLayeredDataFile::GetInt(const t_Str &szKey, const t_Str &szSection, int &ret)
+{
+	t_Str szValue;
 
-	return true;
+	return GetValue(szKey, szSection, szValue) && ToInt(szValue, ret);
 }
 
-// CreateSection
-// Given a section name, this function first checks to see if the given section
-// allready exists in the list or not, if not, it creates the new section and
-// assigns it the comment given in szComment.  The function returns true if
-// sucessfully created, or false otherwise. This version accpets a KeyList
-// and sets up the newly created Section with the keys in the list.
-bool cdf::CDataFile::CreateSection(const t_Str &szSection, const t_Str &szComment, KeyList Keys)
+// GetBool
+// Obtains the value of a key as a bool.
+bool cdf::CLayeredDataFile::GetBool(const t_Str &szKey, const t_Str &szSection, bool &ret)
 {
-	if ( !CreateSection(szSection, szComment) )
-		return false;
+	t_Str szValue;
 
-	t_Section* pSection = GetSection(szSection);
+	return GetValue(szKey, szSection, szValue) && ToBool(szValue, ret);
+}
 
-	if ( !pSection )
-		return false;
+// HasSection
+// Returns true if any layer has the section.
+bool cdf::CLayeredDataFile::HasSection(const t_Str &szSection)
+{
+	EnterEpoch();
 
-	KeyItor k_pos;
+	const t_Index* pIndex = Current();
+	bool bFound = pIndex->Sections.find(LowerCase(szSection)) != pIndex->Sections.end();
 
-	pSection->szName = szSection;
-	for (k_pos = Keys.begin(); k_pos != Keys.end(); k_pos++)
-	{
-		t_Key* pKey = new t_Key;
-		pKey->szComment = (*k_pos).szComment;
-		pKey->szKey = (*k_pos).szKey;
-		pKey->szValue = (*k_pos).szValue;
+	LeaveEpoch();
 
-		pSection->Keys.push_back(*pKey);
-	}
+	return bFound;
+}
 
-	m_Sections.push_back(*pSection);
-	m_bDirty = true;
 
-	return true;
+// CSlot ////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////
+
+// CSlot
+// Starts out empty, as for a key that does not exist.
+cdf::CSlot::CSlot(const t_Str &szKey, const t_Str &szSection)
+{
+	m_szKey = szKey;
+	m_szSection = szSection;
+	m_nSequence = 0;
+	m_nValue = 0;
+	m_fValue = 0;
+	m_bInt = false;
+	m_bFloat = false;
 }
 
-// HasSection
-// Returns true if the specified section exists.
-bool cdf::CDataFile::HasSection(const t_Str &szSection)
+// Store
+// Converts the value once, here, rather than on every read. The sequence
+// number is made odd before the fields are written and even again after,
+// with fences that keep the writes in between.
+void cdf::CSlot::Store(const t_Str* pValue)
 {
-	return GetSection(szSection) != NULL;
+	int nValue = 0;
+	float fValue = 0;
+	bool bInt = pValue && ToInt(*pValue, nValue);
+	bool bFloat = pValue && ToFloat(*pValue, fValue);
+	unsigned nSequence = m_nSequence.load(std::memory_order_relaxed);
+
+	m_nSequence.store(nSequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	m_nValue.store(nValue, std::memory_order_relaxed);
+	m_fValue.store(fValue, std::memory_order_relaxed);
+	m_bInt.store(bInt, std::memory_order_relaxed);
+	m_bFloat.store(bFloat, std::memory_order_relaxed);
+
+	m_nSequence.store(nSequence + 2, std::memory_order_release);
 }
 
-// SectionCount
-// Simply returns the number of sections in the list.
-int cdf::CDataFile::SectionCount()
+// GetInt
+// Reads the value and its flag, and keeps them if the sequence number was
+// even and did not move in the meantime.
+bool cdf::CSlot::GetInt(int &ret) const
 {
-	return m_Sections.size();
+	for ( ;; )
+	{
+		unsigned nSequence = m_nSequence.load(std::memory_order_acquire);
+		int nValue = m_nValue.load(std::memory_order_relaxed);
+		bool bInt = m_bInt.load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if ( (nSequence & 1) == 0 && m_nSequence.load(std::memory_order_relaxed) == nSequence )
+		{
+			if ( bInt )
+				ret = nValue;
+
+			return bInt;
+		}
+
+		std::this_thread::yield();
+	}
 }
 
-// KeyCount
-// Returns the total number of keys contained within all the sections.
-int cdf::CDataFile::KeyCount()
+// GetFloat
+// The same as GetInt, for the float.
+bool cdf::CSlot::GetFloat(float &ret) const
 {
-	int nCounter = 0;
-	SectionItor s_pos;
+	for ( ;; )
+	{
+		unsigned nSequence = m_nSequence.load(std::memory_order_acquire);
+		float fValue = m_fValue.load(std::memory_order_relaxed);
+		bool bFloat = m_bFloat.load(std::memory_order_relaxed);
 
-	for (s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
-		nCounter += (*s_pos).Keys.size();
+		std::atomic_thread_fence(std::memory_order_acquire);
 
-	return nCounter;
+		if ( (nSequence & 1) == 0 && m_nSequence.load(std::memory_order_relaxed) == nSequence )
+		{
+			if ( bFloat )
+				ret = fValue;
+
+			return bFloat;
+		}
+
+		std::this_thread::yield();
+	}
 }
 
 
-// Protected Member Functions ///////////////////////////////////////////////////
+// CSharedMutex /////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////
 
-// GetKey
-// Given a key and section name, looks up the key and if found, returns a
-// pointer to that key, otherwise returns NULL.
-t_Key*	cdf::CDataFile::GetKey(const t_Str &szKey, const t_Str &szSection)
+// st_sharedhold
+// A CSharedMutex this thread holds shared, and how many times.
+typedef struct st_sharedhold
 {
-	KeyItor k_pos;
-	t_Section* pSection;
+	const CSharedMutex* pMutex;
+	int                 nDepth;
+} t_SharedHold;
 
-	// Since our default section has a name value of t_Str("") this should
-	// always return a valid section, wether or not it has any keys in it is
-	// another matter.
-	if ( (pSection = GetSection(szSection)) == NULL )
-		return NULL;
+// SharedHolds
+// The CSharedMutexes held shared by the calling thread. Rarely more than one.
+static std::vector<t_SharedHold>& SharedHolds()
+{
+	static thread_local std::vector<t_SharedHold> Holds;
+	return Holds;
+}
 
-	for (k_pos = pSection->Keys.begin(); k_pos != pSection->Keys.end(); k_pos++)
+cdf::CSharedMutex::CSharedMutex()
+{
+	m_nDepth = 0;
+	m_nWriters = 0;
+}
+
+// lock
+// Locks exclusively, or counts one more level if we allready do.
+void cdf::CSharedMutex::lock()
+{
+	if ( m_Owner.load(std::memory_order_relaxed) == std::this_thread::get_id() )
 	{
-		if ( CompareNoCase( (*k_pos).szKey, szKey ) == 0 )
-			return (t_Key*)&(*k_pos);
+		m_nDepth++;
+		return;
 	}
 
-	return NULL;
+	m_nWriters++;
+	m_Mutex.lock();
+	m_nWriters--;
+
+	m_Owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+	m_nDepth = 1;
 }
 
-// GetSection
-// Given a section name, locates that section in the list and returns a pointer
-// to it. If the section was not found, returns NULL
-t_Section* cdf::CDataFile::GetSection(const t_Str &szSection)
+// try_lock
+// Locks exclusively if that can be done without waiting.
+bool cdf::CSharedMutex::try_lock()
 {
-	SectionItor s_pos;
-
-	for (s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+	if ( m_Owner.load(std::memory_order_relaxed) == std::this_thread::get_id() )
 	{
-		if ( CompareNoCase( (*s_pos).szName, szSection ) == 0 )
-			return (t_Section*)&(*s_pos);
+		m_nDepth++;
+		return true;
 	}
 
-	return NULL;
+	if ( !m_Mutex.try_lock() )
+		return false;
+
+	m_Owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+	m_nDepth = 1;
+	return true;
 }
 
+// unlock
+// Undoes one lock(); the last one releases the mutex.
+void cdf::CSharedMutex::unlock()
+{
+	if ( --m_nDepth > 0 )
+		return;
+
+	m_Owner.store(std::thread::id(), std::memory_order_relaxed);
+	m_Mutex.unlock();
+}
 
-t_Str cdf::CDataFile::CommentStr(t_Str szComment)
+// IsOwner
+// Returns true if the calling thread holds the lock exclusively.
+bool cdf::CSharedMutex::IsOwner() const
 {
-	t_Str szNewStr = t_Str("");
+	return m_Owner.load(std::memory_order_relaxed) == std::this_thread::get_id();
+}
 
-	Trim(szComment);
+// lock_shared
+// Locks shared. A thread that holds the lock in either mode allready only
+// counts one more level.
+void cdf::CSharedMutex::lock_shared()
+{
+	if ( m_Owner.load(std::memory_order_relaxed) == std::this_thread::get_id() )
+	{
+		m_nDepth++;
+		return;
+	}
 
-		if ( szComment.size() == 0 )
-			return szComment;
+	std::vector<t_SharedHold> &Holds = SharedHolds();
 
-	if ( szComment.find_first_of(CommentIndicators) != 0 )
+	for (size_t i = 0; i < Holds.size(); i++)
 	{
-		szNewStr = CommentIndicators[0];
-		szNewStr += " ";
+		if ( Holds[i].pMutex == this )
+		{
+			Holds[i].nDepth++;
+			return;
+		}
 	}
 
-	szNewStr += szComment;
+	// Let a waiting writer go first. Readers that allready hold the lock
+	// came through above, so this can not deadlock.
+	while ( m_nWriters.load(std::memory_order_relaxed) > 0 )
+		std::this_thread::yield();
 
-	return szNewStr;
+	m_Mutex.lock_shared();
+
+	t_SharedHold Hold = { this, 1 };
+	Holds.push_back(Hold);
 }
 
+// unlock_shared
+// Undoes one lock_shared().
+void cdf::CSharedMutex::unlock_shared()
+{
+	if ( m_Owner.load(std::memory_order_relaxed) == std::this_thread::get_id() )
+	{
+		unlock();
+		return;
+	}
+
+	std::vector<t_SharedHold> &Holds = SharedHolds();
+
+	for (size_t i = 0; i < Holds.size(); i++)
+	{
+		if ( Holds[i].pMutex != this )
+			continue;
+
+		if ( --Holds[i].nDepth == 0 )
+		{
+			Holds[i] = Holds.back();
+			Holds.pop_back();
+			m_Mutex.unlock_shared();
+		}
+
+		return;
+	}
+}
 
 
 // Utility Functions ////////////////////////////////////////////////////////////
@@ -741,6 +4610,18 @@ int cdf::CompareNoCase(const t_Str& str1, const t_Str& str2)
 #endif
 }
 
+// LowerCase
+// Returns a lower case copy of a string, for case insensitive lookups.
+t_Str cdf::LowerCase(const t_Str& szStr)
+{
+	t_Str szLower = szStr;
+
+	for (size_t i = 0; i < szLower.size(); i++)
+		szLower[i] = (char)tolower((unsigned char)szLower[i]);
+
+	return szLower;
+}
+
 // Trim
 // Trims whitespace from both sides of a string.
 void cdf::Trim(t_Str& szStr)
@@ -764,6 +4645,153 @@ void cdf::Trim(t_Str& szStr)
 		szStr.erase(rPos, szStr.size()-rPos);
 }
 
+// WriteChunks
+// Replaces the contents of a file with the given chunks, in order. On POSIX
+// systems they all go out through writev(), usually in a single call.
+bool cdf::WriteChunks(const t_Str &szFileName, const std::vector<t_Str> &Chunks)
+{
+#ifdef WIN32
+	std::ofstream File(szFileName.c_str(), std::ios::out|std::ios::trunc);
+	if ( ! File.is_open() )
+	{
+		Report(E_ERROR, "[CDataFile::Save] Unable to save file.");
+		return false;
+	}
+
+	for (size_t i = 0; i < Chunks.size(); i++)
+		File.write(Chunks[i].data(), Chunks[i].size());
+
+	File.flush();
+
+	bool bFailed = File.fail();
+	File.close();
+#else
+	int fd = open(szFileName.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if ( fd < 0 )
+	{
+		Report(E_ERROR, "[CDataFile::Save] Unable to save file.");
+		return false;
+	}
+
+	std::vector<struct iovec> Vectors;
+	size_t i;
+
+	for (i = 0; i < Chunks.size(); i++)
+	{
+		if ( Chunks[i].size() == 0 )
+			continue;
+
+		struct iovec Vector;
+		Vector.iov_base = (void*)Chunks[i].data();
+		Vector.iov_len = Chunks[i].size();
+		Vectors.push_back(Vector);
+	}
+
+	bool bFailed = false;
+	i = 0;
+
+	while ( i < Vectors.size() )
+	{
+		int nCount = Vectors.size() - i < (size_t)IOV_MAX ? (int)(Vectors.size() - i) : IOV_MAX;
+		ssize_t nDone = writev(fd, &Vectors[i], nCount);
+
+		if ( nDone < 0 && errno == EINTR )
+			continue;
+		if ( nDone < 0 )
+		{
+			bFailed = true;
+			break;
+		}
+
+		// Skip what was written, which may end part way into a chunk.
+		while ( i < Vectors.size() && (size_t)nDone >= Vectors[i].iov_len )
+			nDone -= Vectors[i++].iov_len;
+
+		if ( nDone > 0 )
+		{
+			Vectors[i].iov_base = (char*)Vectors[i].iov_base + nDone;
+			Vectors[i].iov_len -= nDone;
+		}
+	}
+
+	if ( close(fd) != 0 )
+		bFailed = true;
+#endif
+
+	if ( bFailed )
+		Report(E_ERROR, "[CDataFile::Save] Unable to write file <%s>.", szFileName.c_str());
+
+	return !bFailed;
+}
+
+// GetFileStamp
+// Fills in the size, modification time and inode of a file. Returns false if
+// the file could not be stat()ed.
+bool cdf::GetFileStamp(const t_Str& szFileName, t_FileStamp& stamp)
+{
+	struct stat st;
+
+	if ( stat(szFileName.c_str(), &st) != 0 )
+		return false;
+
+	stamp.nSize = (long long)st.st_size;
+#if defined(__linux__)
+	stamp.nTime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+	stamp.nTime = (long long)st.st_mtime * 1000000000LL;
+#endif
+	stamp.nInode = (long long)st.st_ino;
+
+	return true;
+}
+
+// HashBytes
+// Hashes a block of memory eight bytes at a time (the mixing steps are those
+// of MurmurHash64A). Good enough to tell whether a section's text changed;
+// not meant to stand up to anyone trying to produce collisions.
+unsigned long long cdf::HashBytes(const char* pData, size_t nLength)
+{
+	const unsigned long long m = 0xc6a4a7935bd1e995ULL;
+	const int r = 47;
+	unsigned long long h = 0x8445d61a4e774912ULL ^ (nLength * m);
+	unsigned long long k;
+
+	while ( nLength >= 8 )
+	{
+		memcpy(&k, pData, 8);
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+		h ^= k;
+		h *= m;
+
+		pData += 8;
+		nLength -= 8;
+	}
+
+	if ( nLength > 0 )
+	{
+		k = 0;
+		memcpy(&k, pData, nLength);
+		h ^= k;
+		h *= m;
+	}
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+
+	return h;
+}
+
+// WaitForPendingSaves
+// Blocks until the hand-off thread has saved everything queued so far.
+void cdf::WaitForPendingSaves()
+{
+	if ( !CHandoffQueue::s_bClosed )
+		HandoffQueue().Wait();
+}
+
 // WriteLn
 // Writes the formatted output to the file stream, returning the number of
 // bytes written.
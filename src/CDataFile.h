@@ -15,9 +15,22 @@
 #ifndef __CDATAFILE_H__
 #define __CDATAFILE_H__
 
+#include <stdio.h>
 #include <vector>
 #include <fstream>
 #include <string>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
 
 namespace cdf
 {
@@ -35,12 +48,65 @@ const int AUTOCREATE_SECTIONS =    (1L<<1);
 // requested key does not allready exist.
 const int AUTOCREATE_KEYS =        (1L<<2);
 
+// INCREMENTAL_SAVE
+// When set, Save() rewrites only the sections that changed since the last
+// Load() or Save(). Untouched sections are copied from the file on disk, or,
+// when every changed section still fits into its old byte range, the changed
+// sections are patched in place. Falls back to a full save whenever the file
+// has been modified behind our back, or can not be replaced without losing
+// its other names, owner or extended attributes. Links are followed.
+const int INCREMENTAL_SAVE =       (1L<<3);
+
+// PRESERVE_FORMAT
+// When set before Load(), the text of the file is kept in memory, and Save()
+// writes unmodified sections and lines back exactly as they were: blank
+// lines, spacing around the '=', ':' separators and line endings survive.
+// Only the lines that were actually edited are rewritten. Costs a copy of
+// the file in memory.
+const int PRESERVE_FORMAT =        (1L<<4);
+
 // MAX_BUFFER_LEN
 // Used simply as a max size of some internal buffers. Determines the maximum
 // length of a line that will be read from or written to the file or the
 // report output.
 const int MAX_BUFFER_LEN =         512;
 
+// MIN_SECTIONS_PER_THREAD
+// The smallest number of sections worth handing to a thread of its own when
+// saving in parallel (see SetSaveThreads).
+const int MIN_SECTIONS_PER_THREAD = 256;
+
+// SECTION_STRIPES
+// The number of locks sections are spread over in section-locking mode (see
+// SetSectionLocking). Must be a power of two.
+const int SECTION_STRIPES =        64;
+
+// MUTATION_BATCH
+// The most queued changes (see QueueValue) applied under one lock.
+const int MUTATION_BATCH =         1024;
+
+// MAX_HOT_KEYS
+// The most CHotKeys whose values are cached at one time. Every reading
+// thread's cache has room for this many; keys created past it are read
+// the way a key named by a string is.
+const int MAX_HOT_KEYS =           4096;
+
+// MUTATION_HISTORY
+// How many queued changes may be applied after one before WaitForMutation()
+// can no longer tell whether it failed; past that it only waits for it.
+const int MUTATION_HISTORY =       65536;
+
+// MUTATION_FAILED
+// The ticket QueueValue() returns for a change it made on the spot, the
+// queue not running, that could not be made.
+const unsigned long long MUTATION_FAILED = ~0ULL;
+
+// MAX_SAVE_PADDING
+// The most empty lines an incremental save (see INCREMENTAL_SAVE) pads the
+// changed sections with to patch the file in place. Past that the file is
+// rewritten, at its proper size.
+const int MAX_SAVE_PADDING =       16;
+
 
 // eDebugLevel
 // Used by our Report function to classify levels of reporting and severity
@@ -69,6 +135,19 @@ enum e_DebugLevel
 	E_CRITICAL
 };
 
+// e_PersistPolicy
+// Decides what the destructor does with changes that have not been saved.
+enum e_PersistPolicy
+{
+	// save them before returning (the default)
+	PERSIST_ON_DESTROY = 0,
+	// hand them over to a process-wide background thread, which saves them
+	// later on. The destructor returns right away. See WaitForPendingSaves().
+	PERSIST_HANDOFF,
+	// throw them away
+	PERSIST_NEVER
+};
+
 
 typedef std::string t_Str;
 
@@ -93,6 +172,19 @@ const t_Str EqualIndicators   = t_Str("=:");
 // the head and tail of strings.
 const t_Str WhiteSpace = t_Str(" \t\n\r");
 
+// IncludeDirective
+// A line made of this, whitespace and the path of another file pulls the
+// sections and keys of that file in at that point. Keys the file before it
+// had outside of any section go into the section the line is in. Keys the
+// including file sets itself win over included ones. Included keys are not
+// saved (the line is, as a key of this name, with the path as its value)
+// unless they are changed. Relative paths are relative to the directory of
+// the including file. Every included file is parsed once per process, and
+// again only when it changes on disk, but changes to it are only seen when
+// the files that include it are loaded again. PRESERVE_FORMAT does not
+// apply to files that include others.
+const t_Str IncludeDirective = t_Str("!include");
+
 // st_key
 // This structure stores the definition of a key. A key is a named identifier
 // that is associated with a value. It may or may not have a comment.  All comments
@@ -103,11 +195,22 @@ typedef struct st_key
 	t_Str szValue;
 	t_Str szComment;
 
+	// What has been changed since the last Load() or Save(). Tells the
+	// PRESERVE_FORMAT mode which lines it has to rewrite.
+	bool  bValueChanged;
+	bool  bCommentChanged;
+
+	// Came from an included file (see IncludeDirective), and is not saved.
+	bool  bIncluded;
+
 	st_key()
 	{
 		szKey = t_Str("");
 		szValue = t_Str("");
 		szComment = t_Str("");
+		bValueChanged = false;
+		bCommentChanged = false;
+		bIncluded = false;
 	}
 
 } t_Key;
@@ -125,11 +228,45 @@ typedef struct st_section
 	t_Str   szComment;
 	KeyList Keys;
 
+	// The byte range this section occupied in the file as of the last Load()
+	// or Save() (-1 if it has never been on disk), a hash of those bytes, and
+	// whether it has been modified since. Used by the incremental save.
+	long long nOffset;
+	long long nLength;
+	unsigned long long nHash;
+	bool      bDirty;
+	bool      bCommentChanged;
+
+	// Only there because an included file has it, and is not saved.
+	bool      bIncluded;
+
+	// A hash of the keys and values, whatever their order, for Diff(), and
+	// whether it is up to date.
+	unsigned long long nKeysHash;
+	bool      bKeysHashed;
+
+	// The generation of the data (see CDataFile::Generation) the section
+	// was last changed in.
+	unsigned long long nGeneration;
+
+	// This section's copy in the published snapshot (see CSnapshot), or
+	// NULL if it has changed since the last one was published.
+	std::shared_ptr<const st_section> pPublished;
+
 	st_section()
 	{
 		szName = t_Str("");
 		szComment = t_Str("");
 		Keys.clear();
+		nOffset = -1;
+		nLength = 0;
+		nHash = 0;
+		bDirty = true;
+		bCommentChanged = false;
+		bIncluded = false;
+		nKeysHash = 0;
+		bKeysHashed = false;
+		nGeneration = 0;
 	}
 
 } t_Section;
@@ -137,6 +274,234 @@ typedef struct st_section
 typedef std::vector<t_Section> SectionList;
 typedef SectionList::iterator SectionItor;
 
+// st_span
+// The byte range of a section in a file, and a hash of those bytes, as
+// found by CDataFile::ScanSections().
+typedef struct st_span
+{
+	t_Str     szName;
+	long long nOffset;
+	long long nLength;
+	unsigned long long nHash;
+
+	st_span()
+	{
+		nOffset = 0;
+		nLength = 0;
+		nHash = 0;
+	}
+
+} t_Span;
+
+// st_snapshot
+// An immutable copy of the section list, published for lock-free readers.
+// Sections that did not change are shared with the previous snapshot.
+typedef struct st_snapshot
+{
+	std::vector< std::shared_ptr<const t_Section> > Sections;
+	int nKeys;
+
+	// Once replaced: the epoch it was retired in, and the next one retired.
+	unsigned long long  nRetired;
+	struct st_snapshot* pNext;
+
+	st_snapshot()
+	{
+		nKeys = 0;
+		nRetired = 0;
+		pNext = NULL;
+	}
+
+} t_Snapshot;
+
+// e_Operation
+// The kinds of change a CTransaction can stage.
+enum e_Operation
+{
+	OP_SET_VALUE = 0,
+	OP_CREATE_KEY,
+	OP_DELETE_KEY,
+	OP_CREATE_SECTION,
+	OP_DELETE_SECTION
+};
+
+// st_operation
+// A change staged by a CTransaction, made when it is committed. The fields
+// an operation does not use are left empty.
+typedef struct st_operation
+{
+	e_Operation Op;
+	t_Str       szSection;
+	t_Str       szKey;
+	t_Str       szValue;
+	t_Str       szComment;
+
+} t_Operation;
+
+// st_undo
+// A section as it was before a transaction first changed it, so that a
+// transaction that fails half way can be undone. nIndex is its position in
+// the section list before the transaction, or -1 if it did not exist, and
+// bDeleted tells whether the transaction has deleted it since.
+typedef struct st_undo
+{
+	t_Str     szName;
+	long      nIndex;
+	bool      bDeleted;
+	t_Section Section;
+
+} t_Undo;
+
+// e_Change
+// The kinds of difference CDataFile::Diff() reports.
+enum e_Change
+{
+	CHANGE_ADDED = 0,
+	CHANGE_REMOVED,
+	CHANGE_MODIFIED
+};
+
+// st_change
+// A difference between two data files, as found by CDataFile::Diff().
+// szKey is empty if a whole section was added or removed. szOldValue and
+// szNewValue are the key's value before and after, each empty if the key
+// did not exist then.
+typedef struct st_change
+{
+	e_Change Change;
+	t_Str    szSection;
+	t_Str    szKey;
+	t_Str    szOldValue;
+	t_Str    szNewValue;
+
+} t_Change;
+
+// t_Observer
+// Called with the changes that one commit made to what it subscribed to
+// (see CDataFile::Subscribe).
+typedef std::function<void(const std::vector<t_Change>&)> t_Observer;
+
+// e_Subscription
+// What a subscription watches: a key, a whole section, or the keys of a
+// section whose names start with a prefix.
+enum e_Subscription
+{
+	SUBSCRIBE_KEY = 0,
+	SUBSCRIBE_SECTION,
+	SUBSCRIBE_PREFIX
+};
+
+// st_subscription
+// A subscription, filed under the lower-cased name of its section. szKey is
+// the lower-cased key or prefix, and empty for a whole section.
+typedef struct st_subscription
+{
+	unsigned long long nId;
+	e_Subscription     Kind;
+	t_Str              szKey;
+	t_Observer         Observer;
+
+} t_Subscription;
+
+// st_delivery
+// The changes of a commit that concern one subscription, on their way to
+// its observer.
+typedef struct st_delivery
+{
+	t_Observer            Observer;
+	std::vector<t_Change> Changes;
+
+} t_Delivery;
+
+// st_expansion
+// The value of a key with its references expanded (see GetExpanded), and
+// the keys it was made from: itself and the keys it refers to, by lower-
+// cased section and key.
+typedef struct st_expansion
+{
+	t_Str              szValue;
+	bool               bFound;
+	std::vector<t_Str> Uses;
+
+} t_Expansion;
+
+// st_mutation
+// A change waiting in the mutation queue (see QueueValue), with the ticket
+// it was given. The queue links them through pNext.
+typedef struct st_mutation
+{
+	t_Operation                       Operation;
+	unsigned long long                nTicket;
+	std::atomic<struct st_mutation*>  pNext;
+
+	st_mutation()
+	{
+		nTicket = 0;
+		pNext = NULL;
+	}
+
+} t_Mutation;
+
+// st_cachedvalue
+// A value read through a CHotKey, as kept in the reading thread's cache:
+// the CHotKey (by its serial, as ids are reused) and the data file it came
+// from (see m_nSerial) and that file's version at the time, whether the key
+// was there and its value, and which conversions of the value have been
+// done (CACHED_* bits) along with their results.
+typedef struct st_cachedvalue
+{
+	unsigned long long nKey;
+	unsigned long long nFile;
+	unsigned long long nVersion;
+	bool  bFound;
+	t_Str szValue;
+
+	int   nConverted;
+	bool  bFloat;
+	bool  bInt;
+	float fValue;
+	int   nValue;
+	bool  bValue;
+
+	st_cachedvalue()
+	{
+		nKey = 0;
+		nFile = 0;
+		nVersion = 0;
+		bFound = false;
+		nConverted = 0;
+		bFloat = false;
+		bInt = false;
+		fValue = 0;
+		nValue = 0;
+		bValue = false;
+	}
+
+} t_CachedValue;
+
+// st_filestamp
+// Identifies a particular version of a file on disk, so that we can tell
+// whether it has been changed by someone else since we last read or wrote it.
+typedef struct st_filestamp
+{
+	long long nSize;
+	long long nTime;	// modification time, in nanoseconds where available
+	long long nInode;
+
+	st_filestamp()
+	{
+		nSize = -1;
+		nTime = 0;
+		nInode = 0;
+	}
+
+	bool operator==(const st_filestamp &other) const
+	{
+		return nSize == other.nSize && nTime == other.nTime && nInode == other.nInode;
+	}
+
+} t_FileStamp;
+
 
 
 /// General Purpose Utility Functions ///////////////////////////////////////////
@@ -145,12 +510,119 @@ void  Report(e_DebugLevel DebugLevel, const char *fmt, ...);
 t_Str GetNextWord(t_Str& CommandLine);
 int   CompareNoCase(const t_Str &str1, const t_Str &str2);
 void  Trim(t_Str& szStr);
+// LowerCase: Returns a lower-cased copy of a name, for lookups, since names
+// are compared without regard to case.
+t_Str LowerCase(const t_Str& szStr);
 int   WriteLn(std::ofstream& stream, const char* fmt, ...);
+bool  GetFileStamp(const t_Str& szFileName, t_FileStamp& stamp);
+bool  WriteChunks(const t_Str& szFileName, const std::vector<t_Str>& Chunks);
+// HashBytes: A fast, non-cryptographic 64 bit hash of a block of memory.
+unsigned long long HashBytes(const char* pData, size_t nLength);
+// WaitForPendingSaves: Blocks until every save handed off by a destructor
+// (see PERSIST_HANDOFF) has been written.
+void  WaitForPendingSaves();
 
 
 /// Class Definitions ///////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////
 
+// CSharedMutex
+// A reader/writer lock. Like std::shared_mutex, except that a thread holding
+// it may lock it again (exclusively if it holds it exclusively, shared either
+// way), so that locked methods can call each other. A thread holding it
+// shared must not try to lock it exclusively. New readers hold back while a
+// writer is waiting, so that a steady stream of them can not starve it.
+class CSharedMutex
+{
+public:
+	CSharedMutex();
+
+	void lock();
+	bool try_lock();
+	void unlock();
+	void lock_shared();
+	void unlock_shared();
+
+	// IsOwner: Returns true if the calling thread holds it exclusively.
+	bool IsOwner() const;
+
+private:
+	std::shared_mutex            m_Mutex;
+	std::atomic<std::thread::id> m_Owner;  // Thread holding it exclusively.
+	int                          m_nDepth; // How many times it did so.
+	std::atomic<int>             m_nWriters; // Threads waiting to lock().
+};
+
+// st_stripe
+// One of the locks of section-locking mode, on a cache line of its own.
+typedef struct alignas(64) st_stripe
+{
+	CSharedMutex Mutex;
+} t_Stripe;
+
+class CFileWatch;
+
+// CHotKey
+// Names a key that is read very often, for the cached Get* methods of
+// CDataFile. Every CHotKey gets an id of its own, which is where the
+// threads keep its value in their caches, so create them once (as statics,
+// say) and not for every read. The id is given back when it is destroyed.
+class CHotKey
+{
+public:
+	CHotKey(const t_Str &szKey, const t_Str &szSection);
+	// A copy names the same key, but has an id of its own.
+	CHotKey(const CHotKey &Other);
+	CHotKey& operator=(const CHotKey &Other);
+	~CHotKey();
+
+private:
+	// TakeId: Takes an id and a serial number.
+	void TakeId();
+
+	int                m_nId;     // -1 past MAX_HOT_KEYS.
+	unsigned long long m_nSerial; // Never given to another CHotKey.
+	t_Str              m_szKey;
+	t_Str              m_szSection;
+
+	friend class CDataFile;
+};
+
+// CSlot
+// A numeric key bound to a slot of its own (see CDataFile::BindSlot). The
+// slot holds the value of the key as an int and as a float, and the data
+// file updates it in place whenever the key changes. Reading it takes no
+// lock and writes to no memory: a sequence number, odd while an update is
+// under way, tells the reader whether what it read holds together, and only
+// a read that overlaps an update is tried again.
+class CSlot
+{
+public:
+	// GetInt & GetFloat: Obtain the value, as their CDataFile counterparts
+	// would. Return false if the key does not exist or is not a number.
+	bool GetInt(int &ret) const;
+	bool GetFloat(float &ret) const;
+
+private:
+	CSlot(const t_Str &szKey, const t_Str &szSection);
+	CSlot(const CSlot&) = delete;
+	CSlot& operator=(const CSlot&) = delete;
+
+	// Store: Sets the slot from the value of the key, or NULL if the key
+	// does not exist. Called by one thread at a time.
+	void Store(const t_Str* pValue);
+
+	t_Str                 m_szKey;
+	t_Str                 m_szSection;
+	std::atomic<unsigned> m_nSequence;
+	std::atomic<int>      m_nValue;
+	std::atomic<float>    m_fValue;
+	std::atomic<bool>     m_bInt;   // The value is an int.
+	std::atomic<bool>     m_bFloat; // The value is a float.
+
+	friend class CDataFile;
+};
+
 
 // CDataFile
 class CDataFile
@@ -168,9 +640,40 @@ public:
 	bool Load(const t_Str &szFileName);
 	bool Save();
 
+	// SaveToBuffer: Serializes the data into a string, exactly as Save()
+	// would write it to the file.
+	bool SaveToBuffer(t_Str &szOut) const;
+	// SaveToBuffer: Serializes the data into a caller-provided buffer.
+	// nWritten receives the size needed; returns false if it did not fit.
+	bool SaveToBuffer(char* pBuffer, size_t nBufferSize, size_t &nWritten) const;
+	// SaveToStream: Serializes the data into a stream.
+	bool SaveToStream(std::ostream &stream) const;
+	// SerializedSize: Returns the exact size of the serialized data.
+	size_t SerializedSize() const;
+
+	// LoadBatch: Loads FileNames[i] into Files[i], for many files at once.
+	// On Linux the opens, reads and closes of all the files are submitted
+	// together through io_uring, falling back to plain POSIX calls when it
+	// is not available. Returns the number of files loaded.
+	static int LoadBatch(const std::vector<CDataFile*> &Files, const std::vector<t_Str> &FileNames);
+	// SaveBatch: Saves many files at once, the same way. With bSync each
+	// file is also fsync()ed. Returns the number of files saved.
+	static int SaveBatch(const std::vector<CDataFile*> &Files, bool bSync);
+
 	// Data handling methods
 	/////////////////////////////////////////////////////////////////
 
+	// GetValue & co: The same as the methods below, for a key named by a
+	// CHotKey. Every thread keeps what it read, converted to the type it
+	// asked for, until the data changes: reading it again takes a lookup
+	// in a thread-local table and one atomic load, and writes to no memory
+	// other threads use.
+	bool GetValue(const CHotKey &Key, t_Str &ret);
+	bool GetString(const CHotKey &Key, t_Str &ret);
+	bool GetFloat(const CHotKey &Key, float &ret);
+	bool GetInt(const CHotKey &Key, int &ret);
+	bool GetBool(const CHotKey &Key, bool &ret);
+
 	// GetValue: Our default access method. Returns the raw t_Str value
 	// Note that this returns keys specific to the given section only.
 	bool GetValue(const t_Str &szKey, const t_Str &szSection, t_Str &ret);
@@ -182,6 +685,13 @@ public:
 	bool GetInt(const t_Str &szKey, const t_Str &szSection, int &ret);
 	// GetBool: Return the value as a bool
 	bool GetBool(const t_Str &szKey, const t_Str &szSection, bool &ret);
+	// GetExpanded: Returns the value with every ${section:key} in it, and
+	// every ${key} of the same section, replaced by the expanded value of
+	// that key; keys that do not exist expand to nothing, and $${ is a
+	// literal ${. A value is expanded on first read and kept until a key it
+	// depends on, directly or not, changes. Returns false if the key does
+	// not exist, or if it depends on itself, which is reported.
+	bool GetExpanded(const t_Str &szKey, const t_Str &szSection, t_Str &ret);
 
 	// SetValue: Sets the value of a given key. Will create the
 	// key if it is not found and AUTOCREATE_KEYS is active.
@@ -238,6 +748,23 @@ public:
 	int SectionCount();
 	// KeyCount: Returns the total number of keys, across all sections.
 	int KeyCount();
+	// Generation: Returns a number that goes up with every change to the
+	// data, reloads included, and never comes back down. Takes no lock, so
+	// a cache can tell whether anything changed since it was filled with a
+	// single load.
+	unsigned long long Generation() const;
+	// SectionGeneration: Returns the generation a section was last changed
+	// in, or the current generation if there is no such section (it may
+	// just have been deleted).
+	unsigned long long SectionGeneration(const t_Str &szSection);
+	// Diff: Fills Changes with the sections and keys that were added to,
+	// removed from or modified in Old to make New, and returns how many
+	// there are. Sections added or removed as a whole are listed once,
+	// without their keys. Names are compared without regard to case, the
+	// order of sections and keys is ignored, and so are comments. Both
+	// files are locked exclusively while they are compared; sections
+	// whose hashes match are skipped without looking at their keys.
+	static size_t Diff(CDataFile &Old, CDataFile &New, std::vector<t_Change> &Changes);
 	// Clear: Initializes the member variables to their default states
 	void Clear();
 	// SetFileName: For use when creating the object by hand
@@ -251,6 +778,128 @@ public:
 	void SetDirty(bool dirty);
 	bool IsDirty() const;
 
+	// Background persistence
+	/////////////////////////////////////////////////////////////////
+	// StartPersister: Starts a worker thread that saves the file whenever
+	// the data is dirty, but at most once every nIntervalMs milliseconds,
+	// so that a burst of changes costs a single save.
+	bool StartPersister(int nIntervalMs);
+	// StopPersister: Stops the worker thread, saving pending changes first.
+	void StopPersister();
+	// Flush: Saves any pending changes right away, blocking until done.
+	bool Flush();
+	// SetPersistPolicy & GetPersistPolicy: Sets and gets what the destructor
+	// does with unsaved changes.
+	void SetPersistPolicy(e_PersistPolicy Policy);
+	e_PersistPolicy GetPersistPolicy() const;
+
+	// File watching
+	/////////////////////////////////////////////////////////////////
+	// StartWatcher: Starts a thread that reloads the file (see Reload)
+	// whenever someone else changes it, including by renaming another
+	// file over it. A burst of changes is waited out until the file has
+	// been left alone for nDebounceMs milliseconds; without inotify, the
+	// file is checked that often.
+	bool StartWatcher(int nDebounceMs);
+	// StopWatcher: Stops the watcher thread.
+	void StopWatcher();
+	// Reload: Loads the file again if it is not as it was last loaded or
+	// saved, replacing the data. The file is parsed before any lock is
+	// taken, and only swapped in under the lock. Where it can, only the
+	// sections whose bytes changed are parsed again; the others are kept
+	// as they are. Changes that have not been saved yet are lost: the file
+	// wins. Returns true if reloaded.
+	bool Reload();
+
+	// EnableJournal: Persists every change by appending a record to the
+	// file <filename>.journal, rather than saving the whole file. The file
+	// is saved and the journal emptied once it grows past nMaxBytes.
+	// Load() replays the journal after reading the file. Clear() and a
+	// change of file name stop journaling; the journal stays with the file
+	// it was kept for.
+	bool EnableJournal(long long nMaxBytes);
+	// DisableJournal: Saves the file and removes the journal.
+	void DisableJournal();
+
+	// SetSaveThreads: Lets Save() render large files on up to nThreads
+	// threads. The output is byte for byte the same as with one.
+	void SetSaveThreads(int nThreads);
+
+	// SetThreadSafe: Makes the Get* methods (and the other readers) take a
+	// shared lock, so that any number of threads can read while others
+	// modify the data. Off by default, as it costs single threaded users.
+	// Set it before the object is shared between threads.
+	void SetThreadSafe(bool bThreadSafe);
+
+	// SetSectionLocking: Gives every section a lock of its own (strictly, one
+	// of SECTION_STRIPES locks picked by its name), on top of the lock on
+	// the section list. Changes to the keys of a section that exists then
+	// only lock out users of the same section, so independent sections can
+	// be read and written at the same time. Creating or deleting sections,
+	// Load(), Save() and the like still lock everything. Implies
+	// SetThreadSafe(true). Set it before the object is shared between
+	// threads.
+	void SetSectionLocking(bool bEnable);
+
+	// BindSlot: Binds a numeric key to a slot (see CSlot), which reads
+	// almost as cheaply as a plain variable. The key is still an ordinary
+	// key, set, saved and loaded as before. It need not exist yet. The slot
+	// belongs to the data file and lasts as long as it does; binding the
+	// key again returns the same slot.
+	const CSlot* BindSlot(const t_Str &szKey, const t_Str &szSection);
+
+	// Subscriptions
+	/////////////////////////////////////////////////////////////////
+	// Subscribe: Calls Observer with the changes made to a key, once per
+	// commit: after every SetValue(), DeleteKey() and the like, or once for
+	// all of the changes made under a transaction (see CTransaction), a
+	// mutation queue batch or a Reload(). Observers are called by the
+	// thread that made the changes, once it has released its locks, so
+	// they may use the data file, and must be thread-safe if more than one
+	// thread changes it. A section added or removed as a whole concerns
+	// every subscription in it, and comes with an empty szKey. Returns an
+	// id for Unsubscribe().
+	unsigned long long Subscribe(const t_Str &szKey, const t_Str &szSection, t_Observer Observer);
+	// SubscribeSection: The same, for all of the keys of a section.
+	unsigned long long SubscribeSection(const t_Str &szSection, t_Observer Observer);
+	// SubscribePrefix: The same, for the keys of a section whose names
+	// start with szPrefix.
+	unsigned long long SubscribePrefix(const t_Str &szPrefix, const t_Str &szSection, t_Observer Observer);
+	// Unsubscribe: Ends a subscription. Returns false if there is no such.
+	bool Unsubscribe(unsigned long long nId);
+
+	// Mutation queue
+	/////////////////////////////////////////////////////////////////
+	// StartMutationQueue: Starts a thread that applies the changes queued
+	// by QueueValue(), as many as have piled up under one lock.
+	bool StartMutationQueue();
+	// StopMutationQueue: Applies what is still queued and stops the thread.
+	// Changes queued while it runs are applied before it returns.
+	void StopMutationQueue();
+	// QueueValue & QueueInt: Queue a SetValue() (or SetInt()) and return
+	// without taking any lock, so that any number of threads can do so
+	// without waiting for each other or for readers. Return a ticket for
+	// WaitForMutation(). If the queue is not running the value is set on
+	// the spot, and they return 0, or MUTATION_FAILED if that failed.
+	unsigned long long QueueValue(const t_Str &szKey, const t_Str &szValue,
+		const t_Str &szComment, const t_Str &szSection);
+	unsigned long long QueueInt(const t_Str &szKey, int nValue,
+		const t_Str &szComment, const t_Str &szSection);
+	// WaitForMutation: Blocks until the change with the given ticket, and
+	// every one queued before it, can be seen by readers. Returns false if
+	// nTimeoutMs (unless negative) passed first, or if the change could not
+	// be made (a missing section or key, see m_Flags). A ticket may be
+	// waited for any number of times, with the same result, until
+	// MUTATION_HISTORY more changes have been applied.
+	bool WaitForMutation(unsigned long long nTicket, int nTimeoutMs);
+
+	// EnableSnapshots: Publishes an immutable copy of the data after every
+	// change, which CSnapshot readers can use without taking any lock.
+	void EnableSnapshots();
+	// DisableSnapshots: Stops publishing, and frees the snapshots once no
+	// reader uses them any more.
+	void DisableSnapshots();
+
 protected:
 	// Note: I've tried to insulate the end user from the internal
 	// data structures as much as possible. This is by design. Doing
@@ -266,6 +915,191 @@ protected:
 	t_Key* GetKey(const t_Str &szKey, const t_Str &szSection);
 	// GetSection: Returns the requested section (if found), NULL otherwise.
 	t_Section* GetSection(const t_Str &szSection);
+	// SetValue: The same as the public one, but creates the key and the
+	// section as the AUTOCREATE_* bits of nCreate say, rather than those
+	// of m_Flags, which is never changed behind the user's back.
+	bool SetValue(const t_Str &szKey, const t_Str &szValue,
+		const t_Str &szComment, const t_Str &szSection, long nCreate);
+	// UpdateSlot: Updates the slot bound to a key, if there is one, to the
+	// key's new value (NULL if it was deleted).
+	void UpdateSlot(const t_Str &szKey, const t_Str &szSection, const t_Str* pValue);
+	// SyncSlots: Updates every slot, after changes to more than one key.
+	void SyncSlots();
+	// CachedValue: Returns the calling thread's cached value of a key,
+	// reading it first if it is missing or out of date.
+	t_CachedValue& CachedValue(const CHotKey &Key);
+
+	// Init: Gives every member its default, for the constructors.
+	void Init();
+	// LoadData: The part of Load() that follows reading the file.
+	void LoadData(const t_Str &szFileName, t_Str &szData, const t_FileStamp* pStamp);
+	// SaveDone: The part of Save() that follows writing the file.
+	void SaveDone(std::vector<t_Str> &Chunks, const std::vector<long long> &Offsets,
+	              const std::vector<unsigned long long> &Hashes);
+	// HashChunks: Hashes the bytes of each section in rendered Chunks.
+	void HashChunks(const std::vector<t_Str> &Chunks, const std::vector<long long> &Offsets,
+	                std::vector<unsigned long long> &Hashes) const;
+	// Unchanged: Returns true if the file on disk already holds exactly what
+	// was rendered, so that Save() need not write it.
+	bool Unchanged(const std::vector<long long> &Offsets, const std::vector<unsigned long long> &Hashes) const;
+	// Parse: Populates the section list from an in-memory copy of a file,
+	// recording the byte range of every section along the way. Included
+	// files are looked for relative to szFileName.
+	void Parse(const char* pData, long long nLength, const t_Str &szFileName);
+	// Include: Handles an include directive found by Parse() in a section.
+	void Include(const t_Str &szPath, const t_Str &szComment, const t_Str &szSection,
+		const t_Str &szFileName);
+	// ParseInclude: Returns the sections of an included file, from the
+	// process-wide cache if they are up to date there, NULL if the file
+	// can not be read.
+	static std::shared_ptr<const SectionList> ParseInclude(const t_Str &szPath);
+	// ScanSections: Finds and hashes the byte range of every section, as
+	// Parse() would record it, without parsing the keys. Returns false if
+	// a section appears more than once.
+	static bool ScanSections(const char* pData, long long nLength, std::vector<t_Span> &Spans);
+	// ReloadSections: Does a Reload() that only parses the sections that
+	// changed. Returns false if that could not be done, leaving the data
+	// as it was.
+	bool ReloadSections(const t_Str &szFileName, const t_FileStamp &Stamp);
+	// DiffSections: Does the work of Diff() for two section lists.
+	static void DiffSections(SectionList &Old, bool bOldOnDisk, SectionList &New, bool bNewOnDisk,
+		std::vector<t_Change> &Changes);
+	// SectionSize: Returns the size of a section's on-disk representation.
+	size_t SectionSize(const t_Section &Section) const;
+	// SerializeSection: Writes the on-disk representation of a section to
+	// pOut, which must have room for SectionSize() bytes.
+	char* SerializeSection(const t_Section &Section, char* pOut) const;
+	// SerializeAll: Renders all sections into one string.
+	void SerializeAll(t_Str &szOut, std::vector<long long> *pOffsets) const;
+	// SerializeChunks: Renders all sections for Save(), in parallel when
+	// allowed to.
+	void SerializeChunks(std::vector<t_Str> &Chunks, std::vector<long long> &Offsets) const;
+	// SerializeRange: Renders a range of sections, for one save thread.
+	void SerializeRange(size_t nBegin, size_t nEnd, t_Str &szOut, long long* pOffsets) const;
+	// RenderSection: Appends a section as Save() would write it, preserving
+	// its original text in PRESERVE_FORMAT mode.
+	void RenderSection(const t_Section &Section, t_Str &szOut) const;
+	// RenderLossless: Appends a modified section, rewriting only the lines
+	// that changed since it was read from m_szSource.
+	void RenderLossless(const t_Section &Section, t_Str &szOut) const;
+	// MarkClean: Clears all modification markers after a Load or Save.
+	void MarkClean();
+	// SaveIncremental: Rewrites only the dirty sections of the file. Returns
+	// false if that was not possible, in which case nothing was written.
+	bool SaveIncremental();
+	// Touch: Marks the given section (and the data file) as modified.
+	void Touch(t_Section* pSection);
+	// PersistLoop: The body of the background persister thread.
+	void PersistLoop();
+	// WatchLoop: The body of the watcher thread.
+	void WatchLoop();
+	// ApplyLoop: The body of the mutation queue's thread.
+	void ApplyLoop();
+	// DrainQueue: Applies up to nMax queued changes under one lock, and
+	// returns how many there were.
+	size_t DrainQueue(size_t nMax);
+	// QueueEmpty: Returns true if no change is queued. Only for the thread
+	// that drains the queue.
+	bool QueueEmpty() const;
+	// HandOff: Moves unsaved data over to the hand-off thread.
+	void HandOff();
+	// Journal: Appends a record to the journal, if there is one.
+	void Journal(const t_Str &szRecord);
+	// ResetJournal: Empties the journal once its changes are in the file.
+	void ResetJournal();
+	// DetachJournal: Stops journaling, leaving the journal for its file.
+	void DetachJournal();
+	// TakeJournalBatch: Returns the records held back by a CWriteLock, as
+	// one group, and forgets them.
+	t_Str TakeJournalBatch();
+	// ReplayJournal: Applies the records in the journal of a file.
+	void ReplayJournal(const t_Str &szFileName);
+	// ReadLock: Returns a shared lock on the data in thread-safe mode, and
+	// an empty one otherwise.
+	std::shared_lock<CSharedMutex> ReadLock() const;
+	// LockWrite & UnlockWrite: Lock and unlock the data for modification.
+	// Changes made under the outermost lock are committed when it is
+	// released. Use CWriteLock rather than calling these directly.
+	void LockWrite();
+	void UnlockWrite();
+	// SectionStripe: Returns the lock of a section in section-locking mode.
+	CSharedMutex& SectionStripe(const t_Str &szSection) const;
+	// ReadSection: Returns a shared lock on a section in section-locking
+	// mode, and an empty one otherwise.
+	std::shared_lock<CSharedMutex> ReadSection(const t_Str &szSection) const;
+	// ReadAllSections: Locks every section shared in section-locking mode,
+	// for readers that go through all of them.
+	void ReadAllSections(std::vector< std::shared_lock<CSharedMutex> > &Locks) const;
+	// Commit: Called when the outermost CWriteLock is released.
+	void Commit();
+	// Announce: Bumps the counters of the views over the data (see
+	// CLayeredDataFile), if it changed since they were last bumped.
+	void Announce();
+	// Apply: Makes the changes staged by a CTransaction, all or none of
+	// them, under a single lock.
+	bool Apply(const std::vector<t_Operation> &Operations);
+	// Remember: Saves a section into Undo before Apply() first changes it.
+	void Remember(const t_Str &szSection, std::vector<t_Undo> &Undo);
+	// Rollback: Puts the sections saved in Undo back the way they were.
+	void Rollback(std::vector<t_Undo> &Undo);
+	// AddSubscription: Files a subscription in the index, and returns its id.
+	unsigned long long AddSubscription(e_Subscription Kind, const t_Str &szKey, const t_Str &szSection,
+		t_Observer Observer);
+	// Notify: Records a change for delivery at the end of the commit, if
+	// its section has subscriptions. Must be called with m_Mutex held
+	// exclusively, and before the change for a key whose value it needs.
+	void Notify(e_Change Change, const t_Str &szSection, const t_Str &szKey,
+		const t_Str &szOldValue, const t_Str &szNewValue);
+	// Expand: Expands a key for GetExpanded(), and the keys it refers to,
+	// into Expanded, unless they are kept allready. Returns false if the
+	// key depends on itself. Called with the data read locked.
+	bool Expand(const t_Str &szKey, const t_Str &szSection, std::unordered_map<t_Str, t_Expansion> &Expanded);
+	// Invalidate: Drops the kept expansions that depend on a key, or on
+	// any key of a section if szKey is empty. Called once the key changed.
+	void Invalidate(const t_Str &szSection, const t_Str &szKey);
+	// ForgetExpansions: Drops all of the kept expansions.
+	void ForgetExpansions();
+	// Route: Sorts the recorded changes out by the subscriptions they
+	// concern, and forgets them. Called with m_Mutex held.
+	void Route(std::vector<t_Delivery> &Deliveries);
+	// Deliver: Calls the observers, with m_Mutex released.
+	static void Deliver(std::vector<t_Delivery> &Deliveries);
+	// Publish: Replaces the published snapshot with the current data.
+	void Publish();
+	// Reclaim: Frees the retired snapshots no reader can be using.
+	void Reclaim();
+
+	// CWriteLock
+	// Locks the data for modification. Changes made under the outermost
+	// one are committed as a whole when it is released.
+	class CWriteLock
+	{
+	public:
+		CWriteLock(CDataFile* pFile);
+		~CWriteLock();
+
+	private:
+		CDataFile* m_pFile;
+	};
+	friend class CWriteLock;
+
+	// CSectionLock
+	// Locks the data for a change that stays within one section. In
+	// section-locking mode, if the section exists and nothing else calls
+	// for the data to be locked as a whole, only that section is locked
+	// exclusively (and the section list shared). Otherwise it is the same
+	// as a CWriteLock.
+	class CSectionLock
+	{
+	public:
+		CSectionLock(CDataFile* pFile, const t_Str &szSection);
+		~CSectionLock();
+
+	private:
+		CDataFile*    m_pFile;
+		CSharedMutex* m_pStripe;
+	};
+	friend class CSectionLock;
 
 
 // Data
@@ -275,7 +1109,268 @@ public:
 protected:
 	SectionList m_Sections;    // Our list of sections
 	t_Str       m_szFileName;  // The filename to write to
-	bool        m_bDirty;      // Tracks whether or not data has changed.
+	std::atomic<bool> m_bDirty; // Tracks whether or not data has changed.
+	std::atomic<unsigned long long> m_nVersion; // Bumped by every change.
+	unsigned long long m_nSerial; // Tells CDataFile objects apart.
+	bool        m_bSpansValid; // Section byte ranges match the file on disk.
+	t_FileStamp m_FileStamp;   // The file as of the last Load or Save.
+	t_Str       m_szSource;    // PRESERVE_FORMAT: the text the spans refer to.
+	bool        m_bSourceValid;// m_szSource is in use.
+	bool        m_bIncludes;   // Some of the data came from included files.
+	std::map<t_Str, CSlot*> m_Slots; // Bound keys, by lower-cased section and key.
+
+	// Subscriptions, by lower-cased section name, and the changes made to
+	// them under the current lock.
+	std::map< t_Str, std::vector<t_Subscription> > m_Subscriptions;
+	std::vector<t_Change> m_Notices;
+	unsigned long long    m_nSubscriptions; // The last id handed out.
+
+	// Expanded values, by lower-cased section and key, and, by section and
+	// key, the expansions that used every key. Guarded by m_ExpandMutex,
+	// since readers fill them in.
+	std::unordered_map<t_Str, t_Expansion> m_Expansions;
+	std::unordered_map< t_Str, std::unordered_map< t_Str, std::unordered_set<t_Str> > > m_ExpansionUsers;
+	std::mutex              m_ExpandMutex;
+	std::atomic<bool>       m_bExpanding;     // GetExpanded() has been used.
+	unsigned long long      m_nExpandEpoch;   // Bumped by every invalidation.
+
+	// Guards the data against the background persister and, in thread-safe
+	// mode, against other threads. Held exclusively by everything that
+	// modifies the data and by Save(), shared by the readers.
+	mutable CSharedMutex         m_Mutex;
+	bool                         m_bThreadSafe;
+	int                          m_nWriteDepth; // Nested CWriteLocks held.
+	bool                         m_bWasDirty;   // Dirty when they were taken.
+	std::unique_ptr<t_Stripe[]>  m_pStripes;    // Section-locking mode.
+
+	// The change counters of the CLayeredDataFiles this is a layer of, and
+	// the version they were last bumped for.
+	std::vector<std::atomic<unsigned long long>*> m_Dependents;
+	std::atomic<unsigned long long>               m_nAnnounced;
+
+	std::atomic<t_Snapshot*> m_pSnapshot;    // Published for CSnapshot readers.
+	t_Snapshot*              m_pRetired;     // Replaced, maybe still in use.
+	std::atomic<bool>        m_bUnpublished; // Changed since last published.
+
+	friend class CSnapshot;
+	friend class CTransaction;
+	friend class CLayeredDataFile;
+
+	std::condition_variable_any  m_PersistCond;
+	std::thread                  m_Persister;
+	bool                         m_bPersistRun;
+	std::chrono::milliseconds    m_PersistInterval;
+	e_PersistPolicy              m_PersistPolicy;
+
+	// The mutation queue: a list of t_Mutations that any thread adds to at
+	// the tail, and only the applier takes from at the head. The head is a
+	// dummy, the one whose change was applied last.
+	t_Mutation*                     m_pQueueHead;
+	std::atomic<t_Mutation*>        m_pQueueTail;
+	std::atomic<unsigned long long> m_nTickets;     // The last ticket given.
+	std::atomic<unsigned long long> m_nApplied;     // Applied up to and including.
+	std::vector<unsigned long long> m_Applied;      // Applied past m_nApplied (a heap).
+	std::set<unsigned long long>    m_Failed;       // Recent tickets not applied (see MUTATION_HISTORY).
+	std::atomic<size_t>             m_nFailed;      // The size of m_Failed.
+	std::atomic<unsigned long long> m_nLastFailed;  // The last ticket not applied.
+	std::atomic<int>                m_nQueueing;    // QueueValue() calls under way.
+	std::atomic<bool>               m_bQueueRun;
+	std::atomic<bool>               m_bApplierIdle; // Waiting for m_QueueCond.
+	std::mutex                      m_QueueMutex;
+	std::condition_variable         m_QueueCond;    // Wakes the applier up.
+	std::condition_variable         m_AppliedCond;  // Wakes WaitForMutation().
+	std::thread                     m_Applier;
+
+	std::thread                  m_Watcher;
+	std::atomic<bool>            m_bWatchRun;
+	int                          m_nWatchDebounce;
+	std::mutex                   m_WatchMutex;
+	CFileWatch*                  m_pWatch;        // The watcher's, while it runs.
+
+	FILE*       m_pJournal;         // The change journal, when enabled.
+	long long   m_nJournalSize;     // Bytes in the journal.
+	long long   m_nJournalMax;      // Save once the journal gets this big.
+	t_Str       m_szJournalBatch;   // Records of the changes not committed yet.
+	int         m_nJournalBatch;    // How many.
+	bool        m_bJournalReplayed; // Load() applied a journal we do not own.
+	int         m_nSaveThreads;     // Threads Save() may use to render.
+};
+
+
+// CSnapshot
+// A read-only view of the data of a CDataFile in snapshot mode (see
+// CDataFile::EnableSnapshots), as it was at one moment. Creating and using
+// one takes no lock and writes to no memory other threads use, so readers
+// never wait for writers or slow each other down. The view does not change
+// while the object lives; create a new one to see later changes. Keep them
+// short lived, as the memory of replaced snapshots is only freed once no
+// reader can be using them. It must not outlive the CDataFile.
+class CSnapshot
+{
+public:
+	CSnapshot(const CDataFile &DataFile);
+	~CSnapshot();
+
+	// IsValid: Returns false if the data file is not in snapshot mode.
+	bool IsValid() const;
+
+	// The same as their CDataFile counterparts.
+	bool GetValue(const t_Str &szKey, const t_Str &szSection, t_Str &ret) const;
+	bool GetString(const t_Str &szKey, const t_Str &szSection, t_Str &ret) const;
+	bool GetFloat(const t_Str &szKey, const t_Str &szSection, float &ret) const;
+	bool GetInt(const t_Str &szKey, const t_Str &szSection, int &ret) const;
+	bool GetBool(const t_Str &szKey, const t_Str &szSection, bool &ret) const;
+	bool HasSection(const t_Str &szSection) const;
+	int  SectionCount() const;
+	int  KeyCount() const;
+
+private:
+	CSnapshot(const CSnapshot&) = delete;
+	CSnapshot& operator=(const CSnapshot&) = delete;
+
+	// GetSection & GetKey: Look up a section or key in the snapshot.
+	const t_Section* GetSection(const t_Str &szSection) const;
+	const t_Key* GetKey(const t_Str &szKey, const t_Str &szSection) const;
+
+	const t_Snapshot* m_pSnapshot;
+};
+
+
+// CTransaction
+// Stages a group of changes to a CDataFile and makes them all at once. The
+// changes are only made by Commit(), in the order they were staged, under a
+// single lock: readers (and CSnapshot readers) see either none of them or
+// all of them, the data is marked dirty once, the background persister
+// saves once, and the journal gets them in a single write. If any of them
+// fails, as the same CDataFile method would, none of them is made.
+class CTransaction
+{
+public:
+	CTransaction(CDataFile &DataFile);
+
+	// The same as their CDataFile counterparts, but only staged.
+	void SetValue(const t_Str &szKey, const t_Str &szValue,
+		const t_Str &szComment, const t_Str &szSection);
+	void SetFloat(const t_Str &szKey, float fValue,
+		const t_Str &szComment, const t_Str &szSection);
+	void SetInt(const t_Str &szKey, int nValue,
+		const t_Str &szComment, const t_Str &szSection);
+	void SetBool(const t_Str &szKey, bool bValue,
+		const t_Str &szComment, const t_Str &szSection);
+	void CreateKey(const t_Str &szKey, const t_Str &szValue,
+		const t_Str &szComment, const t_Str &szSection);
+	void DeleteKey(const t_Str &szKey, const t_Str &szFromSection);
+	void CreateSection(const t_Str &szSection, const t_Str &szComment);
+	void DeleteSection(const t_Str &szSection);
+
+	// Commit: Makes the staged changes. Returns false, having made none of
+	// them, if one failed. Either way nothing stays staged.
+	bool Commit();
+	// Discard: Drops the staged changes.
+	void Discard();
+	// Count: Returns the number of staged changes.
+	int  Count() const;
+
+private:
+	CTransaction(const CTransaction&) = delete;
+	CTransaction& operator=(const CTransaction&) = delete;
+
+	// Stage: Adds a change to the list.
+	void Stage(e_Operation Op, const t_Str &szSection, const t_Str &szKey,
+		const t_Str &szValue, const t_Str &szComment);
+
+	CDataFile&               m_DataFile;
+	std::vector<t_Operation> m_Operations;
+};
+
+
+// CLayeredDataFile
+// A read-only view of a stack of CDataFiles, say defaults, site, host and
+// local settings, in which every key has the value of the topmost layer
+// that has it. The layers are not merged or copied: the view keeps an index
+// of where every key resolves to, and the values, which is brought up to
+// date with the sections that changed in any layer (see SectionGeneration)
+// the next time the view is read. The layers bump a counter of the view's
+// whenever they change, and the index is published the way snapshots are
+// (see CSnapshot), so reading a key takes no lock: one check of the counter
+// and two hash lookups, however many layers there are. Any number of
+// threads may read the view at the same time. The layers must outlive it.
+class CLayeredDataFile
+{
+public:
+	CLayeredDataFile();
+	~CLayeredDataFile();
+
+	// AddLayer: Puts a data file on top of the others.
+	void AddLayer(CDataFile &Layer);
+	// LayerCount: Returns the number of layers.
+	int  LayerCount();
+	// FindLayer: Returns the layer a key is resolved from, 0 being the
+	// bottom one, or -1 if no layer has it.
+	int  FindLayer(const t_Str &szKey, const t_Str &szSection);
+
+	// The same as their CDataFile counterparts, for the topmost layer that
+	// has the key (or section).
+	bool GetValue(const t_Str &szKey, const t_Str &szSection, t_Str &ret);
+	bool GetString(const t_Str &szKey, const t_Str &szSection, t_Str &ret);
+	bool GetFloat(const t_Str &szKey, const t_Str &szSection, float &ret);
+	bool GetInt(const t_Str &szKey, const t_Str &szSection, int &ret);
+	bool GetBool(const t_Str &szKey, const t_Str &szSection, bool &ret);
+	bool HasSection(const t_Str &szSection);
+
+private:
+	CLayeredDataFile(const CLayeredDataFile&) = delete;
+	CLayeredDataFile& operator=(const CLayeredDataFile&) = delete;
+
+	// st_layer
+	// A layer, and the generations of it and of its sections (by lower-cased
+	// name) the index was last brought up to date with.
+	typedef struct st_layer
+	{
+		CDataFile*                                     pFile;
+		unsigned long long                             nGeneration;
+		std::unordered_map<t_Str, unsigned long long> Sections;
+	} t_Layer;
+
+	// st_resolved
+	// A key of the view: its value and the layer it comes from.
+	typedef struct st_resolved
+	{
+		t_Str szValue;
+		int   nLayer;
+	} t_Resolved;
+
+	typedef std::unordered_map<t_Str, t_Resolved> ResolvedKeys;
+
+	// st_index
+	// The keys of the view, by lower-cased section and key, as of a value
+	// of the change counter. Never changed once published; sections that
+	// did not change are shared with the index it replaced.
+	typedef struct st_index
+	{
+		std::unordered_map< t_Str, std::shared_ptr<const ResolvedKeys> > Sections;
+		unsigned long long nDirty;
+		unsigned long long nRetired;  // The epoch it was replaced in.
+		struct st_index*   pNext;     // The next retired one.
+	} t_Index;
+
+	// Current: Returns the index, once it is up to date. The caller must
+	// have entered an epoch.
+	const t_Index* Current();
+	// Refresh: Publishes an index in which the sections that changed in any
+	// layer are indexed again.
+	void Refresh();
+	// IndexSection: Resolves the keys of a section, by lower-cased name.
+	void IndexSection(const t_Str &szSection, t_Index &Index);
+	// Lookup: Finds a key in the current index. Returns false if no layer
+	// has it.
+	bool Lookup(const t_Str &szKey, const t_Str &szSection, t_Str &szValue, int &nLayer);
+
+	std::mutex                      m_Mutex;    // Guards the layers, and refreshes.
+	std::vector<t_Layer>            m_Layers;   // Bottom one first.
+	std::atomic<unsigned long long> m_nDirty;   // Bumped by the layers.
+	std::atomic<t_Index*>           m_pIndex;   // Published for the readers.
+	t_Index*                        m_pRetired; // Replaced, maybe still in use.
 };
 
 } // namespace
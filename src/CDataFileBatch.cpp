@@ -0,0 +1,788 @@
+//
+// CDataFile Batch I/O
+//
+// Loading and saving many files at once. For tools that go through thousands
+// of config files, the open/read/close system calls cost more than the
+// parsing. On Linux these calls are queued on an io_uring, so that the
+// operations for all of the files are submitted together and completed
+// asynchronously by the kernel. Where io_uring is not available (older
+// kernels, other systems, or a sandbox that forbids it) each operation is
+// simply carried out with the ordinary POSIX call.
+//
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#if !defined(WIN32)
+	#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+	#if __has_include(<linux/io_uring.h>)
+		#define CDF_IO_URING
+		#include <linux/io_uring.h>
+		#include <sys/mman.h>
+		#include <sys/syscall.h>
+	#endif
+#endif
+
+#include "CDataFile.h"
+using namespace cdf;
+
+// The largest single read or write handed to the kernel; io_uring lengths
+// are 32 bits. Anything left over is finished off synchronously.
+const size_t MAX_IO_CHUNK = (1u<<30);
+
+// The most operations in flight at any one time.
+const unsigned MAX_RING_ENTRIES = 256;
+
+// The most files a batch has open at any one time; longer lists are done
+// in several goes, to stay clear of the descriptor limit.
+const size_t MAX_BATCH_FILES = 512;
+
+
+// e_IoOp
+// The file operations a batch is made of.
+enum e_IoOp
+{
+	IO_OPEN = 0,
+	IO_STAT,
+	IO_READ,
+	IO_WRITE,
+	IO_FSYNC,
+	IO_CLOSE
+};
+
+// st_ioop
+// One file operation, and its outcome. nResult follows the kernel's
+// convention: -errno on failure, the file descriptor for an open.
+typedef struct st_ioop
+{
+	e_IoOp      Op;
+	int         fd;
+	const char* pszPath;
+	int         nFlags;
+	char*       pBuffer;
+	size_t      nLength;
+	long long   nOffset;
+	t_FileStamp Stamp;
+	int         nResult;
+#ifdef CDF_IO_URING
+	struct statx Statx;
+#endif
+
+	st_ioop()
+	{
+		Op = IO_OPEN;
+		fd = -1;
+		pszPath = NULL;
+		nFlags = 0;
+		pBuffer = NULL;
+		nLength = 0;
+		nOffset = 0;
+		nResult = 0;
+	}
+
+} t_IoOp;
+
+
+// RunSync
+// Carries out an operation with ordinary blocking calls. Reads and writes
+// start at byte nDone, for finishing off what the ring did not.
+static void RunSync(t_IoOp &Op, size_t nDone)
+{
+#ifdef WIN32
+	Op.nResult = -ENOSYS;
+#else
+	ssize_t nRet;
+
+	switch ( Op.Op )
+	{
+		case IO_OPEN:
+			Op.nResult = open(Op.pszPath, Op.nFlags, 0666);
+			if ( Op.nResult < 0 )
+				Op.nResult = -errno;
+			break;
+
+		case IO_STAT:
+			Op.nResult = GetFileStamp(Op.pszPath, Op.Stamp) ? 0 : -ENOENT;
+			break;
+
+		case IO_READ:
+		case IO_WRITE:
+			while ( nDone < Op.nLength )
+			{
+				if ( Op.Op == IO_READ )
+					nRet = pread(Op.fd, Op.pBuffer + nDone, Op.nLength - nDone, (off_t)(Op.nOffset + nDone));
+				else
+					nRet = pwrite(Op.fd, Op.pBuffer + nDone, Op.nLength - nDone, (off_t)(Op.nOffset + nDone));
+
+				if ( nRet < 0 && errno == EINTR )
+					continue;
+				if ( nRet <= 0 )
+					break;
+
+				nDone += nRet;
+			}
+
+			Op.nResult = nDone == Op.nLength ? 0 : -EIO;
+			break;
+
+		case IO_FSYNC:
+			Op.nResult = fsync(Op.fd) == 0 ? 0 : -errno;
+			break;
+
+		case IO_CLOSE:
+			Op.nResult = close(Op.fd) == 0 ? 0 : -errno;
+			break;
+	}
+#endif
+}
+
+
+#ifdef CDF_IO_URING
+// CRing
+// A bare bones io_uring: the submission and completion queues mapped into
+// our address space, and just enough code to fill the one and drain the
+// other. Only one thread ever uses a ring.
+class CRing
+{
+public:
+	CRing()
+	{
+		m_nFd = -1;
+		m_pSq = m_pCq = MAP_FAILED;
+		m_pSqes = (struct io_uring_sqe*)MAP_FAILED;
+		m_nSqSize = m_nCqSize = 0;
+		m_nEntries = 0;
+		m_nUnsubmitted = 0;
+		m_bBroken = false;
+	}
+
+	~CRing()
+	{
+		if ( m_pSqes != MAP_FAILED )
+			munmap(m_pSqes, m_nEntries * sizeof(struct io_uring_sqe));
+		if ( m_pCq != MAP_FAILED && m_pCq != m_pSq )
+			munmap(m_pCq, m_nCqSize);
+		if ( m_pSq != MAP_FAILED )
+			munmap(m_pSq, m_nSqSize);
+		if ( m_nFd >= 0 )
+			close(m_nFd);
+	}
+
+	bool Init(unsigned nEntries)
+	{
+		struct io_uring_params Params;
+		memset(&Params, 0, sizeof(Params));
+
+		m_nFd = (int)syscall(__NR_io_uring_setup, nEntries, &Params);
+		if ( m_nFd < 0 )
+			return false;
+
+		m_nEntries = Params.sq_entries;
+		m_nSqSize = Params.sq_off.array + Params.sq_entries * sizeof(unsigned);
+		m_nCqSize = Params.cq_off.cqes + Params.cq_entries * sizeof(struct io_uring_cqe);
+
+		if ( Params.features & IORING_FEAT_SINGLE_MMAP )
+			m_nSqSize = m_nCqSize = std::max(m_nSqSize, m_nCqSize);
+
+		m_pSq = mmap(NULL, m_nSqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_nFd, IORING_OFF_SQ_RING);
+		if ( m_pSq == MAP_FAILED )
+			return false;
+
+		if ( Params.features & IORING_FEAT_SINGLE_MMAP )
+			m_pCq = m_pSq;
+		else
+			m_pCq = mmap(NULL, m_nCqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_nFd, IORING_OFF_CQ_RING);
+
+		if ( m_pCq == MAP_FAILED )
+			return false;
+
+		m_pSqes = (struct io_uring_sqe*)mmap(NULL, m_nEntries * sizeof(struct io_uring_sqe),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_nFd, IORING_OFF_SQES);
+		if ( m_pSqes == MAP_FAILED )
+			return false;
+
+		m_pSqHead  = (unsigned*)((char*)m_pSq + Params.sq_off.head);
+		m_pSqTail  = (unsigned*)((char*)m_pSq + Params.sq_off.tail);
+		m_pSqMask  = (unsigned*)((char*)m_pSq + Params.sq_off.ring_mask);
+		m_pSqArray = (unsigned*)((char*)m_pSq + Params.sq_off.array);
+		m_pCqHead  = (unsigned*)((char*)m_pCq + Params.cq_off.head);
+		m_pCqTail  = (unsigned*)((char*)m_pCq + Params.cq_off.tail);
+		m_pCqMask  = (unsigned*)((char*)m_pCq + Params.cq_off.ring_mask);
+		m_pCqes    = (struct io_uring_cqe*)((char*)m_pCq + Params.cq_off.cqes);
+
+		return true;
+	}
+
+	unsigned Capacity() const
+	{
+		return m_nEntries;
+	}
+
+	// True once Enter() has failed; nothing more is submitted after that.
+	bool Broken() const
+	{
+		return m_bBroken;
+	}
+
+	// The number of queued operations the kernel has not taken yet. These
+	// are always the last ones queued.
+	unsigned Unsubmitted() const
+	{
+		return *m_pSqTail - __atomic_load_n(m_pSqHead, __ATOMIC_ACQUIRE);
+	}
+
+	// Queues an operation. The caller keeps no more than Capacity() in flight.
+	void Push(t_IoOp &Op, unsigned long long nUser)
+	{
+		unsigned nTail = *m_pSqTail;
+		unsigned nIndex = nTail & *m_pSqMask;
+		struct io_uring_sqe* pSqe = &m_pSqes[nIndex];
+
+		memset(pSqe, 0, sizeof(*pSqe));
+		pSqe->user_data = nUser;
+		pSqe->fd = Op.fd;
+
+		switch ( Op.Op )
+		{
+			case IO_OPEN:
+				pSqe->opcode = IORING_OP_OPENAT;
+				pSqe->fd = AT_FDCWD;
+				pSqe->addr = (unsigned long)Op.pszPath;
+				pSqe->open_flags = Op.nFlags;
+				pSqe->len = 0666;
+				break;
+
+			case IO_STAT:
+				pSqe->opcode = IORING_OP_STATX;
+				pSqe->fd = AT_FDCWD;
+				pSqe->addr = (unsigned long)Op.pszPath;
+				pSqe->len = STATX_SIZE|STATX_MTIME|STATX_INO;
+				pSqe->off = (unsigned long)&Op.Statx;
+				break;
+
+			case IO_READ:
+			case IO_WRITE:
+				pSqe->opcode = Op.Op == IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+				pSqe->addr = (unsigned long)Op.pBuffer;
+				pSqe->len = (unsigned)std::min(Op.nLength, MAX_IO_CHUNK);
+				pSqe->off = (unsigned long long)Op.nOffset;
+				break;
+
+			case IO_FSYNC:
+				pSqe->opcode = IORING_OP_FSYNC;
+				break;
+
+			case IO_CLOSE:
+				pSqe->opcode = IORING_OP_CLOSE;
+				break;
+		}
+
+		m_pSqArray[nIndex] = nIndex;
+		__atomic_store_n(m_pSqTail, nTail + 1, __ATOMIC_RELEASE);
+		m_nUnsubmitted++;
+	}
+
+	// Submits what has been queued and waits for at least one completion.
+	// Returns false if the ring can not be used any more.
+	bool Enter()
+	{
+		int nRet = (int)syscall(__NR_io_uring_enter, m_nFd, m_nUnsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+		if ( nRet < 0 )
+		{
+			if ( errno == EINTR || errno == EAGAIN || errno == EBUSY )
+				return true;
+
+			m_bBroken = true;
+			return false;
+		}
+
+		m_nUnsubmitted -= nRet;
+		return true;
+	}
+
+	// Waits for at least one completion, submitting nothing. Returns false
+	// if the ring can not be waited on either.
+	bool Wait()
+	{
+		if ( syscall(__NR_io_uring_enter, m_nFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) >= 0 )
+			return true;
+
+		return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+	}
+
+	// Takes the next completion off the queue, if there is one.
+	bool Pop(unsigned long long &nUser, int &nResult)
+	{
+		unsigned nHead = *m_pCqHead;
+
+		if ( nHead == __atomic_load_n(m_pCqTail, __ATOMIC_ACQUIRE) )
+			return false;
+
+		struct io_uring_cqe* pCqe = &m_pCqes[nHead & *m_pCqMask];
+		nUser = pCqe->user_data;
+		nResult = pCqe->res;
+
+		__atomic_store_n(m_pCqHead, nHead + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+private:
+	int       m_nFd;
+	void*     m_pSq;
+	void*     m_pCq;
+	size_t    m_nSqSize;
+	size_t    m_nCqSize;
+	unsigned  m_nEntries;
+	unsigned  m_nUnsubmitted;
+	bool      m_bBroken;
+	unsigned* m_pSqHead;
+	unsigned* m_pSqTail;
+	unsigned* m_pSqMask;
+	unsigned* m_pSqArray;
+	unsigned* m_pCqHead;
+	unsigned* m_pCqTail;
+	unsigned* m_pCqMask;
+	struct io_uring_sqe* m_pSqes;
+	struct io_uring_cqe* m_pCqes;
+};
+
+// Complete
+// Records the outcome of an operation the ring carried out. Operations the
+// kernel does not know (older kernels) are redone synchronously, as are
+// reads and writes it only did part of.
+static void Complete(t_IoOp &Op, int nResult)
+{
+	if ( nResult == -EINVAL || nResult == -EOPNOTSUPP )
+	{
+		RunSync(Op, 0);
+		return;
+	}
+
+	Op.nResult = nResult;
+
+	if ( Op.Op == IO_STAT && nResult == 0 )
+	{
+		Op.Stamp.nSize = (long long)Op.Statx.stx_size;
+		Op.Stamp.nTime = (long long)Op.Statx.stx_mtime.tv_sec * 1000000000LL + Op.Statx.stx_mtime.tv_nsec;
+		Op.Stamp.nInode = (long long)Op.Statx.stx_ino;
+	}
+
+	if ( (Op.Op == IO_READ || Op.Op == IO_WRITE) && nResult >= 0 && (size_t)nResult < Op.nLength )
+		RunSync(Op, (size_t)nResult);
+}
+#endif
+
+// RunOps
+// Carries out a set of independent operations, in any order. With a ring
+// they are all queued up (as many at a time as the ring holds) and reaped
+// as they complete; without one they are run one by one. Should the ring
+// fail part way, the operations the kernel has taken are waited for, since
+// it may still be writing to them, and only those it never saw are run
+// with plain I/O: running the others again would open or close twice.
+static void RunOps(void* pRing, std::vector<t_IoOp> &Ops)
+{
+	size_t i;
+
+#ifdef CDF_IO_URING
+	CRing* pQueue = (CRing*)pRing;
+	std::vector<bool> Done(Ops.size(), false);
+	size_t nNext = 0;
+	size_t nDone = 0;
+	size_t nInFlight = 0;
+	unsigned long long nUser;
+	int nResult;
+
+	while ( pQueue && !pQueue->Broken() && nDone < Ops.size() )
+	{
+		while ( nNext < Ops.size() && nInFlight < pQueue->Capacity() )
+		{
+			pQueue->Push(Ops[nNext], nNext);
+			nNext++;
+			nInFlight++;
+		}
+
+		if ( !pQueue->Enter() )
+			break;
+
+		while ( pQueue->Pop(nUser, nResult) )
+		{
+			Complete(Ops[nUser], nResult);
+			Done[nUser] = true;
+			nInFlight--;
+			nDone++;
+		}
+	}
+
+	// The kernel never saw the last nLost operations queued.
+	size_t nLost = 0;
+
+	if ( pQueue && pQueue->Broken() && nDone < Ops.size() )
+	{
+		Report(E_WARN, "[CDataFile::RunOps] io_uring failed, finishing with plain I/O.");
+
+		// The ring may still hold what an earlier failed call left on it.
+		nLost = std::min<size_t>(pQueue->Unsubmitted(), nInFlight);
+
+		while ( nInFlight > nLost )
+		{
+			while ( pQueue->Pop(nUser, nResult) )
+			{
+				Complete(Ops[nUser], nResult);
+				Done[nUser] = true;
+				nInFlight--;
+				nDone++;
+			}
+
+			if ( nInFlight > nLost && !pQueue->Wait() )
+			{
+				Report(E_ERROR, "[CDataFile::RunOps] Unable to wait for %u operations.",
+					(unsigned)(nInFlight - nLost));
+				break;
+			}
+		}
+	}
+
+	// Whatever the ring did not get to. Those it took but we could not
+	// wait for are given up on, rather than run a second time.
+	for (i = 0; i < Ops.size(); i++)
+	{
+		if ( Done[i] )
+			continue;
+
+		if ( i < nNext - nLost )
+			Ops[i].nResult = -ECANCELED;
+		else
+			RunSync(Ops[i], 0);
+	}
+#else
+	(void)pRing;
+
+	for (i = 0; i < Ops.size(); i++)
+		RunSync(Ops[i], 0);
+#endif
+}
+
+// OpenRing
+// Sets up a ring for nOps operations at a time, or returns NULL if io_uring
+// can not be used here.
+static void* OpenRing(size_t nOps)
+{
+#ifdef CDF_IO_URING
+	CRing* pRing = new CRing;
+
+	if ( pRing->Init((unsigned)std::max<size_t>(1, std::min<size_t>(nOps, MAX_RING_ENTRIES))) )
+		return pRing;
+
+	delete pRing;
+#else
+	(void)nOps;
+#endif
+
+	return NULL;
+}
+
+// CloseRing
+// Tears down a ring from OpenRing().
+static void CloseRing(void* pRing)
+{
+#ifdef CDF_IO_URING
+	delete (CRing*)pRing;
+#else
+	(void)pRing;
+#endif
+}
+
+
+// LoadBatch
+// Loads FileNames[i] into Files[i] the way Load() does, but in three rounds
+// of operations across all of the files: open and stat every file, read
+// every file, close every file. Parsing happens once everything is read.
+int cdf::CDataFile::LoadBatch(const std::vector<CDataFile*> &Files, const std::vector<t_Str> &FileNames)
+{
+	size_t nFiles = std::min(Files.size(), FileNames.size());
+
+	if ( nFiles > MAX_BATCH_FILES )
+	{
+		int nTotal = 0;
+
+		for (size_t nFirst = 0; nFirst < nFiles; nFirst += MAX_BATCH_FILES)
+		{
+			size_t nLast = std::min(nFiles, nFirst + MAX_BATCH_FILES);
+
+			nTotal += LoadBatch(std::vector<CDataFile*>(Files.begin() + nFirst, Files.begin() + nLast),
+				std::vector<t_Str>(FileNames.begin() + nFirst, FileNames.begin() + nLast));
+		}
+
+		return nTotal;
+	}
+	std::vector<t_IoOp> Opens(2 * nFiles);
+	std::vector<t_IoOp> Reads;
+	std::vector<t_IoOp> Closes;
+	std::vector<t_Str> Data(nFiles);
+	std::vector<size_t> ReadOf;
+	int nLoaded = 0;
+	size_t i;
+
+	void* pRing = OpenRing(2 * nFiles);
+
+	for (i = 0; i < nFiles; i++)
+	{
+		Opens[2*i].Op = IO_OPEN;
+		Opens[2*i].pszPath = FileNames[i].c_str();
+		Opens[2*i].nFlags = O_RDONLY|O_CLOEXEC;
+		Opens[2*i+1].Op = IO_STAT;
+		Opens[2*i+1].pszPath = FileNames[i].c_str();
+	}
+
+	RunOps(pRing, Opens);
+
+	for (i = 0; i < nFiles; i++)
+	{
+		t_IoOp &Open = Opens[2*i];
+		t_IoOp &Stat = Opens[2*i+1];
+
+		if ( Open.nResult < 0 )
+			continue;
+
+		if ( Stat.nResult == 0 && Stat.Stamp.nSize > 0 )
+		{
+			t_IoOp Read;
+
+			Data[i].resize((size_t)Stat.Stamp.nSize);
+			Read.Op = IO_READ;
+			Read.fd = Open.nResult;
+			Read.pBuffer = &Data[i][0];
+			Read.nLength = Data[i].size();
+			Reads.push_back(Read);
+			ReadOf.push_back(i);
+		}
+
+		t_IoOp Close;
+		Close.Op = IO_CLOSE;
+		Close.fd = Open.nResult;
+		Closes.push_back(Close);
+	}
+
+	RunOps(pRing, Reads);
+	RunOps(pRing, Closes);
+	CloseRing(pRing);
+
+	for (i = 0; i < Reads.size(); i++)
+	{
+		if ( Reads[i].nResult < 0 )
+		{
+			Report(E_ERROR, "[CDataFile::LoadBatch] Unable to read <%s>.", FileNames[ReadOf[i]].c_str());
+			Opens[2*ReadOf[i]].nResult = Reads[i].nResult;
+		}
+	}
+
+	for (i = 0; i < nFiles; i++)
+	{
+		if ( Opens[2*i].nResult < 0 )
+		{
+			Report(E_INFO, "[CDataFile::LoadBatch] Unable to open <%s>. Does it exist?", FileNames[i].c_str());
+			continue;
+		}
+
+		CWriteLock Lock(Files[i]);
+
+		Files[i]->LoadData(FileNames[i], Data[i], Opens[2*i+1].nResult == 0 ? &Opens[2*i+1].Stamp : NULL);
+		nLoaded++;
+	}
+
+	return nLoaded;
+}
+
+// SaveBatch
+// Saves every file in the list the way a full Save() does, in rounds of
+// operations across all of the files: open, write, fsync (if bSync) and
+// close. Files whose contents would not change are skipped. The files stay
+// locked throughout.
+int cdf::CDataFile::SaveBatch(const std::vector<CDataFile*> &Files, bool bSync)
+{
+	if ( Files.size() > MAX_BATCH_FILES )
+	{
+		int nTotal = 0;
+
+		for (size_t nFirst = 0; nFirst < Files.size(); nFirst += MAX_BATCH_FILES)
+		{
+			size_t nLast = std::min(Files.size(), nFirst + MAX_BATCH_FILES);
+
+			nTotal += SaveBatch(std::vector<CDataFile*>(Files.begin() + nFirst, Files.begin() + nLast), bSync);
+		}
+
+		return nTotal;
+	}
+
+	// Lock in address order, so that two batches can not deadlock.
+	std::vector<CDataFile*> Order(Files);
+	std::sort(Order.begin(), Order.end());
+	Order.erase(std::unique(Order.begin(), Order.end()), Order.end());
+
+	std::vector< std::unique_lock<CSharedMutex> > Locks;
+	size_t i, c;
+
+	for (i = 0; i < Order.size(); i++)
+		Locks.push_back(std::unique_lock<CSharedMutex>(Order[i]->m_Mutex));
+
+	size_t nFiles = Order.size();
+	std::vector< std::vector<t_Str> > Chunks(nFiles);
+	std::vector< std::vector<long long> > Offsets(nFiles);
+	std::vector< std::vector<unsigned long long> > Hashes(nFiles);
+	std::vector<bool> Failed(nFiles, false);
+	std::vector<bool> Skipped(nFiles, false);
+
+	for (i = 0; i < nFiles; i++)
+	{
+		CDataFile* pFile = Order[i];
+
+		if ( pFile->m_szFileName.size() == 0 )
+		{
+			Report(E_ERROR, "[CDataFile::SaveBatch] No filename has been set.");
+			Failed[i] = true;
+			continue;
+		}
+
+		if ( pFile->KeyCount() == 0 && pFile->SectionCount() == 0 )
+		{
+			Report(E_INFO, "[CDataFile::SaveBatch] Nothing to save.");
+			Failed[i] = true;
+			continue;
+		}
+
+		pFile->SerializeChunks(Chunks[i], Offsets[i]);
+		pFile->HashChunks(Chunks[i], Offsets[i], Hashes[i]);
+
+		// As in Save(), files that would come out the same are left alone.
+		if ( pFile->Unchanged(Offsets[i], Hashes[i]) )
+		{
+			pFile->MarkClean();
+			pFile->m_bDirty = false;
+			pFile->ResetJournal();
+			Skipped[i] = true;
+		}
+	}
+
+	std::vector<t_IoOp> Writes;
+	std::vector<t_IoOp> Syncs;
+	std::vector<t_IoOp> Closes;
+	std::vector<size_t> WriteOf;
+	std::vector<size_t> SyncOf;
+	std::vector<size_t> OpenOf;
+	std::vector<t_IoOp> Opens;
+
+	for (i = 0; i < nFiles; i++)
+	{
+		if ( Failed[i] || Skipped[i] )
+			continue;
+
+		t_IoOp Open;
+		Open.Op = IO_OPEN;
+		Open.pszPath = Order[i]->m_szFileName.c_str();
+		Open.nFlags = O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC;
+		Opens.push_back(Open);
+		OpenOf.push_back(i);
+	}
+
+	void* pRing = OpenRing(Opens.size() * 2);
+
+	RunOps(pRing, Opens);
+
+	for (size_t o = 0; o < Opens.size(); o++)
+	{
+		i = OpenOf[o];
+
+		if ( Opens[o].nResult < 0 )
+		{
+			Report(E_ERROR, "[CDataFile::SaveBatch] Unable to save file <%s>.", Order[i]->m_szFileName.c_str());
+			Failed[i] = true;
+			continue;
+		}
+
+		// Each chunk goes to its own offset, so they can be written in any order.
+		long long nOffset = 0;
+
+		for (c = 0; c < Chunks[i].size(); c++)
+		{
+			t_IoOp Write;
+
+			if ( Chunks[i][c].size() == 0 )
+				continue;
+
+			Write.Op = IO_WRITE;
+			Write.fd = Opens[o].nResult;
+			Write.pBuffer = &Chunks[i][c][0];
+			Write.nLength = Chunks[i][c].size();
+			Write.nOffset = nOffset;
+			Writes.push_back(Write);
+			WriteOf.push_back(i);
+
+			nOffset += (long long)Write.nLength;
+		}
+
+		if ( bSync )
+		{
+			t_IoOp Sync;
+			Sync.Op = IO_FSYNC;
+			Sync.fd = Opens[o].nResult;
+			Syncs.push_back(Sync);
+			SyncOf.push_back(i);
+		}
+
+		t_IoOp Close;
+		Close.Op = IO_CLOSE;
+		Close.fd = Opens[o].nResult;
+		Closes.push_back(Close);
+	}
+
+	RunOps(pRing, Writes);
+	RunOps(pRing, Syncs);
+	RunOps(pRing, Closes);
+	CloseRing(pRing);
+
+	for (i = 0; i < Writes.size(); i++)
+	{
+		if ( Writes[i].nResult < 0 && !Failed[WriteOf[i]] )
+		{
+			Report(E_ERROR, "[CDataFile::SaveBatch] Unable to write file <%s>.", Order[WriteOf[i]]->m_szFileName.c_str());
+			Failed[WriteOf[i]] = true;
+		}
+	}
+
+	for (i = 0; i < Syncs.size(); i++)
+	{
+		if ( Syncs[i].nResult < 0 && !Failed[SyncOf[i]] )
+		{
+			Report(E_ERROR, "[CDataFile::SaveBatch] Unable to sync file <%s>.", Order[SyncOf[i]]->m_szFileName.c_str());
+			Failed[SyncOf[i]] = true;
+		}
+	}
+
+	int nSaved = 0;
+
+	for (i = 0; i < nFiles; i++)
+	{
+		if ( Failed[i] )
+		{
+			Order[i]->m_bSpansValid = false;
+			continue;
+		}
+
+		if ( !Skipped[i] )
+			Order[i]->SaveDone(Chunks[i], Offsets[i], Hashes[i]);
+
+		nSaved++;
+	}
+
+	return nSaved;
+}
@@ -0,0 +1,191 @@
+//
+// CDataFile Diffs
+//
+// Working out what changed between two versions of the same data, such as
+// the data before and after a reload, so that only the parts of a program
+// that depend on what changed need to be restarted. Every section keeps a
+// hash of its keys until it is next modified, so a diff of two big files
+// that differ in a few places only looks at the keys of those few sections.
+// Sections that are still as they were read from (or written to) disk are
+// compared by the hash of their bytes, which the incremental save keeps
+// anyway, so two freshly loaded files need not even be hashed.
+//
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+
+#include "CDataFile.h"
+using namespace cdf;
+
+
+// KeysHash
+// Returns the hash of the keys and values of a section, working it out if
+// it is not up to date. The hashes of the keys are added up, so that their
+// order does not matter. Only called with the data locked exclusively.
+static unsigned long long KeysHash(t_Section &Section)
+{
+	if ( Section.bKeysHashed )
+		return Section.nKeysHash;
+
+	unsigned long long nHash = 0;
+	t_Str szBuffer;
+
+	for (KeyItor k_pos = Section.Keys.begin(); k_pos != Section.Keys.end(); k_pos++)
+	{
+		szBuffer = LowerCase((*k_pos).szKey);
+		szBuffer += '\0';
+		szBuffer += (*k_pos).szValue;
+
+		nHash += HashBytes(szBuffer.data(), szBuffer.size());
+	}
+
+	Section.nKeysHash = nHash;
+	Section.bKeysHashed = true;
+
+	return nHash;
+}
+
+// SameKeys
+// Returns true if two sections of the same name have the same keys. The
+// same bytes on disk always parse into the same keys; bOldOnDisk and
+// bNewOnDisk tell whether the byte ranges of the sections of each file
+// still describe it.
+static bool SameKeys(t_Section &Old, bool bOldOnDisk, t_Section &New, bool bNewOnDisk)
+{
+	if ( bOldOnDisk && bNewOnDisk && !Old.bDirty && !New.bDirty &&
+		 Old.nOffset >= 0 && New.nOffset >= 0 &&
+		 Old.nLength == New.nLength && Old.nHash == New.nHash )
+		return true;
+
+	return KeysHash(Old) == KeysHash(New);
+}
+
+// Match
+// Pairs up the entries of two lists that have the same name (pName), and
+// calls Found(pOld, pNew) for every pair, with NULL for pOld or pNew if
+// the entry is only in one of them. Entries that kept their place are
+// paired without any lookup; only the rest go through a hash table.
+template <class T, class F>
+static void Match(std::vector<T> &Old, std::vector<T> &New, t_Str T::*pName, F Found)
+{
+	std::vector<T*> OldLeft;
+	std::vector<T*> NewLeft;
+	size_t nBoth = Old.size() < New.size() ? Old.size() : New.size();
+
+	for (size_t i = 0; i < nBoth; i++)
+	{
+		if ( CompareNoCase(Old[i].*pName, New[i].*pName) == 0 )
+			Found(&Old[i], &New[i]);
+		else
+		{
+			OldLeft.push_back(&Old[i]);
+			NewLeft.push_back(&New[i]);
+		}
+	}
+
+	for (size_t i = nBoth; i < Old.size(); i++)
+		OldLeft.push_back(&Old[i]);
+
+	for (size_t i = nBoth; i < New.size(); i++)
+		NewLeft.push_back(&New[i]);
+
+	std::unordered_map<t_Str, size_t> Index;
+	std::vector<bool> Matched(OldLeft.size(), false);
+
+	for (size_t i = 0; i < OldLeft.size(); i++)
+		Index.emplace(LowerCase(OldLeft[i]->*pName), i);
+
+	for (size_t i = 0; i < NewLeft.size(); i++)
+	{
+		typename std::unordered_map<t_Str, size_t>::iterator pos = Index.find(LowerCase(NewLeft[i]->*pName));
+
+		if ( pos != Index.end() && !Matched[pos->second] )
+		{
+			Matched[pos->second] = true;
+			Found(OldLeft[pos->second], NewLeft[i]);
+		}
+		else
+			Found((T*)NULL, NewLeft[i]);
+	}
+
+	for (size_t i = 0; i < OldLeft.size(); i++)
+	{
+		if ( !Matched[i] )
+			Found(OldLeft[i], (T*)NULL);
+	}
+}
+
+// AddChange
+// Appends a difference to a change list.
+static void AddChange(std::vector<t_Change> &Changes, e_Change Change, const t_Str &szSection,
+	const t_Str &szKey, const t_Str &szOldValue, const t_Str &szNewValue)
+{
+	t_Change Entry;
+
+	Entry.Change = Change;
+	Entry.szSection = szSection;
+	Entry.szKey = szKey;
+	Entry.szOldValue = szOldValue;
+	Entry.szNewValue = szNewValue;
+
+	Changes.push_back(Entry);
+}
+
+
+// Diff
+// Locks the two files and compares their sections.
+size_t cdf::CDataFile::Diff(CDataFile &Old, CDataFile &New, std::vector<t_Change> &Changes)
+{
+	Changes.clear();
+
+	if ( &Old == &New )
+		return 0;
+
+	// The two are always locked in the same order, so that two threads
+	// comparing the same files the other way round can not deadlock.
+	CDataFile* pFirst = std::less<CDataFile*>()(&Old, &New) ? &Old : &New;
+	CWriteLock FirstLock(pFirst);
+	CWriteLock SecondLock(pFirst == &Old ? &New : &Old);
+
+	// The bytes of a file that includes others do not say all there is to it.
+	DiffSections(Old.m_Sections, Old.m_bSpansValid && !Old.m_bIncludes,
+		New.m_Sections, New.m_bSpansValid && !New.m_bIncludes, Changes);
+
+	return Changes.size();
+}
+
+// DiffSections
+// Pairs up the sections of the two lists by name, and the keys of every
+// pair whose hashes do not match. bOldOnDisk and bNewOnDisk tell whether
+// the byte ranges of the sections describe their files.
+void cdf::CDataFile::DiffSections(SectionList &Old, bool bOldOnDisk, SectionList &New, bool bNewOnDisk,
+	std::vector<t_Change> &Changes)
+{
+	t_Str szNone = t_Str("");
+
+	Match(Old, New, &t_Section::szName, [&](t_Section* pOld, t_Section* pNew)
+	{
+		if ( pOld == NULL )
+			AddChange(Changes, CHANGE_ADDED, pNew->szName, szNone, szNone, szNone);
+		else
+		if ( pNew == NULL )
+			AddChange(Changes, CHANGE_REMOVED, pOld->szName, szNone, szNone, szNone);
+		else
+		if ( !SameKeys(*pOld, bOldOnDisk, *pNew, bNewOnDisk) )
+		{
+			Match(pOld->Keys, pNew->Keys, &t_Key::szKey, [&](t_Key* pOldKey, t_Key* pNewKey)
+			{
+				if ( pOldKey == NULL )
+					AddChange(Changes, CHANGE_ADDED, pNew->szName, pNewKey->szKey, szNone, pNewKey->szValue);
+				else
+				if ( pNewKey == NULL )
+					AddChange(Changes, CHANGE_REMOVED, pNew->szName, pOldKey->szKey, pOldKey->szValue, szNone);
+				else
+				if ( pOldKey->szValue != pNewKey->szValue )
+					AddChange(Changes, CHANGE_MODIFIED, pNew->szName, pNewKey->szKey,
+						pOldKey->szValue, pNewKey->szValue);
+			});
+		}
+	});
+}
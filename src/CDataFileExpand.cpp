@@ -0,0 +1,325 @@
+//
+// CDataFile Expansions
+//
+// Values that refer to other keys, as ${section:key}, or ${key} for a key of
+// the same section. A value is expanded the first time it is read and kept,
+// along with the keys it was made from; every key knows the expansions that
+// used it, so a change to a key only drops the expansions that depend on it,
+// directly or through others. A config of thousands of such values costs a
+// hash lookup per read once it has been read through.
+//
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+
+#include "CDataFile.h"
+using namespace cdf;
+
+
+// ExpansionName
+// The name an expansion is kept by: the lower-cased section and key, with a
+// line break between them, which names can not hold.
+static t_Str ExpansionName(const t_Str &szSection, const t_Str &szKey)
+{
+	return LowerCase(szSection) + '\n' + LowerCase(szKey);
+}
+
+// st_expanding
+// A key being expanded: its value, how far we got and what we made of it.
+typedef struct st_expanding
+{
+	t_Str       szName;
+	t_Str       szSection;
+	t_Str       szRaw;
+	size_t      nPos;
+	t_Expansion Expansion;
+} t_Expanding;
+
+// CycleStr
+// Lists the keys of a cycle for a report, as section:key, starting and
+// ending with the key that refers back to itself.
+static t_Str CycleStr(const std::vector<t_Str> &Path, size_t nFrom)
+{
+	t_Str szCycle;
+
+	for (size_t i = nFrom; i <= Path.size(); i++)
+	{
+		t_Str szName = Path[i < Path.size() ? i : nFrom];
+
+		szName[szName.find('\n')] = ':';
+		szCycle += (i > nFrom ? " -> " : "") + szName;
+	}
+
+	return szCycle;
+}
+
+
+// GetExpanded
+// Returns the kept expansion if there is one. Otherwise expands the key,
+// and keeps it and whatever else was expanded along the way, unless some
+// key changed meanwhile (the expansions might have used its old value).
+bool cdf::CDataFile::GetExpanded(const t_Str &szKey, const t_Str &szSection, t_Str &ret)
+{
+	std::shared_lock<CSharedMutex> Lock = ReadLock();
+	t_Str szName = ExpansionName(szSection, szKey);
+	unsigned long long nEpoch;
+
+	// From now on writers tell us about their changes.
+	m_bExpanding = true;
+
+	{
+		std::lock_guard<std::mutex> ExpandLock(m_ExpandMutex);
+		std::unordered_map<t_Str, t_Expansion>::iterator pos = m_Expansions.find(szName);
+
+		if ( pos != m_Expansions.end() )
+		{
+			ret = pos->second.szValue;
+			return pos->second.bFound;
+		}
+
+		nEpoch = m_nExpandEpoch;
+	}
+
+	std::unordered_map<t_Str, t_Expansion> Expanded;
+
+	if ( !Expand(szKey, szSection, Expanded) )
+		return false;
+
+	bool bFound = Expanded[szName].bFound;
+	t_Str szValue = Expanded[szName].szValue;
+
+	{
+		std::lock_guard<std::mutex> ExpandLock(m_ExpandMutex);
+
+		if ( m_nExpandEpoch == nEpoch )
+		{
+			std::unordered_map<t_Str, t_Expansion>::iterator pos;
+
+			for (pos = Expanded.begin(); pos != Expanded.end(); pos++)
+			{
+				if ( !m_Expansions.emplace(pos->first, pos->second).second )
+					continue;
+
+				for (size_t i = 0; i < pos->second.Uses.size(); i++)
+				{
+					const t_Str &szUse = pos->second.Uses[i];
+					size_t nBreak = szUse.find('\n');
+
+					m_ExpansionUsers[szUse.substr(0, nBreak)][szUse.substr(nBreak + 1)].insert(pos->first);
+				}
+			}
+		}
+	}
+
+	if ( !bFound )
+		return false;
+
+	ret = szValue;
+	return true;
+}
+
+// Expand
+// Copies the value of the key, replacing every reference by the expansion
+// of the key it names. Those that are not kept are expanded first, and so
+// on down: the keys being expanded are kept on a stack of our own rather
+// than the thread's, as a chain of references may be thousands long. A key
+// goes back to its references once the one on top of it is done.
+bool cdf::CDataFile::Expand(const t_Str &szKey, const t_Str &szSection,
+	std::unordered_map<t_Str, t_Expansion> &Expanded)
+{
+	std::vector<t_Expanding> Stack;
+	std::unordered_set<t_Str> OnStack;
+	t_Str szRefValue;
+
+	// Looks for an expansion made allready, here or before.
+	auto Found = [&](const t_Str &szName, t_Str &szValue) -> bool
+	{
+		std::unordered_map<t_Str, t_Expansion>::iterator pos = Expanded.find(szName);
+
+		if ( pos == Expanded.end() )
+		{
+			std::lock_guard<std::mutex> ExpandLock(m_ExpandMutex);
+
+			if ( (pos = m_Expansions.find(szName)) == m_Expansions.end() )
+				return false;
+
+			pos = Expanded.emplace(szName, pos->second).first;
+		}
+
+		szValue = pos->second.szValue;
+		return true;
+	};
+
+	// Puts a key on the stack, with its value as it is now.
+	auto Begin = [&](const t_Str &szBeginKey, const t_Str &szBeginSection, const t_Str &szName)
+	{
+		Stack.push_back(t_Expanding());
+
+		t_Expanding &Top = Stack.back();
+		std::shared_lock<CSharedMutex> SectionLock = ReadSection(szBeginSection);
+		t_Key* pKey = GetKey(szBeginKey, szBeginSection);
+
+		Top.szName = szName;
+		Top.szSection = szBeginSection;
+		Top.szRaw = pKey ? pKey->szValue : t_Str("");
+		Top.nPos = 0;
+		Top.Expansion.bFound = pKey != NULL;
+		Top.Expansion.Uses.push_back(szName);
+
+		OnStack.insert(szName);
+	};
+
+	t_Str szName = ExpansionName(szSection, szKey);
+
+	if ( Found(szName, szRefValue) )
+		return true;
+
+	Begin(szKey, szSection, szName);
+
+	while ( Stack.size() > 0 )
+	{
+		t_Expanding &Top = Stack.back();
+		size_t nRef = Top.szRaw.find("${", Top.nPos);
+		size_t nEnd = nRef == t_Str::npos ? t_Str::npos : Top.szRaw.find('}', nRef + 2);
+
+		if ( nEnd == t_Str::npos )
+		{
+			Top.Expansion.szValue.append(Top.szRaw, Top.nPos, t_Str::npos);
+
+			OnStack.erase(Top.szName);
+			Expanded.emplace(Top.szName, Top.Expansion);
+			Stack.pop_back();
+			continue;
+		}
+
+		// $${ stands for ${.
+		if ( nRef > Top.nPos && Top.szRaw[nRef - 1] == '$' )
+		{
+			Top.Expansion.szValue.append(Top.szRaw, Top.nPos, nRef - Top.nPos - 1);
+			Top.Expansion.szValue += "${";
+			Top.nPos = nRef + 2;
+			continue;
+		}
+
+		t_Str szRef = Top.szRaw.substr(nRef + 2, nEnd - nRef - 2);
+		size_t nColon = szRef.rfind(':');
+		t_Str szRefSection = nColon == t_Str::npos ? Top.szSection : szRef.substr(0, nColon);
+		t_Str szRefKey = nColon == t_Str::npos ? szRef : szRef.substr(nColon + 1);
+		t_Str szRefName = ExpansionName(szRefSection, szRefKey);
+
+		if ( Found(szRefName, szRefValue) )
+		{
+			Top.Expansion.szValue.append(Top.szRaw, Top.nPos, nRef - Top.nPos);
+			Top.Expansion.szValue += szRefValue;
+			Top.Expansion.Uses.push_back(szRefName);
+			Top.nPos = nEnd + 1;
+			continue;
+		}
+
+		if ( OnStack.count(szRefName) > 0 )
+		{
+			std::vector<t_Str> Path;
+			size_t nFrom = 0;
+
+			for (size_t i = 0; i < Stack.size(); i++)
+			{
+				if ( Stack[i].szName == szRefName )
+					nFrom = i;
+				Path.push_back(Stack[i].szName);
+			}
+
+			Report(E_ERROR, "[CDataFile::GetExpanded] A value depends on itself: %s.",
+				CycleStr(Path, nFrom).c_str());
+			return false;
+		}
+
+		Begin(szRefKey, szRefSection, szRefName);
+	}
+
+	return true;
+}
+
+// Invalidate
+// Drops the expansions that used the key, then those that used them, and so
+// on. Nothing to do until GetExpanded() has been used.
+void cdf::CDataFile::Invalidate(const t_Str &szSection, const t_Str &szKey)
+{
+	if ( !m_bExpanding )
+		return;
+
+	std::lock_guard<std::mutex> ExpandLock(m_ExpandMutex);
+	std::vector<t_Str> Stale;
+
+	m_nExpandEpoch++;
+	Stale.push_back(szKey.size() > 0 ? ExpansionName(szSection, szKey) : LowerCase(szSection));
+
+	while ( Stale.size() > 0 )
+	{
+		t_Str szName = Stale.back();
+		size_t nBreak = szName.find('\n');
+
+		Stale.pop_back();
+
+		std::unordered_map< t_Str, std::unordered_map< t_Str, std::unordered_set<t_Str> > >::iterator s_pos =
+			m_ExpansionUsers.find(szName.substr(0, nBreak));
+
+		if ( s_pos == m_ExpansionUsers.end() )
+			continue;
+
+		// A section name alone stands for all of its keys.
+		std::vector<t_Str> Users;
+
+		for (std::unordered_map< t_Str, std::unordered_set<t_Str> >::iterator k_pos = s_pos->second.begin();
+			 k_pos != s_pos->second.end(); k_pos++)
+		{
+			if ( nBreak == t_Str::npos || k_pos->first == szName.substr(nBreak + 1) )
+				Users.insert(Users.end(), k_pos->second.begin(), k_pos->second.end());
+		}
+
+		for (size_t i = 0; i < Users.size(); i++)
+		{
+			std::unordered_map<t_Str, t_Expansion>::iterator pos = m_Expansions.find(Users[i]);
+
+			if ( pos == m_Expansions.end() )
+				continue;
+
+			for (size_t u = 0; u < pos->second.Uses.size(); u++)
+			{
+				const t_Str &szUse = pos->second.Uses[u];
+				size_t nUseBreak = szUse.find('\n');
+				t_Str szUseSection = szUse.substr(0, nUseBreak);
+				t_Str szUseKey = szUse.substr(nUseBreak + 1);
+
+				std::unordered_set<t_Str> &Set = m_ExpansionUsers[szUseSection][szUseKey];
+
+				Set.erase(Users[i]);
+				if ( Set.empty() )
+				{
+					m_ExpansionUsers[szUseSection].erase(szUseKey);
+					if ( m_ExpansionUsers[szUseSection].empty() )
+						m_ExpansionUsers.erase(szUseSection);
+				}
+			}
+
+			m_Expansions.erase(pos);
+			Stale.push_back(Users[i]);
+		}
+	}
+}
+
+// ForgetExpansions
+// Drops every expansion, for changes to the data as a whole.
+void cdf::CDataFile::ForgetExpansions()
+{
+	if ( !m_bExpanding )
+		return;
+
+	std::lock_guard<std::mutex> ExpandLock(m_ExpandMutex);
+
+	m_nExpandEpoch++;
+	m_Expansions.clear();
+	m_ExpansionUsers.clear();
+}
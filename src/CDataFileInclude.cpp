@@ -0,0 +1,307 @@
+//
+// CDataFile Includes
+//
+// Files that pull in other files, so that settings many of them share need
+// only be kept in one place. Every included file is parsed once per process
+// and kept, with the versions of the files it was made of, in a cache that
+// all CDataFile objects share; loading a hundred files that include the same
+// one parses it once. The parsed sections are never changed, only copied
+// from, so a file including one can not change what the others see.
+//
+
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "CDataFile.h"
+using namespace cdf;
+
+
+// st_includefile
+// A file that went into a parsed include, and the version of it read.
+typedef struct st_includefile
+{
+	t_Str       szPath;
+	t_FileStamp Stamp;
+} t_IncludeFile;
+
+// st_includeframe
+// An include being parsed by this thread, and the files read for it so far.
+typedef struct st_includeframe
+{
+	t_Str                      szPath;
+	std::vector<t_IncludeFile> Files;
+} t_IncludeFrame;
+
+// CIncludeCache
+// The parsed includes of the process, by canonical path (see RealPath).
+class CIncludeCache
+{
+public:
+	// Find: Returns the sections parsed from a file, if none of the files
+	// they were made of have changed since.
+	std::shared_ptr<const SectionList> Find(const t_Str &szPath, std::vector<t_IncludeFile> &Files)
+	{
+		std::lock_guard<std::mutex> Lock(m_Mutex);
+		std::map<t_Str, t_Entry>::iterator pos = m_Entries.find(szPath);
+
+		if ( pos == m_Entries.end() )
+			return std::shared_ptr<const SectionList>();
+
+		t_FileStamp Stamp;
+
+		for (size_t i = 0; i < pos->second.Files.size(); i++)
+		{
+			const t_IncludeFile &File = pos->second.Files[i];
+
+			if ( !GetFileStamp(File.szPath, Stamp) || !(Stamp == File.Stamp) )
+				return std::shared_ptr<const SectionList>();
+		}
+
+		Files = pos->second.Files;
+		return pos->second.pSections;
+	}
+
+	// Store: Keeps the sections parsed from a file.
+	void Store(const t_Str &szPath, const std::vector<t_IncludeFile> &Files,
+		const std::shared_ptr<const SectionList> &pSections)
+	{
+		std::lock_guard<std::mutex> Lock(m_Mutex);
+		t_Entry &Entry = m_Entries[szPath];
+
+		Entry.Files = Files;
+		Entry.pSections = pSections;
+	}
+
+private:
+	typedef struct st_entry
+	{
+		std::vector<t_IncludeFile>         Files;
+		std::shared_ptr<const SectionList> pSections;
+	} t_Entry;
+
+	std::mutex                 m_Mutex;
+	std::map<t_Str, t_Entry>   m_Entries;
+};
+
+static CIncludeCache& IncludeCache()
+{
+	static CIncludeCache Cache;
+	return Cache;
+}
+
+// The includes this thread is in the middle of parsing, outermost first, by
+// canonical path.
+static std::vector<t_IncludeFrame>& IncludeStack()
+{
+	static thread_local std::vector<t_IncludeFrame> Stack;
+	return Stack;
+}
+
+// IsAbsolute
+// Returns true if a path does not depend on the directory it is used from.
+static bool IsAbsolute(const t_Str &szPath)
+{
+	return szPath.size() > 0 && (szPath[0] == '/' || szPath[0] == '\\' ||
+		(szPath.size() > 1 && szPath[1] == ':'));
+}
+
+// RealPath
+// Sets szReal to the canonical path of an existing file: absolute, with no
+// '.' or '..' parts and, where there are links, that of the file linked to;
+// so that one file has one name however it is reached. Returns false if the
+// file does not exist.
+static bool RealPath(const t_Str &szPath, t_Str &szReal)
+{
+#ifdef WIN32
+	char szBuffer[_MAX_PATH];
+
+	if ( _fullpath(szBuffer, szPath.c_str(), _MAX_PATH) == NULL )
+		return false;
+#else
+	char szBuffer[PATH_MAX];
+
+	if ( realpath(szPath.c_str(), szBuffer) == NULL )
+		return false;
+#endif
+
+	szReal = szBuffer;
+	return true;
+}
+
+
+// Include
+// Keeps the directive in the section it appears in, as a key, so that it
+// is saved back the way it was found, then copies in the keys of the file
+// it names that we do not have yet. Keys outside of any section in that
+// file go into the section the directive is in. Keys that are set later
+// on, further down our own file, replace the included ones as they would
+// any other key.
+void cdf::CDataFile::Include(const t_Str &szPath, const t_Str &szComment, const t_Str &szSection,
+	const t_Str &szFileName)
+{
+	t_Section* pSection = GetSection(szSection);
+
+	if ( pSection == NULL )
+		return;
+
+	// Pushed as is, since one section may include several files.
+	t_Key Directive;
+
+	Directive.szKey = IncludeDirective;
+	Directive.szValue = szPath;
+	Directive.szComment = szComment;
+
+	pSection->Keys.push_back(Directive);
+	Touch(pSection);
+	m_bIncludes = true;
+
+	t_Str szFullPath = szPath;
+	size_t nSlash = szFileName.find_last_of("/\\");
+
+	if ( !IsAbsolute(szPath) && nSlash != t_Str::npos )
+		szFullPath = szFileName.substr(0, nSlash + 1) + szPath;
+
+	// The file being loaded counts as being parsed as well, so that a file
+	// it includes can not include it back.
+	std::vector<t_IncludeFrame> &Stack = IncludeStack();
+	bool bOutermost = Stack.empty();
+
+	if ( bOutermost )
+	{
+		Stack.push_back(t_IncludeFrame());
+		if ( !RealPath(szFileName, Stack.back().szPath) )
+			Stack.back().szPath = szFileName;
+	}
+
+	std::shared_ptr<const SectionList> pIncluded = ParseInclude(szFullPath);
+
+	if ( bOutermost )
+		Stack.pop_back();
+
+	if ( !pIncluded )
+		return;
+
+	for (SectionList::const_iterator s_pos = pIncluded->begin(); s_pos != pIncluded->end(); s_pos++)
+	{
+		const t_Section &Included = (*s_pos);
+		const t_Str &szTarget = Included.szName.size() == 0 ? szSection : Included.szName;
+
+		if ( (pSection = GetSection(szTarget)) == NULL )
+		{
+			m_Sections.push_back(t_Section());
+			pSection = &m_Sections.back();
+			pSection->szName = szTarget;
+			pSection->szComment = Included.szComment;
+			pSection->bIncluded = true;
+
+			Touch(pSection);
+			Notify(CHANGE_ADDED, szTarget, t_Str(""), t_Str(""), t_Str(""));
+		}
+
+		bool bAdded = false;
+
+		for (KeyList::const_iterator k_pos = Included.Keys.begin(); k_pos != Included.Keys.end(); k_pos++)
+		{
+			const t_Key &Key = (*k_pos);
+
+			// The files it includes in turn are allready merged in.
+			if ( Key.szKey.size() == 0 || Key.szKey == IncludeDirective ||
+				 GetKey(Key.szKey, szTarget) != NULL )
+				continue;
+
+			pSection->Keys.push_back(Key);
+			pSection->Keys.back().bIncluded = true;
+			pSection->Keys.back().bValueChanged = false;
+			pSection->Keys.back().bCommentChanged = false;
+			bAdded = true;
+
+			Notify(CHANGE_ADDED, szTarget, Key.szKey, t_Str(""), Key.szValue);
+			UpdateSlot(Key.szKey, szTarget, &Key.szValue);
+		}
+
+		if ( bAdded )
+		{
+			Touch(pSection);
+			Invalidate(szTarget, t_Str(""));
+		}
+	}
+}
+
+// ParseInclude
+// Looks the file up in the cache, and parses it into a CDataFile of its own
+// if it is not there or has changed. Parsing it may include more files;
+// those are recorded along with it, so that a change to any of them makes
+// it parse again. A file that includes itself, directly or not and by
+// whatever path, is reported and left out. Files go by their canonical
+// path, which is also the one parsed, so that the files it includes are
+// found from the same directory whichever way it was reached.
+std::shared_ptr<const SectionList> cdf::CDataFile::ParseInclude(const t_Str &szIncludePath)
+{
+	std::vector<t_IncludeFrame> &Stack = IncludeStack();
+	t_Str szPath;
+
+	if ( !RealPath(szIncludePath, szPath) )
+	{
+		Report(E_ERROR, "[CDataFile::ParseInclude] Unable to read <%s>.", szIncludePath.c_str());
+		return std::shared_ptr<const SectionList>();
+	}
+
+	for (size_t i = 0; i < Stack.size(); i++)
+	{
+		if ( Stack[i].szPath == szPath )
+		{
+			Report(E_ERROR, "[CDataFile::ParseInclude] <%s> includes itself.", szIncludePath.c_str());
+			return std::shared_ptr<const SectionList>();
+		}
+	}
+
+	std::vector<t_IncludeFile> Files;
+	std::shared_ptr<const SectionList> pSections = IncludeCache().Find(szPath, Files);
+
+	if ( !pSections )
+	{
+		t_IncludeFile File;
+
+		File.szPath = szPath;
+		if ( !GetFileStamp(szPath, File.Stamp) )
+		{
+			Report(E_ERROR, "[CDataFile::ParseInclude] Unable to read <%s>.", szPath.c_str());
+			return std::shared_ptr<const SectionList>();
+		}
+
+		// Parsed with the cache unlocked, since it may include more files.
+		CDataFile Included;
+		bool bLoaded;
+
+		Included.SetPersistPolicy(PERSIST_NEVER);
+
+		Stack.push_back(t_IncludeFrame());
+		Stack.back().szPath = szPath;
+		Stack.back().Files.push_back(File);
+
+		bLoaded = Included.Load(szPath);
+
+		Files.swap(Stack.back().Files);
+		Stack.pop_back();
+
+		if ( !bLoaded )
+		{
+			Report(E_ERROR, "[CDataFile::ParseInclude] Unable to read <%s>.", szPath.c_str());
+			return std::shared_ptr<const SectionList>();
+		}
+
+		pSections = std::make_shared<const SectionList>(Included.m_Sections);
+		IncludeCache().Store(szPath, Files, pSections);
+	}
+
+	// Whatever includes this file depends on what it is made of.
+	if ( Stack.size() > 0 )
+		Stack.back().Files.insert(Stack.back().Files.end(), Files.begin(), Files.end());
+
+	return pSections;
+}
@@ -0,0 +1,174 @@
+//
+// CDataFile Subscriptions
+//
+// Telling the rest of a program what changed, as it changes. Subscriptions
+// are filed by section, so a change to a section nobody watches costs a
+// lookup (and nothing at all while there are no subscriptions). Changes
+// that concern someone are recorded under the write lock and handed out
+// once per commit, when the outermost lock is released: a transaction, a
+// batch of the mutation queue or a reload makes one call per observer.
+//
+
+#include <vector>
+#include <string>
+#include <map>
+
+#include "CDataFile.h"
+using namespace cdf;
+
+
+// Concerns
+// Returns true if a change concerns a subscription in its section. szKey
+// is the lower-cased key that changed, empty for the whole section.
+static bool Concerns(const t_Subscription &Subscription, const t_Str &szKey)
+{
+	if ( Subscription.Kind == SUBSCRIBE_SECTION || szKey.size() == 0 )
+		return true;
+
+	if ( Subscription.Kind == SUBSCRIBE_KEY )
+		return szKey == Subscription.szKey;
+
+	return szKey.compare(0, Subscription.szKey.size(), Subscription.szKey) == 0;
+}
+
+
+// Subscribe
+// Subscribes to a single key.
+unsigned long long cdf::CDataFile::Subscribe(const t_Str &szKey, const t_Str &szSection, t_Observer Observer)
+{
+	return AddSubscription(SUBSCRIBE_KEY, szKey, szSection, Observer);
+}
+
+// SubscribeSection
+// Subscribes to every key of a section.
+unsigned long long cdf::CDataFile::SubscribeSection(const t_Str &szSection, t_Observer Observer)
+{
+	return AddSubscription(SUBSCRIBE_SECTION, t_Str(""), szSection, Observer);
+}
+
+// SubscribePrefix
+// Subscribes to the keys of a section that start with a prefix.
+unsigned long long cdf::CDataFile::SubscribePrefix(const t_Str &szPrefix, const t_Str &szSection, t_Observer Observer)
+{
+	return AddSubscription(SUBSCRIBE_PREFIX, szPrefix, szSection, Observer);
+}
+
+// AddSubscription
+// Adds a subscription to the list of its section. Taking the write lock
+// makes sure no change is being made meanwhile, in section-locking mode as
+// well: once there are subscriptions, changes lock the data as a whole.
+unsigned long long cdf::CDataFile::AddSubscription(e_Subscription Kind, const t_Str &szKey,
+	const t_Str &szSection, t_Observer Observer)
+{
+	CWriteLock Lock(this);
+
+	t_Subscription Subscription;
+
+	Subscription.nId = ++m_nSubscriptions;
+	Subscription.Kind = Kind;
+	Subscription.szKey = LowerCase(szKey);
+	Subscription.Observer = Observer;
+
+	m_Subscriptions[LowerCase(szSection)].push_back(Subscription);
+
+	return Subscription.nId;
+}
+
+// Unsubscribe
+// Takes a subscription out of the index. Changes allready on their way to
+// it may still be delivered.
+bool cdf::CDataFile::Unsubscribe(unsigned long long nId)
+{
+	CWriteLock Lock(this);
+
+	std::map< t_Str, std::vector<t_Subscription> >::iterator pos;
+
+	for (pos = m_Subscriptions.begin(); pos != m_Subscriptions.end(); pos++)
+	{
+		std::vector<t_Subscription> &List = pos->second;
+
+		for (size_t i = 0; i < List.size(); i++)
+		{
+			if ( List[i].nId != nId )
+				continue;
+
+			List.erase(List.begin() + i);
+
+			if ( List.empty() )
+				m_Subscriptions.erase(pos);
+
+			return true;
+		}
+	}
+
+	Report(E_INFO, "[CDataFile::Unsubscribe] There is no subscription %llu.", nId);
+	return false;
+}
+
+// Notify
+// Keeps a change for Route(), unless nobody is subscribed to its section.
+void cdf::CDataFile::Notify(e_Change Change, const t_Str &szSection, const t_Str &szKey,
+	const t_Str &szOldValue, const t_Str &szNewValue)
+{
+	if ( m_Subscriptions.empty() || m_Subscriptions.find(LowerCase(szSection)) == m_Subscriptions.end() )
+		return;
+
+	t_Change Notice;
+
+	Notice.Change = Change;
+	Notice.szSection = szSection;
+	Notice.szKey = szKey;
+	Notice.szOldValue = szOldValue;
+	Notice.szNewValue = szNewValue;
+
+	m_Notices.push_back(Notice);
+}
+
+// Route
+// Gives every subscription the changes that concern it, in the order they
+// were made, and copies its observer, so that the observers can be called
+// with the lock released.
+void cdf::CDataFile::Route(std::vector<t_Delivery> &Deliveries)
+{
+	std::map<unsigned long long, size_t> Index;
+
+	for (size_t n = 0; n < m_Notices.size(); n++)
+	{
+		const t_Change &Notice = m_Notices[n];
+		std::map< t_Str, std::vector<t_Subscription> >::iterator pos = m_Subscriptions.find(LowerCase(Notice.szSection));
+
+		if ( pos == m_Subscriptions.end() )
+			continue;
+
+		t_Str szKey = LowerCase(Notice.szKey);
+
+		for (size_t i = 0; i < pos->second.size(); i++)
+		{
+			const t_Subscription &Subscription = pos->second[i];
+
+			if ( !Concerns(Subscription, szKey) )
+				continue;
+
+			std::map<unsigned long long, size_t>::iterator d_pos = Index.find(Subscription.nId);
+
+			if ( d_pos == Index.end() )
+			{
+				d_pos = Index.insert(std::make_pair(Subscription.nId, Deliveries.size())).first;
+				Deliveries.push_back(t_Delivery());
+				Deliveries.back().Observer = Subscription.Observer;
+			}
+
+			Deliveries[d_pos->second].Changes.push_back(Notice);
+		}
+	}
+
+	m_Notices.clear();
+}
+
+// Deliver
+// Calls every observer with its changes.
+void cdf::CDataFile::Deliver(std::vector<t_Delivery> &Deliveries)
+{
+	for (size_t i = 0; i < Deliveries.size(); i++)
+		Deliveries[i].Observer(Deliveries[i].Changes);
+}
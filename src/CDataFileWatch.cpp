@@ -0,0 +1,608 @@
+//
+// CDataFile File Watching
+//
+// Reloading a file when someone else changes it. On Linux the directory the
+// file is in is watched through inotify, which also catches the usual way
+// editors and deployment tools save: writing a new file and renaming it over
+// the old one (the old file's inode never changes, so watching the file
+// itself would miss it). Elsewhere, or when inotify is not available, the
+// file is stat()ed at regular intervals instead.
+//
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <unordered_map>
+#include <string.h>
+#include <errno.h>
+
+#if !defined(WIN32)
+	#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+	#define CDF_INOTIFY
+	#include <sys/inotify.h>
+	#include <poll.h>
+	#include <fcntl.h>
+#endif
+
+#include "CDataFile.h"
+using namespace cdf;
+
+// A burst of events that never lets up still gets the file reloaded once
+// this many quiet spells' worth of time have passed.
+const int MAX_DEBOUNCE_ROUNDS = 10;
+
+
+// CFileWatch
+// Waits for a file to change. Wait() returns once something happened to the
+// file, once the time is up, or once another thread calls Wake().
+class cdf::CFileWatch
+{
+public:
+	CFileWatch(const t_Str &szFileName);
+	~CFileWatch();
+
+	// Wait: Returns true if the file changed within nTimeoutMs (forever if
+	// negative; polling waits for nPollMs at most).
+	bool Wait(int nTimeoutMs, int nPollMs);
+	// Wake: Makes Wait() return right away.
+	void Wake();
+
+private:
+	// Poll: Sleeps up to nTimeoutMs, and returns true if the stamp of the
+	// file changed since the last time.
+	bool Poll(int nTimeoutMs);
+
+	t_Str       m_szFileName;
+	t_FileStamp m_Stamp;     // Polling: the file as last seen.
+	bool        m_bWoken;
+	std::mutex  m_Mutex;
+	std::condition_variable m_Cond;
+
+#if defined(CDF_INOTIFY)
+	// Reads the events that are waiting, and returns true if one of them
+	// was about the file.
+	bool Drain();
+
+	t_Str m_szName;          // The file name, without the directory.
+	int   m_nNotify;         // The inotify descriptor, -1 if polling.
+	int   m_Wake[2];         // A pipe that interrupts poll().
+#endif
+};
+
+// CFileWatch
+// Sets up an inotify watch on the directory of the file, for everything
+// that could replace or change it. Falls back to polling if that fails.
+cdf::CFileWatch::CFileWatch(const t_Str &szFileName)
+{
+	m_szFileName = szFileName;
+	m_bWoken = false;
+	GetFileStamp(m_szFileName, m_Stamp);
+
+#if defined(CDF_INOTIFY)
+	size_t nSlash = szFileName.rfind('/');
+	t_Str szDir = nSlash == t_Str::npos ? t_Str(".") : nSlash == 0 ? t_Str("/") : szFileName.substr(0, nSlash);
+
+	m_szName = nSlash == t_Str::npos ? szFileName : szFileName.substr(nSlash + 1);
+	m_Wake[0] = m_Wake[1] = -1;
+
+	if ( (m_nNotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 )
+		return;
+
+	if ( inotify_add_watch(m_nNotify, szDir.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE |
+		IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_ATTRIB) < 0 || pipe(m_Wake) != 0 )
+	{
+		Report(E_INFO, "[CFileWatch::CFileWatch] inotify is not available for <%s>. Polling instead.",
+			szDir.c_str());
+		close(m_nNotify);
+		m_nNotify = -1;
+		return;
+	}
+
+	fcntl(m_Wake[0], F_SETFL, O_NONBLOCK);
+#endif
+}
+
+cdf::CFileWatch::~CFileWatch()
+{
+#if defined(CDF_INOTIFY)
+	if ( m_nNotify >= 0 )
+	{
+		close(m_nNotify);
+		close(m_Wake[0]);
+		close(m_Wake[1]);
+	}
+#endif
+}
+
+// Wait
+// Waits for inotify to report something about the file, or for the pipe
+// to be written to.
+bool cdf::CFileWatch::Wait(int nTimeoutMs, int nPollMs)
+{
+#if defined(CDF_INOTIFY)
+	if ( m_nNotify >= 0 )
+	{
+		struct pollfd Fds[2];
+
+		Fds[0].fd = m_nNotify;
+		Fds[0].events = POLLIN;
+		Fds[1].fd = m_Wake[0];
+		Fds[1].events = POLLIN;
+
+		std::chrono::steady_clock::time_point tEnd = std::chrono::steady_clock::now() +
+			std::chrono::milliseconds(nTimeoutMs < 0 ? 0 : nTimeoutMs);
+
+		for ( ;; )
+		{
+			int nWait = nTimeoutMs < 0 ? -1 : (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+				tEnd - std::chrono::steady_clock::now()).count();
+
+			if ( nTimeoutMs >= 0 && nWait < 0 )
+				nWait = 0;
+
+			int nReady = poll(Fds, 2, nWait);
+
+			if ( nReady < 0 && errno == EINTR )
+				continue;
+
+			if ( nReady <= 0 || (Fds[1].revents & POLLIN) )
+				return false;
+
+			if ( Drain() )
+				return true;
+
+			// Something else in the directory changed; keep waiting.
+			if ( nTimeoutMs >= 0 && std::chrono::steady_clock::now() >= tEnd )
+				return false;
+		}
+	}
+#endif
+
+	return Poll(nTimeoutMs < 0 || nTimeoutMs > nPollMs ? nPollMs : nTimeoutMs);
+}
+
+#if defined(CDF_INOTIFY)
+// Drain
+// Events come in variable-length records: the fixed header, then the name
+// of the directory entry it is about.
+bool cdf::CFileWatch::Drain()
+{
+	char Buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool bHit = false;
+	ssize_t nRead;
+
+	while ( (nRead = read(m_nNotify, Buffer, sizeof(Buffer))) > 0 )
+	{
+		for (char* p = Buffer; p < Buffer + nRead; )
+		{
+			const struct inotify_event* pEvent = (const struct inotify_event*)p;
+
+			if ( pEvent->len > 0 && m_szName == pEvent->name )
+				bHit = true;
+
+			p += sizeof(struct inotify_event) + pEvent->len;
+		}
+	}
+
+	return bHit;
+}
+#endif
+
+// Wake
+// Writes a byte to the pipe, or wakes up the polling sleep.
+void cdf::CFileWatch::Wake()
+{
+#if defined(CDF_INOTIFY)
+	if ( m_nNotify >= 0 )
+	{
+		char c = 0;
+
+		if ( write(m_Wake[1], &c, 1) != 1 )
+			Report(E_ERROR, "[CFileWatch::Wake] Unable to wake up the watcher of <%s>.", m_szFileName.c_str());
+		return;
+	}
+#endif
+
+	std::lock_guard<std::mutex> Lock(m_Mutex);
+	m_bWoken = true;
+	m_Cond.notify_all();
+}
+
+// Poll
+// Sleeps, unless woken, and compares the stamp of the file with the one
+// seen last.
+bool cdf::CFileWatch::Poll(int nTimeoutMs)
+{
+	{
+		std::unique_lock<std::mutex> Lock(m_Mutex);
+
+		if ( m_Cond.wait_for(Lock, std::chrono::milliseconds(nTimeoutMs), [&] { return m_bWoken; }) )
+			return false;
+	}
+
+	t_FileStamp Stamp;
+	GetFileStamp(m_szFileName, Stamp);
+
+	if ( Stamp == m_Stamp )
+		return false;
+
+	m_Stamp = Stamp;
+	return true;
+}
+
+
+// StartWatcher
+// Starts the watcher thread.
+bool cdf::CDataFile::StartWatcher(int nDebounceMs)
+{
+	std::lock_guard<std::mutex> Lock(m_WatchMutex);
+
+	if ( m_bWatchRun )
+	{
+		Report(E_INFO, "[CDataFile::StartWatcher] The watcher is allready running.");
+		return false;
+	}
+
+	if ( m_szFileName.size() == 0 )
+	{
+		Report(E_ERROR, "[CDataFile::StartWatcher] No filename has been set.");
+		return false;
+	}
+
+	// The watch is set up before returning, so that no change made from
+	// now on can be missed.
+	m_nWatchDebounce = nDebounceMs > 0 ? nDebounceMs : 1;
+	m_pWatch = new CFileWatch(m_szFileName);
+	m_bWatchRun = true;
+	m_Watcher = std::thread(&CDataFile::WatchLoop, this);
+
+	return true;
+}
+
+// StopWatcher
+// Stops the watcher thread and waits for it to finish.
+void cdf::CDataFile::StopWatcher()
+{
+	{
+		std::lock_guard<std::mutex> Lock(m_WatchMutex);
+
+		if ( !m_bWatchRun )
+			return;
+
+		m_bWatchRun = false;
+		m_pWatch->Wake();
+	}
+
+	m_Watcher.join();
+
+	delete m_pWatch;
+	m_pWatch = NULL;
+}
+
+// WatchLoop
+// The watcher. Catches up with any change made before the watch was set
+// up, then sleeps until the file changes, and waits for a quiet spell of
+// m_nWatchDebounce milliseconds (an editor saving, or a tool writing in
+// several goes, can cause a whole burst of events) before reloading it.
+void cdf::CDataFile::WatchLoop()
+{
+	CFileWatch &Watch = *m_pWatch;
+
+	Reload();
+
+	while ( m_bWatchRun )
+	{
+		if ( !Watch.Wait(-1, m_nWatchDebounce) )
+			continue;
+
+		std::chrono::steady_clock::time_point tLimit = std::chrono::steady_clock::now() +
+			std::chrono::milliseconds(m_nWatchDebounce) * MAX_DEBOUNCE_ROUNDS;
+
+		while ( m_bWatchRun && std::chrono::steady_clock::now() < tLimit )
+		{
+			if ( !Watch.Wait(m_nWatchDebounce, m_nWatchDebounce) )
+				break;
+		}
+
+		if ( m_bWatchRun )
+			Reload();
+	}
+}
+
+// Reload
+// Reads the file into a CDataFile of its own, without holding any lock on
+// this one, and then swaps the sections in under the write lock, which is
+// only held for as long as the swap takes (readers of snapshots are not
+// held up at all). Nothing happens if the file is as we last loaded or
+// saved it, which is also how our own saves are told apart from changes
+// made by others, or if it can not be read (it may be in the middle of
+// being replaced; the next event will tell).
+bool cdf::CDataFile::Reload()
+{
+	t_Str szFileName;
+	t_FileStamp Stamp;
+	t_FileStamp Last;
+	long nFlags;
+
+	{
+		std::shared_lock<CSharedMutex> Lock(m_Mutex);
+		szFileName = m_szFileName;
+		Last = m_FileStamp;
+		nFlags = m_Flags;
+	}
+
+	if ( szFileName.size() == 0 || !GetFileStamp(szFileName, Stamp) || Stamp == Last )
+		return false;
+
+	if ( ReloadSections(szFileName, Stamp) )
+		return true;
+
+	CDataFile Fresh;
+
+	Fresh.m_Flags = nFlags;
+	Fresh.m_szFileName = szFileName;
+	Fresh.SetPersistPolicy(PERSIST_NEVER);
+
+	if ( !Fresh.Load(szFileName) )
+		return false;
+
+	CWriteLock Lock(this);
+
+	if ( szFileName != m_szFileName )
+		return false;
+
+	if ( m_bDirty )
+		Report(E_INFO, "[CDataFile::Reload] <%s> changed on disk; reloading it over unsaved changes.",
+			szFileName.c_str());
+
+	if ( !m_Subscriptions.empty() )
+	{
+		std::vector<t_Change> Changes;
+
+		Diff(*this, Fresh, Changes);
+
+		for (size_t i = 0; i < Changes.size(); i++)
+			Notify(Changes[i].Change, Changes[i].szSection, Changes[i].szKey,
+				Changes[i].szOldValue, Changes[i].szNewValue);
+	}
+
+	m_Sections.swap(Fresh.m_Sections);
+	ForgetExpansions();
+	m_bSpansValid = Fresh.m_bSpansValid;
+	m_FileStamp = Fresh.m_FileStamp;
+	m_szSource.swap(Fresh.m_szSource);
+	m_bSourceValid = Fresh.m_bSourceValid;
+	m_bIncludes = Fresh.m_bIncludes;
+	m_bDirty = false;
+
+	unsigned long long nGeneration = m_nVersion.fetch_add(1, std::memory_order_relaxed) + 1;
+
+	for (SectionItor s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+		(*s_pos).nGeneration = nGeneration;
+
+	m_bUnpublished = true;
+	SyncSlots();
+
+	return true;
+}
+
+// ReadWhole
+// Reads a whole file into szData, with a single call.
+static bool ReadWhole(const t_Str &szFileName, t_Str &szData)
+{
+	std::ifstream File(szFileName.c_str(), std::ios::in|std::ios::binary);
+
+	if ( !File.is_open() )
+		return false;
+
+	File.seekg(0, std::ios::end);
+	long long nSize = (long long)File.tellg();
+	File.seekg(0, std::ios::beg);
+
+	szData = t_Str("");
+
+	if ( nSize > 0 )
+	{
+		szData.resize((size_t)nSize);
+		File.read(&szData[0], nSize);
+		szData.resize((size_t)File.gcount());
+	}
+
+	return !File.bad();
+}
+
+// ReloadSections
+// Scans the file for the byte ranges of its sections, and keeps every
+// section whose range hashes the same as it did when the file was last
+// loaded or saved, unless it has been changed since. Only the others are
+// parsed, each on its own, which gives the same result as parsing them
+// along with the rest: a section's range holds all there is to it. Kept
+// sections keep their published snapshot copies, hashes, generations and
+// so on; the data version only moves on if anything did change. Gives up, for the
+// full reload to take over, if the byte ranges we have do not describe the
+// file, if the file has a journal (which may change any section), if a
+// section appears twice, if either version includes other files, or if the
+// file or the data change meanwhile.
+bool cdf::CDataFile::ReloadSections(const t_Str &szFileName, const t_FileStamp &Stamp)
+{
+	t_Str szData;
+	t_FileStamp Read;
+	t_FileStamp Journal;
+	std::vector<t_Span> Spans;
+
+	if ( GetFileStamp(szFileName + ".journal", Journal) )
+		return false;
+
+	if ( !ReadWhole(szFileName, szData) || !GetFileStamp(szFileName, Read) || !(Read == Stamp) )
+		return false;
+
+	if ( !ScanSections(szData.data(), (long long)szData.size(), Spans) )
+		return false;
+
+	// Which sections are still the same, by their place in the list.
+	std::vector<long> Keep(Spans.size(), -1);
+	unsigned long long nVersion;
+	long nFlags;
+
+	{
+		std::shared_lock<CSharedMutex> Lock(m_Mutex);
+
+		if ( !m_bSpansValid || m_bIncludes || m_pJournal || szFileName != m_szFileName )
+			return false;
+
+		std::unordered_map<t_Str, long> Index;
+
+		for (size_t i = 0; i < m_Sections.size(); i++)
+			Index.emplace(LowerCase(m_Sections[i].szName), (long)i);
+
+		for (size_t i = 0; i < Spans.size(); i++)
+		{
+			std::unordered_map<t_Str, long>::iterator pos = Index.find(LowerCase(Spans[i].szName));
+
+			if ( pos == Index.end() )
+				continue;
+
+			const t_Section &Section = m_Sections[pos->second];
+
+			if ( !Section.bDirty && Section.nOffset >= 0 &&
+				 Section.nLength == Spans[i].nLength && Section.nHash == Spans[i].nHash )
+				Keep[i] = pos->second;
+		}
+
+		nVersion = m_nVersion.load(std::memory_order_relaxed);
+		nFlags = m_Flags;
+	}
+
+	// Parse the sections that changed.
+	CDataFile Fresh;
+	SectionList Parsed;
+
+	Fresh.m_Flags = nFlags;
+	Fresh.SetPersistPolicy(PERSIST_NEVER);
+
+	for (size_t i = 0; i < Spans.size(); i++)
+	{
+		if ( Keep[i] >= 0 )
+			continue;
+
+		Fresh.m_Sections.assign(1, t_Section());
+		Fresh.Parse(szData.data() + Spans[i].nOffset, Spans[i].nLength, szFileName);
+
+		t_Section* pSection = Fresh.GetSection(Spans[i].szName);
+
+		if ( pSection == NULL )
+			return false;
+
+		Parsed.push_back(*pSection);
+
+		t_Section &Section = Parsed.back();
+
+		Section.nOffset = Spans[i].nOffset;
+		Section.nLength = Spans[i].nLength;
+		Section.nHash = Spans[i].nHash;
+		Section.bDirty = false;
+		Section.bCommentChanged = false;
+
+		for (KeyItor k_pos = Section.Keys.begin(); k_pos != Section.Keys.end(); k_pos++)
+		{
+			(*k_pos).bValueChanged = false;
+			(*k_pos).bCommentChanged = false;
+		}
+	}
+
+	CWriteLock Lock(this);
+
+	if ( m_nVersion.load(std::memory_order_relaxed) != nVersion || !m_bSpansValid ||
+		 m_pJournal || szFileName != m_szFileName )
+		return false;
+
+	if ( m_bDirty )
+		Report(E_INFO, "[CDataFile::Reload] <%s> changed on disk; reloading it over unsaved changes.",
+			szFileName.c_str());
+
+	// The subscribers hear about the sections that were parsed, and those
+	// that are gone.
+	std::vector<bool> Kept(m_Sections.size(), false);
+
+	for (size_t i = 0; i < Spans.size(); i++)
+	{
+		if ( Keep[i] >= 0 )
+			Kept[Keep[i]] = true;
+	}
+
+	if ( !m_Subscriptions.empty() )
+	{
+		std::vector<t_Change> Changes;
+		SectionList Before;
+
+		for (size_t i = 0; i < m_Sections.size(); i++)
+		{
+			if ( !Kept[i] )
+				Before.push_back(m_Sections[i]);
+		}
+
+		DiffSections(Before, false, Parsed, false, Changes);
+
+		for (size_t i = 0; i < Changes.size(); i++)
+			Notify(Changes[i].Change, Changes[i].szSection, Changes[i].szKey,
+				Changes[i].szOldValue, Changes[i].szNewValue);
+	}
+
+	bool bChanged = Parsed.size() > 0 || Spans.size() != m_Sections.size();
+	unsigned long long nGeneration = m_nVersion.load(std::memory_order_relaxed) + 1;
+	SectionList Sections;
+	size_t nParsed = 0;
+
+	Sections.reserve(Spans.size());
+
+	for (size_t i = 0; i < Spans.size(); i++)
+	{
+		if ( Keep[i] < 0 )
+		{
+			Sections.push_back(std::move(Parsed[nParsed++]));
+			Sections.back().nGeneration = nGeneration;
+			continue;
+		}
+
+		if ( Keep[i] != (long)i )
+			bChanged = true;
+
+		Sections.push_back(std::move(m_Sections[Keep[i]]));
+		Sections.back().nOffset = Spans[i].nOffset;
+	}
+
+	m_Sections.swap(Sections);
+	m_FileStamp = Stamp;
+
+	// The expansions that used the sections parsed, or those that are gone.
+	for (size_t i = 0; i < Spans.size(); i++)
+	{
+		if ( Keep[i] < 0 )
+			Invalidate(Spans[i].szName, t_Str(""));
+	}
+
+	for (size_t i = 0; i < Kept.size(); i++)
+	{
+		if ( !Kept[i] )
+			Invalidate(Sections[i].szName, t_Str(""));
+	}
+
+	m_bSourceValid = (m_Flags & PRESERVE_FORMAT) != 0;
+	if ( m_bSourceValid )
+		m_szSource.swap(szData);
+	else
+		m_szSource = t_Str("");
+	m_bDirty = false;
+
+	if ( bChanged )
+	{
+		m_nVersion.fetch_add(1, std::memory_order_relaxed);
+		m_bUnpublished = true;
+		SyncSlots();
+	}
+
+	return true;
+}
@@ -9,6 +9,9 @@
 #include <stdio.h>
 #include <float.h>	// needed for the FLT_MIN define
 #include <limits.h> // needed for the INT_MIN define
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 #include "CDataFile.h"
 
@@ -179,6 +182,855 @@ void doSomething()
 		WinDF.SectionCount(), WinDF.KeyCount());
 
 	WinDF.Save();
+
+	// The data can also be serialized without going through a file, for
+	// instance to hand it to another process.
+	std::string szBuffer;
+	WinDF.SaveToBuffer(szBuffer);
+
+	cdf::Report(cdf::E_INFO, "[doSomething] The file <win.ini> serializes to %d bytes.",
+		(int)szBuffer.size());
+
+	/// Section Four ///////////////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// In this section, we look at the other ways of getting the data to and
+	// from disk. The examples work on scratch files of their own, which they
+	// remove when they are done.
+	////////////////////////////////////////////////////////////////////////////
+
+	// Save in the background //////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// The persister thread saves the file whenever the data has changed, but
+	// no more than once every 50ms here, so the hundred changes below cost a
+	// save or two rather than a hundred. Flush() saves whatever is left.
+	cdf::CDataFile PersistDF;
+
+	PersistDF.SetFileName("persist.ini");
+	PersistDF.StartPersister(50);
+
+	for (int i = 1; i <= 100; i++)
+		PersistDF.SetInt("counter", i, "", "Demo");
+
+	PersistDF.Flush();
+	PersistDF.StopPersister();
+
+	cdf::CDataFile PersistedDF("persist.ini");
+
+	PersistedDF.GetInt("counter", "Demo", nValue);
+	cdf::Report(cdf::E_INFO, "[doSomething] The persister saved 'counter' as %d.", nValue);
+
+	remove("persist.ini");
+
+	// Leave the saving to someone else ////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// By default the destructor saves unsaved changes, which can take a
+	// while. With PERSIST_HANDOFF it hands them to a background thread and
+	// returns at once; WaitForPendingSaves() waits for that thread to catch
+	// up. With PERSIST_NEVER the changes are simply dropped.
+	{
+		cdf::CDataFile HandOffDF("handoff.ini");
+
+		HandOffDF.SetPersistPolicy(cdf::PERSIST_HANDOFF);
+		HandOffDF.SetInt("counter", 200, "", "Demo");
+	}
+
+	cdf::WaitForPendingSaves();
+
+	{
+		cdf::CDataFile DroppedDF("handoff.ini");
+
+		DroppedDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		DroppedDF.SetInt("counter", 300, "", "Demo");
+	}
+
+	cdf::CDataFile HandedOffDF("handoff.ini");
+
+	HandedOffDF.GetInt("counter", "Demo", nValue);
+	cdf::Report(cdf::E_INFO, "[doSomething] The hand-off thread saved 'counter' as %d.", nValue);
+
+	remove("handoff.ini");
+
+	// Keep the file the way it was written ////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// Normally the data is written out in a standard layout. With
+	// PRESERVE_FORMAT, set before loading, the lines that were not changed
+	// are written back exactly as they were read: spacing, blank lines and
+	// all.
+	std::ifstream TestFile("test.ini", std::ios::binary);
+	std::string szOriginal((std::istreambuf_iterator<char>(TestFile)), std::istreambuf_iterator<char>());
+	cdf::CDataFile PlainDF("test.ini");
+	cdf::CDataFile FormatDF;
+
+	// We only look, so nothing is to be saved when it goes away.
+	FormatDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+	FormatDF.m_Flags |= cdf::PRESERVE_FORMAT;
+	FormatDF.Load("test.ini");
+
+	PlainDF.SaveToBuffer(szBuffer);
+	cdf::Report(cdf::E_INFO, "[doSomething] Without PRESERVE_FORMAT <test.ini> %s.",
+		szBuffer == szOriginal ? "comes back as it was" : "comes back changed");
+
+	FormatDF.SaveToBuffer(szBuffer);
+	cdf::Report(cdf::E_INFO, "[doSomething] With PRESERVE_FORMAT <test.ini> %s.",
+		szBuffer == szOriginal ? "comes back as it was" : "comes back changed");
+
+	// Journal the changes /////////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// With a journal, every change is appended to <file>.journal with a
+	// single write, rather than the whole file being saved; Load() applies
+	// the journal after reading the file. The changes of a transaction (see
+	// CTransaction, below) go in as one group, which is left out as a whole
+	// if a crash cuts it short.
+	{
+		cdf::CDataFile JournalDF;
+
+		JournalDF.SetFileName("journal.ini");
+		JournalDF.SetInt("counter", 1, "", "Demo");
+		JournalDF.EnableJournal(4096);
+		JournalDF.SetInt("counter", 2, "", "Demo");
+
+		cdf::CTransaction Transaction(JournalDF);
+
+		Transaction.SetInt("counter", 3, "", "Demo");
+		Transaction.SetInt("other", 3, "", "Demo");
+		Transaction.Commit();
+	}
+
+	// Cut the last record short, as a crash in the middle of writing it would.
+	std::ifstream JournalIn("journal.ini.journal", std::ios::binary);
+	std::string szJournal((std::istreambuf_iterator<char>(JournalIn)), std::istreambuf_iterator<char>());
+	JournalIn.close();
+
+	std::ofstream JournalOut("journal.ini.journal", std::ios::binary|std::ios::trunc);
+	JournalOut.write(szJournal.data(), szJournal.size() - 2);
+	JournalOut.close();
+
+	{
+		cdf::CDataFile ReplayedDF("journal.ini");
+
+		ReplayedDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		bool bOther = ReplayedDF.HasSection("Demo") && ReplayedDF.GetString("other", "Demo", szBuffer);
+
+		ReplayedDF.GetInt("counter", "Demo", nValue);
+		cdf::Report(cdf::E_INFO, "[doSomething] After the journal was replayed 'counter' is %d, and 'other' %s.",
+			nValue, bOther ? "was set" : "was not set");
+	}
+
+	remove("journal.ini");
+	remove("journal.ini.journal");
+
+	// Save on several threads /////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// A file of many sections can be rendered on several threads at once.
+	// The file written is byte for byte what a single thread would write.
+	{
+		cdf::CDataFile LargeDF;
+		std::string szExpected;
+
+		LargeDF.SetFileName("large.ini");
+		for (int i = 0; i < 2000; i++)
+		{
+			char szSection[32];
+
+			sprintf(szSection, "Section%d", i);
+			LargeDF.SetInt("index", i, "", szSection);
+			LargeDF.SetValue("name", szSection, "; The name of the section", szSection);
+		}
+
+		LargeDF.SaveToBuffer(szExpected);
+		LargeDF.SetSaveThreads(4);
+		LargeDF.Save();
+
+		std::ifstream LargeFile("large.ini", std::ios::binary);
+		std::string szSaved((std::istreambuf_iterator<char>(LargeFile)), std::istreambuf_iterator<char>());
+
+		cdf::Report(cdf::E_INFO, "[doSomething] Saved on 4 threads, <large.ini> is %s.",
+			szSaved == szExpected ? "the same as on one" : "not the same as on one");
+	}
+
+	remove("large.ini");
+
+	// Save and load many files at once ////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// SaveBatch() and LoadBatch() do the opens, reads or writes and closes of
+	// a whole list of files together, in a few rounds of system calls rather
+	// than a few per file.
+	{
+		cdf::CDataFile BatchDF[3];
+		cdf::CDataFile LoadedDF[3];
+		std::vector<cdf::CDataFile*> Saves, Loads;
+		std::vector<std::string> FileNames;
+
+		for (int i = 0; i < 3; i++)
+		{
+			char szFileName[32];
+
+			sprintf(szFileName, "batch%d.ini", i);
+			FileNames.push_back(szFileName);
+
+			BatchDF[i].SetFileName(szFileName);
+			BatchDF[i].SetInt("number", i, "", "Demo");
+			Saves.push_back(&BatchDF[i]);
+
+			LoadedDF[i].SetPersistPolicy(cdf::PERSIST_NEVER);
+			Loads.push_back(&LoadedDF[i]);
+		}
+
+		int nSaved = cdf::CDataFile::SaveBatch(Saves, false);
+		int nLoaded = cdf::CDataFile::LoadBatch(Loads, FileNames);
+
+		LoadedDF[2].GetInt("number", "Demo", nValue);
+		cdf::Report(cdf::E_INFO, "[doSomething] The batch saved %d files and loaded %d; 'number' of the last is %d.",
+			nSaved, nLoaded, nValue);
+	}
+
+	remove("batch0.ini");
+	remove("batch1.ini");
+	remove("batch2.ini");
+
+	// Saving what is allready there ///////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// Save() leaves the file alone if what it would write is what the file
+	// holds allready, so setting keys to the values they have does not
+	// touch the file (or wake up whoever watches it).
+	{
+		cdf::CDataFile UnchangedDF;
+		cdf::t_FileStamp Before, After;
+
+		UnchangedDF.SetFileName("unchanged.ini");
+		UnchangedDF.SetInt("counter", 5, "", "Demo");
+		UnchangedDF.Save();
+		cdf::GetFileStamp("unchanged.ini", Before);
+
+		UnchangedDF.SetInt("counter", 5, "", "Demo");
+		UnchangedDF.Save();
+		cdf::GetFileStamp("unchanged.ini", After);
+
+		cdf::Report(cdf::E_INFO, "[doSomething] Saving the same value again %s <unchanged.ini>.",
+			Before == After ? "left alone" : "rewrote");
+
+		UnchangedDF.SetInt("counter", 60, "", "Demo");
+		UnchangedDF.Save();
+		cdf::GetFileStamp("unchanged.ini", After);
+
+		cdf::Report(cdf::E_INFO, "[doSomething] Saving a new value %s <unchanged.ini>.",
+			Before == After ? "left alone" : "rewrote");
+	}
+
+	remove("unchanged.ini");
+
+	// Save only what changed //////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// With INCREMENTAL_SAVE, Save() only writes the sections that changed.
+	// A section that still fits where it was is patched in place, padded
+	// with a few empty lines. Otherwise the unchanged sections are copied
+	// into a new file, which replaces the old one. A file that someone
+	// else changed meanwhile is saved in full. After every step the file
+	// is read back, and must hold what a plain Save() would have written.
+	{
+		cdf::CDataFile IncrementalDF;
+
+		IncrementalDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		IncrementalDF.SetFileName("incremental.ini");
+		IncrementalDF.SetValue("name", "a name of some considerable length", "", "First");
+		IncrementalDF.SetValue("name", "another name", "", "Second");
+		IncrementalDF.SetValue("name", "yet another name", "", "Third");
+		IncrementalDF.Save();
+		IncrementalDF.m_Flags |= cdf::INCREMENTAL_SAVE;
+
+		auto Check = [&](const char* szStep)
+		{
+			std::string szPlain, szReloaded;
+			cdf::CDataFile ReloadedDF;
+
+			std::ifstream SavedFile("incremental.ini", std::ios::binary);
+			std::string szSaved((std::istreambuf_iterator<char>(SavedFile)), std::istreambuf_iterator<char>());
+
+			ReloadedDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+			ReloadedDF.Load("incremental.ini");
+			ReloadedDF.SaveToBuffer(szReloaded);
+			IncrementalDF.SaveToBuffer(szPlain);
+
+			cdf::Report(cdf::E_INFO, "[doSomething] %s: <incremental.ini> %s, and reads back %s.", szStep,
+				szSaved == szPlain ? "is what a plain Save() writes" : "was padded",
+				szReloaded == szPlain ? "as it should" : "wrong");
+		};
+
+		IncrementalDF.SetValue("name", "a rather shorter name", "", "First");
+		IncrementalDF.Save();
+		Check("Shrunk a little");
+
+		IncrementalDF.SetValue("name", "short", "", "First");
+		IncrementalDF.Save();
+		Check("Shrunk past the padding");
+
+		IncrementalDF.SetValue("name", "a name much longer than the one it replaces", "", "First");
+		IncrementalDF.Save();
+		Check("Grown");
+
+		IncrementalDF.SetValue("name", "a new section", "", "Fourth");
+		IncrementalDF.Save();
+		Check("Section added");
+
+		IncrementalDF.DeleteSection("Second");
+		IncrementalDF.Save();
+		Check("Section deleted");
+
+		std::ofstream OtherOut("incremental.ini", std::ios::app);
+		OtherOut << "\n[Other]\nname=someone else's\n";
+		OtherOut.close();
+
+		IncrementalDF.SetValue("name", "changed again", "", "Third");
+		IncrementalDF.Save();
+		Check("Changed by someone else");
+	}
+
+	remove("incremental.ini");
+
+	/// Section Five ///////////////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// In this section, we share CDataFile objects between threads, and look
+	// at the ways of making readers and writers get in each other's way as
+	// little as possible.
+	////////////////////////////////////////////////////////////////////////////
+
+	// Read while others write /////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// With SetThreadSafe(true) any number of threads may read the data while
+	// another changes it. Here two readers check that the counter they read
+	// never goes back down while the writer counts up.
+	{
+		cdf::CDataFile SharedDF;
+		std::atomic<bool> bWriting(true);
+		std::atomic<bool> bBackwards(false);
+
+		SharedDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		SharedDF.SetThreadSafe(true);
+		SharedDF.SetInt("counter", 0, "", "Demo");
+
+		std::thread Writer([&]()
+		{
+			for (int i = 1; i <= 1000; i++)
+				SharedDF.SetInt("counter", i, "", "Demo");
+			bWriting = false;
+		});
+
+		auto Read = [&]()
+		{
+			int nLast = 0, nRead = 0;
+
+			while ( bWriting )
+			{
+				if ( SharedDF.GetInt("counter", "Demo", nRead) && nRead < nLast )
+					bBackwards = true;
+				nLast = nRead;
+			}
+		};
+
+		std::thread Reader1(Read), Reader2(Read);
+
+		Writer.join();
+		Reader1.join();
+		Reader2.join();
+
+		SharedDF.GetInt("counter", "Demo", nValue);
+		cdf::Report(cdf::E_INFO, "[doSomething] The writer counted to %d; the readers %s.",
+			nValue, bBackwards ? "saw it go back" : "never saw it go back");
+	}
+
+	// Read without locking ////////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// In snapshot mode every change publishes a copy of the data, which a
+	// CSnapshot reads without taking any lock. A snapshot does not change
+	// while it lives: the one taken before the change below still sees the
+	// old value.
+	{
+		cdf::CDataFile SnapshotDF;
+		int nOld = 0, nNew = 0;
+
+		SnapshotDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		SnapshotDF.EnableSnapshots();
+		SnapshotDF.SetInt("counter", 1, "", "Demo");
+
+		cdf::CSnapshot Before(SnapshotDF);
+
+		SnapshotDF.SetInt("counter", 2, "", "Demo");
+
+		cdf::CSnapshot After(SnapshotDF);
+
+		Before.GetInt("counter", "Demo", nOld);
+		After.GetInt("counter", "Demo", nNew);
+		cdf::Report(cdf::E_INFO, "[doSomething] The snapshot taken before the change has 'counter' %d, the one after %d.",
+			nOld, nNew);
+	}
+
+	// Lock sections, not the whole file ///////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// With SetSectionLocking(true) changes to the keys of one section only
+	// lock out the users of that section, so the two threads below, each
+	// with a section of its own, do not wait for each other.
+	{
+		cdf::CDataFile SectionsDF;
+		int nFirst = 0, nSecond = 0;
+
+		SectionsDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		SectionsDF.SetSectionLocking(true);
+		SectionsDF.CreateSection("First", "");
+		SectionsDF.CreateSection("Second", "");
+
+		auto Count = [&](const char* szSection)
+		{
+			for (int i = 1; i <= 1000; i++)
+				SectionsDF.SetInt("counter", i, "", szSection);
+		};
+
+		std::thread First(Count, "First"), Second(Count, "Second");
+
+		First.join();
+		Second.join();
+
+		SectionsDF.GetInt("counter", "First", nFirst);
+		SectionsDF.GetInt("counter", "Second", nSecond);
+		cdf::Report(cdf::E_INFO, "[doSomething] The threads counted to %d in [First] and %d in [Second].",
+			nFirst, nSecond);
+	}
+
+	// Change several keys at once /////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// A CTransaction stages changes and makes them all at once on Commit(),
+	// so readers see none or all of them. If one of them fails, none is
+	// made: deleting a key that does not exist undoes the first one here.
+	{
+		cdf::CDataFile AccountDF;
+		cdf::CTransaction Transfer(AccountDF);
+		int nFrom = 0, nTo = 0;
+
+		AccountDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		AccountDF.SetInt("from", 100, "", "Demo");
+		AccountDF.SetInt("to", 0, "", "Demo");
+
+		Transfer.SetInt("from", 50, "", "Demo");
+		Transfer.DeleteKey("no such key", "Demo");
+		Transfer.SetInt("to", 50, "", "Demo");
+
+		bool bCommitted = Transfer.Commit();
+
+		AccountDF.GetInt("from", "Demo", nFrom);
+		AccountDF.GetInt("to", "Demo", nTo);
+		cdf::Report(cdf::E_INFO, "[doSomething] The transaction %s: 'from' is %d and 'to' is %d.",
+			bCommitted ? "was committed" : "failed", nFrom, nTo);
+
+		Transfer.SetInt("from", 50, "", "Demo");
+		Transfer.SetInt("to", 50, "", "Demo");
+
+		bCommitted = Transfer.Commit();
+
+		AccountDF.GetInt("from", "Demo", nFrom);
+		AccountDF.GetInt("to", "Demo", nTo);
+		cdf::Report(cdf::E_INFO, "[doSomething] The transaction %s: 'from' is %d and 'to' is %d.",
+			bCommitted ? "was committed" : "failed", nFrom, nTo);
+	}
+
+	// Read a key very often ///////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// A key named by a CHotKey is cached by every thread that reads it, as
+	// the type it was read as, until the data changes; reading it again then
+	// costs a table lookup. Create the CHotKey once, not for every read.
+	{
+		static const cdf::CHotKey Port("port", "Demo");
+		cdf::CDataFile HotDF;
+		int nHits = 0;
+
+		HotDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		HotDF.SetInt("port", 8080, "", "Demo");
+
+		for (int i = 0; i < 1000; i++)
+		{
+			HotDF.GetInt(Port, nValue);
+			nHits += nValue == 8080;
+		}
+
+		HotDF.SetInt("port", 8081, "", "Demo");
+		HotDF.GetInt(Port, nValue);
+
+		cdf::Report(cdf::E_INFO, "[doSomething] 'port' was read as 8080 %d times, and as %d after the change.",
+			nHits, nValue);
+	}
+
+	// Queue changes rather than wait for the lock /////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// With the mutation queue running, QueueValue() and QueueInt() return
+	// at once with a ticket, and a thread of the data file's makes the
+	// changes, as many at a time as have piled up. WaitForMutation() waits
+	// for a ticket, and tells whether the change could be made.
+	{
+		cdf::CDataFile QueueDF;
+		int nTotal = 0;
+
+		QueueDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		QueueDF.StartMutationQueue();
+
+		auto Count = [&](int nThread)
+		{
+			char szKey[32];
+			unsigned long long nTicket = 0;
+
+			sprintf(szKey, "thread%d", nThread);
+			for (int i = 1; i <= 250; i++)
+				nTicket = QueueDF.QueueInt(szKey, i, "", "Demo");
+			QueueDF.WaitForMutation(nTicket, -1);
+		};
+
+		std::thread Threads[4] = { std::thread(Count, 0), std::thread(Count, 1),
+			std::thread(Count, 2), std::thread(Count, 3) };
+
+		for (int i = 0; i < 4; i++)
+		{
+			char szKey[32];
+
+			Threads[i].join();
+			sprintf(szKey, "thread%d", i);
+			QueueDF.GetInt(szKey, "Demo", nValue);
+			nTotal += nValue;
+		}
+
+		cdf::Report(cdf::E_INFO, "[doSomething] The queue applied the changes of 4 threads, which add up to %d.",
+			nTotal);
+
+		// Without AUTOCREATE_SECTIONS a change to a missing section fails,
+		// and its ticket says so however often it is asked.
+		QueueDF.m_Flags &= ~cdf::AUTOCREATE_SECTIONS;
+
+		unsigned long long nTicket = QueueDF.QueueInt("counter", 1, "", "No Such Section");
+
+		QueueDF.WaitForMutation(nTicket, -1);
+		cdf::Report(cdf::E_INFO, "[doSomething] The change to a missing section %s.",
+			QueueDF.WaitForMutation(nTicket, -1) ? "was made" : "could not be made");
+
+		// With the queue stopped the change is made on the spot, and the
+		// ticket tells the same.
+		QueueDF.StopMutationQueue();
+		nTicket = QueueDF.QueueInt("counter", 1, "", "No Such Section");
+
+		cdf::Report(cdf::E_INFO, "[doSomething] With the queue stopped, the change %s.",
+			QueueDF.WaitForMutation(nTicket, -1) ? "was made" : "could not be made");
+
+		QueueDF.m_Flags |= cdf::AUTOCREATE_SECTIONS;
+	}
+
+	// Bind a key to a slot ////////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// BindSlot() gives a numeric key a slot the data file keeps up to date
+	// whenever the key changes. Reading the slot takes no lock at all, so a
+	// thread can poll it as it would a plain variable.
+	{
+		cdf::CDataFile SlotDF;
+		int nBefore = 0;
+
+		SlotDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		SlotDF.SetInt("timeout", 30, "", "Demo");
+
+		const cdf::CSlot* pTimeout = SlotDF.BindSlot("timeout", "Demo");
+
+		pTimeout->GetInt(nBefore);
+		SlotDF.SetInt("timeout", 60, "", "Demo");
+		pTimeout->GetInt(nValue);
+
+		cdf::Report(cdf::E_INFO, "[doSomething] The slot of 'timeout' held %d, and %d after the change.",
+			nBefore, nValue);
+	}
+
+	// Create keys where SetValue() would not //////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// Without AUTOCREATE_KEYS, SetValue() only changes keys that exist, while
+	// CreateKey() creates them anyway. It does so without touching m_Flags,
+	// which other threads may be reading meanwhile.
+	{
+		cdf::CDataFile StrictDF;
+
+		StrictDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		StrictDF.m_Flags = 0;
+		StrictDF.CreateSection("Demo", "");
+
+		bool bSet = StrictDF.SetValue("name", "set", "", "Demo");
+		bool bCreated = StrictDF.CreateKey("name", "created", "", "Demo");
+
+		cdf::Report(cdf::E_INFO, "[doSomething] Without AUTOCREATE_KEYS SetValue() %s the key, CreateKey() %s it, and m_Flags is still %ld.",
+			bSet ? "created" : "did not create", bCreated ? "created" : "did not create", StrictDF.m_Flags);
+	}
+
+	/// Section Six ////////////////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// In this section, we keep up with changes: to the file, made by someone
+	// else, and to the data, made by us.
+	////////////////////////////////////////////////////////////////////////////
+
+	// Reload the file when it changes /////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// The watcher thread reloads the file whenever someone else changes it,
+	// once it has been left alone for 20ms here. We wait (for a second at
+	// most) for it to notice the change another data file saves.
+	{
+		cdf::CDataFile WriterDF;
+
+		WriterDF.SetFileName("watched.ini");
+		WriterDF.SetInt("counter", 1, "", "Demo");
+		WriterDF.Save();
+
+		cdf::CDataFile WatchedDF("watched.ini");
+
+		// We read while the watcher may be reloading.
+		WatchedDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		WatchedDF.SetThreadSafe(true);
+		WatchedDF.StartWatcher(20);
+
+		WriterDF.SetInt("counter", 22, "", "Demo");
+		WriterDF.Save();
+
+		for (int i = 0; i < 100; i++)
+		{
+			if ( WatchedDF.GetInt("counter", "Demo", nValue) && nValue == 22 )
+				break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+
+		WatchedDF.StopWatcher();
+		cdf::Report(cdf::E_INFO, "[doSomething] The watcher reloaded <watched.ini>: 'counter' is %d.", nValue);
+	}
+
+	remove("watched.ini");
+
+	// Compare two files ///////////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// Diff() lists what was added, removed or modified to make one data file
+	// into another. Sections that were added or removed as a whole are
+	// listed without their keys.
+	{
+		cdf::CDataFile OldDF, NewDF;
+		std::vector<cdf::t_Change> Changes;
+		const char* szKinds[] = { "added", "removed", "modified" };
+
+		OldDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		OldDF.SetInt("port", 80, "", "Server");
+		OldDF.SetValue("host", "localhost", "", "Server");
+		OldDF.SetValue("level", "debug", "", "Logging");
+
+		NewDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		NewDF.SetInt("port", 8080, "", "Server");
+		NewDF.SetValue("host", "localhost", "", "Server");
+		NewDF.SetInt("threads", 4, "", "Server");
+
+		size_t nChanges = cdf::CDataFile::Diff(OldDF, NewDF, Changes);
+
+		cdf::Report(cdf::E_INFO, "[doSomething] The files differ in %d places.", (int)nChanges);
+
+		for (size_t i = 0; i < Changes.size(); i++)
+		{
+			cdf::Report(cdf::E_INFO, "[doSomething] [%s] %s was %s: '%s' -> '%s'.",
+				Changes[i].szSection.c_str(),
+				Changes[i].szKey.size() > 0 ? Changes[i].szKey.c_str() : "the section",
+				szKinds[Changes[i].Change],
+				Changes[i].szOldValue.c_str(), Changes[i].szNewValue.c_str());
+		}
+	}
+
+	// Be told about changes ///////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// An observer subscribed to a key (or a section, or the keys starting
+	// with a prefix) is called with the changes once per commit: once for
+	// the SetInt() below, and once for both changes of the transaction.
+	{
+		cdf::CDataFile ObservedDF;
+		cdf::CTransaction Transaction(ObservedDF);
+		int nCalls = 0;
+		int nChanges = 0;
+
+		ObservedDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		ObservedDF.CreateSection("Server", "");
+
+		unsigned long long nId = ObservedDF.SubscribeSection("Server",
+			[&](const std::vector<cdf::t_Change> &Changes)
+			{
+				nCalls++;
+				nChanges += (int)Changes.size();
+			});
+
+		ObservedDF.SetInt("port", 80, "", "Server");
+		ObservedDF.SetValue("level", "debug", "", "Logging");
+
+		Transaction.SetInt("port", 8080, "", "Server");
+		Transaction.SetInt("threads", 4, "", "Server");
+		Transaction.Commit();
+
+		ObservedDF.Unsubscribe(nId);
+		ObservedDF.SetInt("port", 80, "", "Server");
+
+		cdf::Report(cdf::E_INFO, "[doSomething] The observer of [Server] was called %d times, with %d changes.",
+			nCalls, nChanges);
+	}
+
+	// Reload only what changed ////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// Reload() loads the file again if it changed, but only parses the
+	// sections whose bytes changed; the others are kept as they are, and so
+	// is the generation they were last changed in.
+	{
+		cdf::CDataFile WriterDF;
+
+		WriterDF.SetFileName("reload.ini");
+		WriterDF.SetInt("counter", 1, "", "First");
+		WriterDF.SetInt("counter", 1, "", "Second");
+		WriterDF.Save();
+
+		cdf::CDataFile ReloadDF("reload.ini");
+
+		ReloadDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+
+		unsigned long long nFirst = ReloadDF.SectionGeneration("First");
+		unsigned long long nSecond = ReloadDF.SectionGeneration("Second");
+
+		WriterDF.SetInt("counter", 22, "", "Second");
+		WriterDF.Save();
+
+		bool bReloaded = ReloadDF.Reload();
+
+		ReloadDF.GetInt("counter", "Second", nValue);
+		cdf::Report(cdf::E_INFO, "[doSomething] <reload.ini> was %s: [First] %s, [Second] %s and its 'counter' is %d.",
+			bReloaded ? "reloaded" : "not reloaded",
+			ReloadDF.SectionGeneration("First") == nFirst ? "was kept" : "was parsed again",
+			ReloadDF.SectionGeneration("Second") == nSecond ? "was kept" : "was parsed again",
+			nValue);
+	}
+
+	remove("reload.ini");
+
+	// Tell whether anything changed ///////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// Generation() goes up with every change and takes no lock, so a value
+	// worked out from the data need only be worked out again when it moved.
+	// Of the thousand reads below, only those after a change do any work.
+	{
+		cdf::CDataFile CachedDF;
+		unsigned long long nCachedAt = 0;
+		int nRefreshes = 0;
+
+		CachedDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		CachedDF.SetInt("limit", 10, "", "Demo");
+
+		for (int i = 0; i < 1000; i++)
+		{
+			if ( i == 500 )
+				CachedDF.SetInt("limit", 20, "", "Demo");
+
+			if ( CachedDF.Generation() != nCachedAt )
+			{
+				nCachedAt = CachedDF.Generation();
+				CachedDF.GetInt("limit", "Demo", nValue);
+				nRefreshes++;
+			}
+		}
+
+		cdf::Report(cdf::E_INFO, "[doSomething] 'limit' was read %d times in 1000 uses, and is %d.",
+			nRefreshes, nValue);
+	}
+
+	/// Section Seven //////////////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// In this section, we put settings together from more than one file, or
+	// more than one key.
+	////////////////////////////////////////////////////////////////////////////
+
+	// Include another file ////////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// A '!include <file>' line pulls in the sections and keys of that file.
+	// Keys the including file sets itself win over included ones, and the
+	// included keys are not saved with it: only the line is.
+	{
+		cdf::CDataFile BaseDF;
+
+		BaseDF.SetFileName("base.ini");
+		BaseDF.SetInt("port", 80, "", "Server");
+		BaseDF.SetValue("host", "localhost", "", "Server");
+		BaseDF.Save();
+
+		std::ofstream SiteOut("site.ini");
+		SiteOut << "!include base.ini\n[Server]\nport=8080\n";
+		SiteOut.close();
+
+		cdf::CDataFile SiteDF("site.ini");
+
+		SiteDF.GetInt("port", "Server", nValue);
+		SiteDF.GetValue("host", "Server", szBuffer);
+		SiteDF.SetBool("verbose", true, "", "Server");
+		SiteDF.Save();
+
+		std::ifstream SiteIn("site.ini", std::ios::binary);
+		std::string szSite((std::istreambuf_iterator<char>(SiteIn)), std::istreambuf_iterator<char>());
+
+		cdf::Report(cdf::E_INFO, "[doSomething] <site.ini> has 'port' %d and 'host' '%s', which it %s.",
+			nValue, szBuffer.c_str(),
+			szSite.find("localhost") == std::string::npos ? "does not save" : "saves");
+	}
+
+	remove("base.ini");
+	remove("site.ini");
+
+	// Stack files on top of each other ////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// A CLayeredDataFile reads a stack of data files as one, every key taking
+	// the value of the topmost file that has it. Nothing is copied: a change
+	// to any of the files shows through on the next read.
+	{
+		cdf::CDataFile DefaultsDF, HostDF;
+		cdf::CLayeredDataFile Settings;
+
+		DefaultsDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		DefaultsDF.SetInt("port", 80, "", "Server");
+		DefaultsDF.SetValue("host", "localhost", "", "Server");
+
+		HostDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		HostDF.SetValue("host", "example.org", "", "Server");
+
+		Settings.AddLayer(DefaultsDF);
+		Settings.AddLayer(HostDF);
+
+		Settings.GetValue("host", "Server", szBuffer);
+		cdf::Report(cdf::E_INFO, "[doSomething] The layers give 'host' '%s', from layer %d, and 'port' from layer %d.",
+			szBuffer.c_str(), Settings.FindLayer("host", "Server"), Settings.FindLayer("port", "Server"));
+
+		HostDF.SetInt("port", 8080, "", "Server");
+
+		Settings.GetInt("port", "Server", nValue);
+		cdf::Report(cdf::E_INFO, "[doSomething] Once the top layer sets it, 'port' is %d, from layer %d.",
+			nValue, Settings.FindLayer("port", "Server"));
+	}
+
+	// Refer to other keys /////////////////////////////////////////////////////
+	////////////////////////////////////////////////////////////////////////////
+	// GetExpanded() replaces ${section:key}, or ${key} for a key of the same
+	// section, with the expanded value of that key. Expansions are kept until
+	// a key they depend on changes. A key that depends on itself, however
+	// indirectly, is reported rather than expanded.
+	{
+		cdf::CDataFile ExpandDF;
+
+		ExpandDF.SetPersistPolicy(cdf::PERSIST_NEVER);
+		ExpandDF.SetValue("root", "/srv", "", "Paths");
+		ExpandDF.SetValue("logs", "${root}/logs", "", "Paths");
+		ExpandDF.SetValue("file", "${Paths:logs}/server.log", "", "Server");
+
+		ExpandDF.GetExpanded("file", "Server", szBuffer);
+		cdf::Report(cdf::E_INFO, "[doSomething] 'file' expands to '%s'.", szBuffer.c_str());
+
+		ExpandDF.SetValue("root", "/var", "", "Paths");
+		ExpandDF.GetExpanded("file", "Server", szBuffer);
+		cdf::Report(cdf::E_INFO, "[doSomething] Once 'root' changed, 'file' expands to '%s'.", szBuffer.c_str());
+
+		ExpandDF.SetValue("a", "${b}", "", "Cycle");
+		ExpandDF.SetValue("b", "${a}", "", "Cycle");
+		cdf::Report(cdf::E_INFO, "[doSomething] 'a' %s.",
+			ExpandDF.GetExpanded("a", "Cycle", szBuffer) ? "was expanded" : "could not be expanded");
+	}
 }
 
 int main(int argc, char* argv[])